@@ -0,0 +1,81 @@
+// Acceleration structure benchmark.
+// Builds the top level of a scene of 200k spheres as a BVH, a uniform grid and a hashed grid
+// (Scene::setAccel) and traces 200k incoherent rays through it, for spheres spread uniformly
+// over a cube and for the same count packed into a few small clusters far apart.
+
+#define AUTOGRAD_IMPLEMENTATION
+#include "autograd.h"
+#undef AUTOGRAD_IMPLEMENTATION
+
+#include "objects.h"
+#include <chrono>
+#include <cstdio>
+
+static double seconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Best of a few runs, the first one also warms up the caches
+template <typename F>
+static double timeIt(F &&f) {
+  double best = std::numeric_limits<double>::max();
+  for (int run = 0; run < 3; run++) {
+    const double t0 = seconds();
+    f();
+    best = std::min(best, seconds() - t0);
+  }
+  return best;
+}
+
+int main() {
+  const int n = 200000, n_rays = 200000, n_clusters = 20;
+
+  // Uniform: radius ~ spacing / 4 over [-1, 1]^3. Clusters: the same spheres in small
+  // balls scattered over [-10, 10]^3, the rest of the volume empty
+  const Float_t radius = 0.25 * 2 / std::cbrt((Float_t)n);
+  std::vector<Point3f> uniform_centers, clustered_centers, cluster(n_clusters);
+  for (Point3f &c : cluster) c = Point3f(uniform(-10, 10), uniform(-10, 10), uniform(-10, 10));
+  for (int i = 0; i < n; i++) {
+    uniform_centers.emplace_back(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1));
+    const Point3f &c = cluster[i % n_clusters];
+    clustered_centers.emplace_back(c.x + uniform(-0.3, 0.3), c.y + uniform(-0.3, 0.3), c.z + uniform(-0.3, 0.3));
+  }
+
+  printf("%10s %12s %12s %12s %10s\n", "spheres", "accel", "build", "trace", "hits");
+  for (const auto &[name, centers] : {std::make_pair("uniform", &uniform_centers), std::make_pair("clusters", &clustered_centers)}) {
+    Scene scene;
+    const uint32_t material = scene.addMaterial(Material(Direction(0, 0, 0), Direction(0.5, 0.5, 0.5), Direction(0, 0, 0), Direction(0, 0, 0)));
+    for (const Point3f &c : *centers) scene.add(std::make_shared<Sphere>(Point(c.x, c.y, c.z), radius, material));
+
+    // Rays between random points of the scene's bounds
+    const AABB bounds = scene.bounds();
+    const auto random_point = [&](Float_t *p) {
+      for (int a = 0; a < 3; a++) p[a] = uniform(bounds.min[a], bounds.max[a]);
+    };
+    std::vector<FastRay> rays;
+    for (int i = 0; i < n_rays; i++) {
+      Float_t o[3], target[3];
+      random_point(o);
+      random_point(target);
+      const Float_t d[3] = {target[0] - o[0], target[1] - o[1], target[2] - o[2]};
+      const Float_t norm = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+      const Float_t dn[3] = {d[0] / norm, d[1] / norm, d[2] / norm};
+      rays.emplace_back(o, dn);
+    }
+
+    for (const auto &[accel_name, accel] : {std::make_pair("BVH", Accel::BVH), std::make_pair("grid", Accel::Grid),
+                                            std::make_pair("hashed grid", Accel::HashedGrid)}) {
+      scene.setAccel(accel);
+      const double t_build = timeIt([&] { scene.commit(); });
+      size_t hits = 0;
+      const double t_trace = timeIt([&] {
+        hits = 0;
+        for (const FastRay &ray : rays) {
+          RayHit hit;
+          hits += scene.closestHit(ray, hit) != nullptr;
+        }
+      });
+      printf("%10s %12s %10.1fms %10.1fms %10zu\n", name, accel_name, 1e3 * t_build, 1e3 * t_trace, hits);
+    }
+  }
+}
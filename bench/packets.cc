@@ -0,0 +1,108 @@
+// Camera ray packet benchmark.
+// Traces the camera rays of a 512x512 view, as render() generates them, one by one through
+// Scene::closestHit, as one-lane packets and as 4x4 tile packets through Scene::intersect.
+// Two scenes: a single 160k-triangle height field mesh, and 52 instances of a smaller one
+// for the top-level traversal.
+
+#define AUTOGRAD_IMPLEMENTATION
+#include "autograd.h"
+#undef AUTOGRAD_IMPLEMENTATION
+
+#include "mesh.h"
+#include <chrono>
+#include <cstdio>
+
+static double seconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Best of a few runs, the first one also warms up the caches
+template <typename F>
+static double timeIt(F &&f) {
+  double best = std::numeric_limits<double>::max();
+  for (int run = 0; run < 3; run++) {
+    const double t0 = seconds();
+    f();
+    best = std::min(best, seconds() - t0);
+  }
+  return best;
+}
+
+// n x n vertices over [-1, 1]^2 at depth z, bumped towards the camera
+static std::shared_ptr<TriangleMesh> heightField(int n, Float_t z, uint32_t material) {
+  auto mesh = std::make_shared<TriangleMesh>(material);
+  for (int y = 0; y < n; y++)
+    for (int x = 0; x < n; x++)
+      mesh->addVertex(2.0f * x / (n - 1) - 1, 2.0f * y / (n - 1) - 1, z + uniform(-0.05, 0.05));
+  for (int y = 0; y + 1 < n; y++) {
+    for (int x = 0; x + 1 < n; x++) {
+      const uint32_t i = y * n + x;
+      mesh->addTriangle(i, i + 1, i + n);
+      mesh->addTriangle(i + 1, i + n + 1, i + n);
+    }
+  }
+  return mesh;
+}
+
+int main() {
+  const int width = 512, height = 512, tile = 4;
+  const uint32_t material = 0;
+
+  Scene field;
+  field.addMaterial(Material(Direction(0, 0, 0), Direction(0.5, 0.5, 0.5), Direction(0, 0, 0), Direction(0, 0, 0)));
+  field.add(heightField(283, 1, material)); // 2 * 282^2 = 159048 triangles
+  field.commit();
+
+  // 52 copies of a 3042-triangle field on a 8x7 layout with the four corners left out
+  Scene instanced;
+  instanced.addMaterial(Material(Direction(0, 0, 0), Direction(0.5, 0.5, 0.5), Direction(0, 0, 0), Direction(0, 0, 0)));
+  const std::shared_ptr<TriangleMesh> shared = heightField(40, 0, material);
+  for (int i = 0; i < 56; i++) {
+    const int x = i % 8, y = i / 8;
+    if ((x == 0 || x == 7) && (y == 0 || y == 6)) continue;
+    instanced.add(std::make_shared<Instance>(shared, Transform::translate(0.25f * x - 0.875f, 0.28f * y - 0.84f, 0.5f + 0.1f * (i % 3)) *
+                                                         Transform::scale(0.12, 0.12, 0.12)));
+  }
+  instanced.commit();
+
+  // Camera rays in 4x4 tile order, as render() traces them
+  std::vector<FastRay> rays;
+  for (int ty = 0; ty < height; ty += tile) {
+    for (int tx = 0; tx < width; tx += tile) {
+      for (int y = ty; y < ty + tile; y++) {
+        for (int x = tx; x < tx + tile; x++) {
+          const Float_t o[3] = {0, 0, -3};
+          const Float_t d[3] = {1 - 2 * (x + 0.5f) / width, 1 - 2 * (y + 0.5f) / height, 3};
+          rays.emplace_back(o, d);
+        }
+      }
+    }
+  }
+
+  printf("%10s %12s %12s %12s %10s %10s\n", "scene", "single", "1-lane", "4x4", "vs single", "vs 1-lane");
+  for (const auto &[name, scene] : {std::make_pair("160k mesh", &field), std::make_pair("52 inst.", &instanced)}) {
+    size_t hits = 0;
+    const double t_single = timeIt([&] {
+      hits = 0;
+      for (const FastRay &ray : rays) {
+        RayHit hit;
+        hits += scene->closestHit(ray, hit) != nullptr;
+      }
+    });
+    const auto packets = [&](int lanes) {
+      return timeIt([&] {
+        for (size_t first = 0; first < rays.size(); first += lanes) {
+          RayPacket<PACKET_SIZE> packet;
+          for (int i = 0; i < lanes; i++) packet.add(rays[first + i]);
+          packet.prepare();
+          PacketHit hit;
+          scene->intersect(packet, hit);
+        }
+      });
+    };
+    const double t_lane = packets(1), t_tile = packets(tile * tile);
+
+    printf("%10s %11.1fms %11.1fms %11.1fms %9.2fx %9.2fx   (%zu hits)\n", name, 1e3 * t_single, 1e3 * t_lane,
+           1e3 * t_tile, t_single / t_tile, t_lane / t_tile, hits);
+  }
+}
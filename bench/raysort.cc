@@ -0,0 +1,108 @@
+// Secondary ray sorting benchmark.
+// Traces one diffuse-like bounce (uniform directions from the primary hits) of a 512x512
+// image through triangle scenes of increasing size, in generation order and sorted with
+// sortRays, and reports the speedup. The sorted timings include computing the order and
+// gathering the rays into it, as renderWavefront does.
+
+#define AUTOGRAD_IMPLEMENTATION
+#include "autograd.h"
+#undef AUTOGRAD_IMPLEMENTATION
+
+#include "mesh.h"
+#include "raysort.h"
+#include <chrono>
+#include <cstdio>
+
+static double seconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Best of a few runs, the first one also warms up the caches
+template <typename F>
+static double timeIt(F &&f) {
+  double best = std::numeric_limits<double>::max();
+  for (int run = 0; run < 3; run++) {
+    const double t0 = seconds();
+    f();
+    best = std::min(best, seconds() - t0);
+  }
+  return best;
+}
+
+// Box room with n small random triangles floating inside
+static void clutteredRoom(Scene &scene, int n) {
+  const uint32_t material = scene.addMaterial(Material(Direction(0, 0, 0), Direction(0.5, 0.5, 0.5), Direction(0, 0, 0), Direction(0, 0, 0)));
+
+  auto room = std::make_shared<TriangleMesh>(material);
+  for (int corner = 0; corner < 8; corner++)
+    room->addVertex(corner & 1 ? 1 : -1, corner & 2 ? 1 : -1, corner & 4 ? 1 : -1);
+  const uint32_t faces[6][4] = {{0, 1, 3, 2}, {4, 6, 7, 5}, {0, 4, 5, 1}, {2, 3, 7, 6}, {0, 2, 6, 4}, {1, 5, 7, 3}};
+  for (const auto &f : faces) {
+    room->addTriangle(f[0], f[1], f[2]);
+    room->addTriangle(f[0], f[2], f[3]);
+  }
+  scene.add(room);
+
+  // Triangle size shrinks with the count so the room stays about equally cluttered
+  const Float_t size = 0.5 / std::cbrt((Float_t)n);
+  auto clutter = std::make_shared<TriangleMesh>(material);
+  for (int i = 0; i < n; i++) {
+    const Float_t c[3] = {uniform(-0.9, 0.9), uniform(-0.9, 0.9), uniform(-0.9, 0.9)};
+    for (int k = 0; k < 3; k++)
+      clutter->addVertex(c[0] + uniform(-size, size), c[1] + uniform(-size, size), c[2] + uniform(-size, size));
+    clutter->addTriangle(3 * i, 3 * i + 1, 3 * i + 2);
+  }
+  scene.add(clutter);
+  scene.commit();
+}
+
+int main() {
+  const int width = 512, height = 512;
+
+  printf("%10s %10s %12s %12s %10s %8s\n", "triangles", "rays", "unsorted", "sorted", "sort", "speedup");
+  for (const int n : {1000, 10000, 100000, 1000000}) {
+    Scene scene;
+    clutteredRoom(scene, n);
+
+    // Primary rays from a pinhole inside the room
+    std::vector<FastRay> primary;
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        const Float_t o[3] = {0, 0, -0.95};
+        Float_t d[3] = {1 - 2 * (x + 0.5f) / width, 1 - 2 * (y + 0.5f) / height, 1};
+        const Float_t norm = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        for (Float_t &v : d) v /= norm;
+        primary.emplace_back(o, d);
+      }
+    }
+    std::vector<SceneHit> hits;
+    scene.intersect(primary, hits);
+
+    // One bounce in uniformly random directions, in pixel order
+    std::vector<FastRay> secondary;
+    for (size_t i = 0; i < primary.size(); i++) {
+      if (hits[i].object == nullptr) continue;
+      const FastRay &ray = primary[i];
+      const Float_t t = hits[i].hit.t * (1 - 1e-4);
+      const Float_t o[3] = {ray.o[0] + ray.d[0] * t, ray.o[1] + ray.d[1] * t, ray.o[2] + ray.d[2] * t};
+
+      const Float_t z = uniform(-1, 1), phi = uniform(0, 2 * M_PI), r = std::sqrt(1 - z * z);
+      const Float_t d[3] = {r * std::cos(phi), r * std::sin(phi), z};
+      secondary.emplace_back(o, d);
+    }
+
+    std::vector<uint32_t> order;
+    const double t_unsorted = timeIt([&] { scene.intersect(secondary, hits); });
+    const double t_sort = timeIt([&] { sortRays(secondary, scene.bounds(), order); });
+    const double t_sorted = timeIt([&] {
+      sortRays(secondary, scene.bounds(), order);
+      std::vector<FastRay> sorted;
+      sorted.reserve(secondary.size());
+      for (const uint32_t i : order) sorted.push_back(secondary[i]);
+      scene.intersect(sorted, hits);
+    });
+
+    printf("%10d %10zu %11.1fms %11.1fms %8.1fms %7.2fx\n", n + 12, secondary.size(),
+           1e3 * t_unsorted, 1e3 * t_sorted, 1e3 * t_sort, t_unsorted / t_sorted);
+  }
+}
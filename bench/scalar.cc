@@ -0,0 +1,72 @@
+// Scalar type benchmark.
+// The work that moved from ad::Float to plain floats when Vec3 was templated on its scalar
+// type: camera ray generation, the basis around the normal for diffuse sampling and
+// tonemapping, done for every sample of a 512x512 image on Vec3<Float> and on Vec3f.
+// Float builds an autograd node per operation, which is what plain floats save.
+
+#define AUTOGRAD_IMPLEMENTATION
+#include "autograd.h"
+#undef AUTOGRAD_IMPLEMENTATION
+
+#include "rtmath.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+static double seconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Best of a few runs, the first one also warms up the caches
+template <typename F>
+static double timeIt(F &&f) {
+  double best = std::numeric_limits<double>::max();
+  for (int run = 0; run < 3; run++) {
+    const double t0 = seconds();
+    f();
+    best = std::min(best, seconds() - t0);
+  }
+  return best;
+}
+
+// Sum over every sample, so the work can not be optimized away
+template <typename T>
+static double perSample(int width, int height, int spp) {
+  using std::sqrt;
+  const Vec3<T> forward(0, 0, 3), left(-1, 0, 0), up(0, 1, 0);
+  double sum = 0.0;
+  for (int s = 0; s < spp; s++) {
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        // Camera ray through a jittered point of the pixel
+        const Float_t u = (x + uniform(0, 1)) / width, v = (y + uniform(0, 1)) / height;
+        const Ray3<T> ray(Point3<T>(0, 0, -3), forward + left * T(1.0 - 2.0 * u) + up * T(1.0 - 2.0 * v));
+
+        // Basis around the normal of a sphere at the origin and a cosine-distributed direction
+        const Vec3<T> n = (ray.o + ray.d * T(2.5)).normalize();
+        Vec3<T> t;
+        if (std::abs(value_of(n.x)) > std::abs(value_of(n.y))) t = Vec3<T>(-n.z, T(0), n.x) / sqrt(n.x * n.x + n.z * n.z);
+        else t = Vec3<T>(T(0), n.z, -n.y) / sqrt(n.y * n.y + n.z * n.z);
+        const Vec3<T> b = n.cross(t);
+        const Float_t r = std::sqrt(uniform(0, 1)), phi = 2 * M_PI * uniform(0, 1);
+        const Vec3<T> wi = t * T(r * std::cos(phi)) + b * T(r * std::sin(phi)) + n * T(std::sqrt(1 - r * r));
+
+        // Tonemapped value of the sample
+        const T L = wi.y * T(0.5) + T(0.5);
+        sum += std::pow(std::clamp(value_of(L), 0.0f, 1.0f), 1.0f / 2.2f);
+      }
+    }
+  }
+  return sum;
+}
+
+int main() {
+  const int width = 512, height = 512, spp = 1;
+  double sum_float = 0.0, sum_ad = 0.0;
+  const double t_ad = timeIt([&] { sum_ad = perSample<Float>(width, height, spp); });
+  const double t_float = timeIt([&] { sum_float = perSample<float>(width, height, spp); });
+
+  printf("%10s %12s %12s %10s\n", "samples", "Vec3<Float>", "Vec3f", "speedup");
+  printf("%10d %10.1fms %10.1fms %9.2fx   (sums %.1f, %.1f)\n", width * height * spp, 1e3 * t_ad, 1e3 * t_float,
+         t_ad / t_float, sum_ad, sum_float);
+}
@@ -0,0 +1,41 @@
+#include "alias.h"
+
+void AliasTable::build(const std::vector<Float_t> &weights) {
+  bins.clear();
+
+  double total = 0.0;
+  for (const Float_t w : weights) total += std::max(w, 0.0f);
+  sum = total;
+  if (total <= 0) return;
+
+  const size_t n = weights.size();
+  bins.resize(n);
+
+  // Probabilities scaled so the average bin holds exactly 1, split into the bins below and
+  // above it. Each small bin is topped up from a large one, which becomes its alias
+  std::vector<double> scaled(n);
+  std::vector<uint32_t> small, large;
+  for (uint32_t i = 0; i < n; i++) {
+    bins[i].p = std::max(weights[i], 0.0f) / total;
+    scaled[i] = std::max(weights[i], 0.0f) / total * n;
+    (scaled[i] < 1.0 ? small : large).push_back(i);
+  }
+
+  while (!small.empty() && !large.empty()) {
+    const uint32_t s = small.back(), l = large.back();
+    small.pop_back();
+
+    bins[s].q = scaled[s];
+    bins[s].alias = l;
+
+    scaled[l] -= 1.0 - scaled[s];
+    if (scaled[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+
+  // What is left is 1 up to rounding
+  for (const uint32_t i : large) bins[i] = {1.0f, i, bins[i].p};
+  for (const uint32_t i : small) bins[i] = {1.0f, i, bins[i].p};
+}
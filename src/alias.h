@@ -0,0 +1,40 @@
+#pragma once
+
+#include "rtmath.h"
+#include <vector>
+#include <cstdint>
+
+// Walker's alias method (built with Vose's algorithm): draws index i with probability
+// weights[i] / sum(weights) in O(1) from a single uniform number. Each bin keeps its own
+// probability q and an alias, the bin is chosen uniformly and then either kept or swapped
+// for its alias. Building is O(n).
+class AliasTable {
+  public:
+    AliasTable() = default;
+    explicit AliasTable(const std::vector<Float_t> &weights) { build(weights); }
+
+    // Negative weights count as 0. If all are 0 the table is empty
+    void build(const std::vector<Float_t> &weights);
+
+    // u in [0, 1)
+    uint32_t sample(Float_t u) const {
+      const Float_t x = u * bins.size();
+      const uint32_t i = std::min(uint32_t(x), uint32_t(bins.size() - 1));
+      return x - i < bins[i].q ? i : bins[i].alias;
+    }
+    // Probability of sample() returning i
+    Float_t pmf(uint32_t i) const { return bins[i].p; }
+
+    bool empty() const { return bins.empty(); }
+    size_t size() const { return bins.size(); }
+    Float_t total() const { return sum; } // Sum of the weights it was built from
+
+  private:
+    struct Bin {
+      Float_t q;      // Probability of keeping i once bin i is picked
+      uint32_t alias; // Taken otherwise
+      Float_t p;      // weights[i] / sum
+    };
+    std::vector<Bin> bins;
+    Float_t sum = 0;
+};
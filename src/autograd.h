@@ -11,6 +11,7 @@
 
 #include <memory>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 
 #ifndef AUTOGRAD_FLOAT_TYPE
@@ -37,6 +38,10 @@ struct Ctx {
 
 static int _ctx_counter = 0;
 
+// Bumped whenever leaf values are written from outside the graph (Float::update, optimizer
+// steps), so plain-float copies of parameters (BVHs, cached edges) know to refresh
+inline uint64_t param_epoch = 0;
+
 class UnaryBackwardFn : public BackwardFn {
   public:
     explicit UnaryBackwardFn(std::shared_ptr<Ctx> op) : op(op) {
@@ -157,6 +162,7 @@ class Float {
 
     void update(Float_t v) {
       *this->_ctx->value = v;
+      param_epoch++;
     }
 
     void zero_grad() {
@@ -1,59 +1,459 @@
 #pragma once
 
 #include "rtmath.h"
+#include <optional>
+#include <variant>
 
-class BSDF {
-  public:
-    explicit BSDF(const Direction &k_) : k(k_) {}
-    virtual ~BSDF() = default;
+// BSDF lobes are plain structs with evaluate and sample templated on the scalar type. A BSDF
+// holds one of them and dispatches on its type with a switch, so shading does no virtual
+// calls. Sampling returns the direction together with its weight f * cos / pdf, computed in
+// one pass. Sampled directions and pdfs never carry gradients, weights do.
 
-    virtual Direction evaluate(const Direction &wo, const Direction &wi, const Direction &n) const = 0;
-    virtual Direction sample(const Direction &wo, const Direction &n) const = 0;
-    virtual Float_t pdf(const Direction &wo, const Direction &wi, const Direction &n) const = 0;
-    virtual Float_t cosThetaI(const Direction &wi, const Direction &n) const = 0;
+// What kind of scattering a sample comes from
+enum LobeFlags : uint32_t {
+  LOBE_REFLECTION = 1 << 0,
+  LOBE_TRANSMISSION = 1 << 1,
+  LOBE_DIFFUSE = 1 << 2,
+  LOBE_GLOSSY = 1 << 3,
+  LOBE_SPECULAR = 1 << 4, // Dirac delta: evaluate and pdf are 0, only sample reaches it
+};
 
-  public:
-    Direction k;
+template <typename T>
+struct BSDFSample {
+  Vec3<T> wi;     // Sampled incident direction, pointing away from the surface
+  Vec3<T> weight; // f * cos / pdf
+  Float_t pdf;    // Solid angle pdf of wi, for specular lobes the probability of the branch taken
+  uint32_t flags; // LobeFlags
+
+  bool specular() const { return flags & LOBE_SPECULAR; }
 };
 
-class DiffuseBSDF : public BSDF {
-  public:
-    using BSDF::BSDF;
+template <typename T>
+inline Vec3<T> reflect(const Vec3<T> &wo, const Vec3<T> &n) { return wo - n * T(2.0) * n.dot(wo); }
+
+// Refracted direction of wo (pointing towards the surface, n on its side) going from index n1
+// to n2 in wt, false on total internal reflection
+template <typename T>
+inline bool refract(const Vec3<T> &wo, const Vec3<T> &n, const T &n1, const T &n2, Vec3<T> &wt) {
+  using std::sqrt;
+  const T eta = n1 / n2;
+  const T cosThetaI = -n.dot(wo);
+  const T sin2ThetaT = eta * eta * (1.0 - cosThetaI * cosThetaI);
+
+  if (value_of(sin2ThetaT) > 1.0) return false;
+
+  const T cosThetaT = sqrt(1.0 - sin2ThetaT);
+  wt = wo * eta + n * (eta * cosThetaI - cosThetaT);
+  return true;
+}
+
+// Unpolarized Fresnel reflectance of a dielectric interface, for light hitting it at cosThetaI
+// from the side of index n1
+template <typename T>
+inline T fresnelDielectric(const T &cosThetaI, const T &n1, const T &n2) {
+  using std::sqrt;
+  const T eta = n1 / n2;
+  const T sin2ThetaT = eta * eta * (1.0 - cosThetaI * cosThetaI);
+  if (value_of(sin2ThetaT) >= 1.0) return T(1.0); // Total internal reflection
 
-    Direction evaluate(const Direction &, const Direction &, const Direction &) const override { return k * M_1_PI; }
+  const T cosThetaT = sqrt(1.0 - sin2ThetaT);
+  const T rs = (n1 * cosThetaI - n2 * cosThetaT) / (n1 * cosThetaI + n2 * cosThetaT);
+  const T rp = (n2 * cosThetaI - n1 * cosThetaT) / (n2 * cosThetaI + n1 * cosThetaT);
+  return (rs * rs + rp * rp) * 0.5;
+}
 
-    Direction sample(const Direction &, const Direction &n) const override;
+// Fresnel reflectance of a conductor of complex index eta + i kappa, for light hitting it at
+// cosThetaI from a medium of index 1 [PBRT 3, 8.2.1]
+template <typename T>
+inline T fresnelConductor(const T &cosThetaI, const T &eta, const T &kappa) {
+  using std::sqrt;
+  const T cos2 = cosThetaI * cosThetaI, sin2 = 1.0 - cos2;
+  const T eta2 = eta * eta, kappa2 = kappa * kappa;
+  const T t0 = eta2 - kappa2 - sin2;
+  const T a2b2 = sqrt(t0 * t0 + eta2 * kappa2 * 4.0);
+  const T a = sqrt((a2b2 + t0) * 0.5);
+  const T t1 = a2b2 + cos2, t2 = a * cosThetaI * 2.0;
+  const T rs = (t1 - t2) / (t1 + t2);
+  const T t3 = a2b2 * cos2 + sin2 * sin2, t4 = t2 * sin2;
+  const T rp = rs * (t3 - t4) / (t3 + t4);
+  return (rs + rp) * 0.5;
+}
 
-    // Uniform cosine sampling allows this optimization:
-    Float_t pdf(const Direction &, const Direction &, const Direction &) const override { return 1.0; }
-    Float_t cosThetaI(const Direction &, const Direction &) const override { return 1.0; }
+// Orthonormal basis (x, y) around n
+inline void makeBasis(const Vec3f &n, Vec3f &x, Vec3f &y) {
+  if (std::abs(n.x) > std::abs(n.y))
+    x = Vec3f(-n.z, 0, n.x) / std::sqrt(n.x * n.x + n.z * n.z);
+  else
+    x = Vec3f(0, n.z, -n.y) / std::sqrt(n.y * n.y + n.z * n.z);
+  y = n.cross(x);
+}
+
+struct DiffuseBSDF {
+  static constexpr uint32_t flags = LOBE_REFLECTION | LOBE_DIFFUSE;
+  Direction k;
+
+  template <typename T>
+  Vec3<T> evaluate(const Vec3<T> &, const Vec3<T> &, const Vec3<T> &, bool) const { return vec_cast<Vec3<T>>(k) * T(M_1_PI); }
+
+  template <typename T>
+  BSDFSample<T> sample(const Vec3<T> &, const Vec3<T> &n_, bool) const {
+    // Uniform cosine sampling
+    const Float_t theta = std::acos(std::sqrt(1.0 - uniform(0.0, 1.0)));
+    const Float_t phi = 2.0 * M_PI * uniform(0.0, 1.0);
+
+    const Vec3f n(n_);
+    Vec3f x, y;
+    makeBasis(n, x, y);
+
+    // Sample direction in the local coordinate system
+    const Vec3f wi = x * (std::sin(theta) * std::cos(phi)) +
+                     y * (std::sin(theta) * std::sin(phi)) +
+                     n * std::cos(theta);
+    // f * cos / pdf = (k / pi) * cos / (cos / pi)
+    return {Vec3<T>(wi), vec_cast<Vec3<T>>(k), Float_t(std::cos(theta) * M_1_PI), LOBE_REFLECTION | LOBE_DIFFUSE};
+  }
+
+  Float_t pdf(const Vec3f &, const Vec3f &wi, const Vec3f &n, bool) const { return std::max(n.dot(wi), 0.0f) * M_1_PI; }
 };
 
 
-class SpecularBSDF : public BSDF {
-  public:
-    using BSDF::BSDF;
-    
-    Direction evaluate(const Direction &wo, const Direction &wi, const Direction &n) const override;
-    Direction sample(const Direction &wo, const Direction &n) const override;
+struct SpecularBSDF {
+  static constexpr uint32_t flags = LOBE_REFLECTION | LOBE_SPECULAR;
+  Direction k;
+
+  template <typename T>
+  Vec3<T> evaluate(const Vec3<T> &, const Vec3<T> &, const Vec3<T> &, bool) const { return Vec3<T>(0.0f, 0.0f, 0.0f); }
+
+  template <typename T>
+  BSDFSample<T> sample(const Vec3<T> &wo, const Vec3<T> &n, bool) const {
+    return {reflect(-wo, n), vec_cast<Vec3<T>>(k), 1.0f, LOBE_REFLECTION | LOBE_SPECULAR};
+  }
+
+  Float_t pdf(const Vec3f &, const Vec3f &, const Vec3f &, bool) const { return 0.0; }
+};
+
+
+// Rough mirror: GGX (Trowbridge-Reitz) microfacets with height-correlated Smith masking.
+// roughness is the perceptual one, alpha = roughness^2. Directions come from the distribution
+// of visible normals [Heitz 2018]; the weight re-evaluates f with the sampled direction held
+// fixed, so gradients reach both k and roughness. A conductor has a complex index eta + i kappa
+// whose Fresnel term scales f per channel; eta = 0 (the default) leaves f unscaled, k alone
+// then sets the color.
+struct GGXBSDF {
+  static constexpr uint32_t flags = LOBE_REFLECTION | LOBE_GLOSSY;
+  Direction k;
+  Float roughness;
+  Direction eta = Direction(0, 0, 0), kappa = Direction(0, 0, 0);
+
+  template <typename T>
+  Vec3<T> evaluate(const Vec3<T> &wo, const Vec3<T> &wi, const Vec3<T> &n, bool into) const {
+    return evaluate(wo, wi, n, into, scalar_cast<T>(roughness));
+  }
+  // The overloads with a trailing roughness use it instead of the member, e.g. from a texture
+  template <typename T>
+  Vec3<T> evaluate(const Vec3<T> &wo, const Vec3<T> &wi, const Vec3<T> &n, bool, const T &r) const {
+    const T cosO = n.dot(wo), cosI = n.dot(wi);
+    if (value_of(cosO) <= 0 || value_of(cosI) <= 0) return Vec3<T>(0.0f, 0.0f, 0.0f);
+
+    const T a2 = alpha2(r);
+    const Vec3<T> m = (wo + wi).normalize();
+    const T G2 = 1.0 / (1.0 + lambda(cosO, a2) + lambda(cosI, a2));
+    const Vec3<T> f = vec_cast<Vec3<T>>(k) * (D(n.dot(m), a2) * G2 / (4.0 * cosO * cosI));
+    if (!conductor()) return f;
+
+    const T cosH = wo.dot(m);
+    const Vec3<T> e = vec_cast<Vec3<T>>(eta), kp = vec_cast<Vec3<T>>(kappa);
+    return f * Vec3<T>(fresnelConductor(cosH, e.x, kp.x), fresnelConductor(cosH, e.y, kp.y), fresnelConductor(cosH, e.z, kp.z));
+  }
+
+  template <typename T>
+  BSDFSample<T> sample(const Vec3<T> &wo, const Vec3<T> &n, bool into) const {
+    return sample(wo, n, into, scalar_cast<T>(roughness));
+  }
+  template <typename T>
+  BSDFSample<T> sample(const Vec3<T> &wo_, const Vec3<T> &n_, bool into, const T &rough) const {
+    const Vec3f wo(wo_), n(n_);
+    const Vec3f wi = reflect(-wo, sampleNormal(wo, n, alpha(Float_t(value_of(rough)))));
+
+    const Float_t p = pdf(wo, wi, n, into, value_of(rough));
+    if (p <= 0) return {Vec3<T>(wi), Vec3<T>(0.0f, 0.0f, 0.0f), 0.0f, flags};
+
+    const Vec3<T> wi_(wi);
+    return {wi_, evaluate(wo_, wi_, n_, into, rough) * (n_.dot(wi_) * T(1.0 / p)), p, flags};
+  }
+
+  // D(m) * G1(wo) / (4 cos(wo)), the pdf of the visible normal reflected about wo
+  Float_t pdf(const Vec3f &wo, const Vec3f &wi, const Vec3f &n, bool into) const { return pdf(wo, wi, n, into, roughness.value()); }
+  Float_t pdf(const Vec3f &wo, const Vec3f &wi, const Vec3f &n, bool, Float_t r) const {
+    const Float_t cosO = n.dot(wo), cosI = n.dot(wi);
+    if (cosO <= 0 || cosI <= 0) return 0.0;
+
+    const Float_t a2 = alpha2(r);
+    return D(n.dot((wo + wi).normalize()), a2) / ((1 + lambda(cosO, a2)) * 4 * cosO);
+  }
+
+  bool conductor() const { return eta.x.value() > 0 || eta.y.value() > 0 || eta.z.value() > 0; }
+
+  // Microfacet normal m drawn from the normals visible from wo, D(m) G1(wo) max(wo.m, 0) / cos(wo)
+  static Vec3f sampleNormal(const Vec3f &wo, const Vec3f &n, Float_t a) {
+    Vec3f x, y;
+    makeBasis(n, x, y);
+
+    // Stretch wo to the unit roughness configuration and sample a visible normal there
+    const Vec3f vh = Vec3f(a * wo.dot(x), a * wo.dot(y), std::max(wo.dot(n), 0.0f)).normalize();
+    const Float_t lensq = vh.x * vh.x + vh.y * vh.y;
+    const Vec3f t1 = lensq > 0 ? Vec3f(-vh.y, vh.x, 0) / std::sqrt(lensq) : Vec3f(1, 0, 0);
+    const Vec3f t2 = vh.cross(t1);
+
+    const Float_t r = std::sqrt(uniform(0.0, 1.0));
+    const Float_t phi = 2.0 * M_PI * uniform(0.0, 1.0);
+    const Float_t s = 0.5 * (1.0 + vh.z);
+    const Float_t p1 = r * std::cos(phi);
+    const Float_t p2 = (1 - s) * std::sqrt(1 - p1 * p1) + s * r * std::sin(phi);
+    const Vec3f nh = t1 * p1 + t2 * p2 + vh * std::sqrt(std::max(0.0f, 1 - p1 * p1 - p2 * p2));
+
+    // Back to the ellipsoid configuration and to world space
+    const Vec3f ml = Vec3f(a * nh.x, a * nh.y, std::max(nh.z, 0.0f)).normalize();
+    return x * ml.x + y * ml.y + n * ml.z;
+  }
+
+  // alpha of roughness r
+  template <typename T>
+  static T alpha(const T &r) {
+    const T a = r * r;
+    return value_of(a) < 1e-3 ? T(1e-3) : a; // Keeps D finite
+  }
+  template <typename T>
+  static T alpha2(const T &r) { const T a = alpha(r); return a * a; }
 
-    Float_t pdf(const Direction &, const Direction &, const Direction &) const override { return 1.0; }
-    // Optimization by not deviding on evaluate
-    Float_t cosThetaI(const Direction &, const Direction &) const override { return 1.0; }
+  // Normal distribution for a microfacet at cosM from n
+  template <typename T>
+  static T D(const T &cosM, const T &a2) {
+    const T d = cosM * cosM * (a2 - 1.0) + 1.0;
+    return a2 / (d * d * M_PI);
+  }
+  // Smith Lambda, G1 = 1 / (1 + lambda)
+  template <typename T>
+  static T lambda(const T &cos, const T &a2) {
+    using std::sqrt;
+    const T cos2 = cos * cos;
+    return (sqrt(1.0 + a2 * (1.0 - cos2) / cos2) - 1.0) * 0.5;
+  }
 };
 
 
-class RefractiveBSDF : public BSDF {
+// Smooth dielectric (glass, water). n1 is the index outside the object and n2 inside, the
+// side wo is on comes from the hit (SurfaceHit::into). Reflection and transmission are picked
+// in proportion to the exact Fresnel reflectance; the weights keep its gradient, so both
+// indices can be learned.
+struct RefractiveBSDF {
+  static constexpr uint32_t flags = LOBE_REFLECTION | LOBE_TRANSMISSION | LOBE_SPECULAR;
+  Direction k;
+  Float n1, n2;
+
+  template <typename T>
+  Vec3<T> evaluate(const Vec3<T> &, const Vec3<T> &, const Vec3<T> &, bool) const { return Vec3<T>(0.0f, 0.0f, 0.0f); }
+
+  template <typename T>
+  BSDFSample<T> sample(const Vec3<T> &wo, const Vec3<T> &n, bool into) const {
+    const T &ni = scalar_cast<T>(into ? n1 : n2);
+    const T &nt = scalar_cast<T>(into ? n2 : n1);
+
+    const T F = fresnelDielectric(n.dot(wo), ni, nt);
+    const Float_t f = value_of(F);
+
+    // F / f and (1 - F) / (1 - f) are 1 but carry the derivative of the Fresnel term
+    Vec3<T> wt;
+    if (uniform(0.0, 1.0) < f || !refract(-wo, n, ni, nt, wt))
+      return {reflect(-wo, n), vec_cast<Vec3<T>>(k) * (F * T(1.0 / f)), f, LOBE_REFLECTION | LOBE_SPECULAR};
+    return {wt, vec_cast<Vec3<T>>(k) * ((1.0 - F) * T(1.0 / (1.0 - f))), 1 - f, LOBE_TRANSMISSION | LOBE_SPECULAR};
+  }
+
+  Float_t pdf(const Vec3f &, const Vec3f &, const Vec3f &, bool) const { return 0.0; }
+};
+
+
+// Rough dielectric: the GGX microfacets of GGXBSDF, each one a smooth interface between n1
+// (outside) and n2 (inside) [Walter et al. 2007]. A visible normal m is sampled and then
+// reflection or refraction through it, in proportion to the Fresnel reflectance at m. The
+// transmitted f holds the Jacobian |wi.m| / (wi.m + wo.m / eta)^2 of the refracted half vector
+// (eta = nt / ni). Like RefractiveBSDF, radiance is not scaled by (ni / nt)^2
+struct RoughRefractiveBSDF {
+  static constexpr uint32_t flags = LOBE_REFLECTION | LOBE_TRANSMISSION | LOBE_GLOSSY;
+  Direction k;
+  Float roughness;
+  Float n1, n2;
+
+  template <typename T>
+  Vec3<T> evaluate(const Vec3<T> &wo, const Vec3<T> &wi, const Vec3<T> &n, bool into) const {
+    return evaluate(wo, wi, n, into, scalar_cast<T>(roughness));
+  }
+  template <typename T>
+  Vec3<T> evaluate(const Vec3<T> &wo, const Vec3<T> &wi, const Vec3<T> &n, bool into, const T &r) const {
+    const T &ni = scalar_cast<T>(into ? n1 : n2);
+    const T &nt = scalar_cast<T>(into ? n2 : n1);
+    const T cosO = n.dot(wo), cosI = n.dot(wi);
+    Vec3<T> m;
+    if (!halfVector(wo, wi, n, ni / nt, m)) return Vec3<T>(0.0f, 0.0f, 0.0f);
+
+    const T a2 = GGXBSDF::alpha2(r);
+    const T cosOM = wo.dot(m), cosIM = wi.dot(m);
+    const T F = fresnelDielectric(cosOM, ni, nt);
+    const T DG = GGXBSDF::D(n.dot(m), a2) / (1.0 + GGXBSDF::lambda(cosO, a2) + GGXBSDF::lambda(cosI, a2));
+    if (value_of(cosI) > 0) return vec_cast<Vec3<T>>(k) * (F * DG / (4.0 * cosO * cosI));
+
+    // cosIM and cosI are both negative
+    const T denom = cosIM + cosOM * ni / nt;
+    return vec_cast<Vec3<T>>(k) * ((1.0 - F) * DG * cosIM * cosOM / (cosI * cosO * denom * denom));
+  }
+
+  template <typename T>
+  BSDFSample<T> sample(const Vec3<T> &wo, const Vec3<T> &n, bool into) const {
+    return sample(wo, n, into, scalar_cast<T>(roughness));
+  }
+  template <typename T>
+  BSDFSample<T> sample(const Vec3<T> &wo_, const Vec3<T> &n_, bool into, const T &rough) const {
+    const Vec3f wo(wo_), n(n_);
+    const Float_t ni = (into ? n1 : n2).value(), nt = (into ? n2 : n1).value();
+    const Vec3f m = GGXBSDF::sampleNormal(wo, n, GGXBSDF::alpha(Float_t(value_of(rough))));
+
+    // On total internal reflection F is 1 and refract is never reached
+    Vec3f wi;
+    const bool reflected = uniform(0.0, 1.0) < fresnelDielectric(wo.dot(m), ni, nt);
+    if (reflected) wi = reflect(-wo, m);
+    else if (!refract(-wo, m, ni, nt, wi)) wi = reflect(-wo, m);
+    const uint32_t branch = reflected ? LOBE_REFLECTION | LOBE_GLOSSY : LOBE_TRANSMISSION | LOBE_GLOSSY;
+
+    // A direction on the wrong side of the surface for its branch scatters nothing
+    const Float_t cosI = n.dot(wi);
+    const Float_t p = (cosI > 0) == reflected ? pdf(wo, wi, n, into, value_of(rough)) : 0.0f;
+    if (p <= 0) return {Vec3<T>(wi), Vec3<T>(0.0f, 0.0f, 0.0f), 0.0f, branch};
+
+    const Vec3<T> wi_(wi);
+    const T cos = n_.dot(wi_);
+    return {wi_, evaluate(wo_, wi_, n_, into, rough) * ((reflected ? cos : -cos) * T(1.0 / p)), p, branch};
+  }
+
+  // Pdf of the visible normal times the Jacobian of its reflection or refraction, times the
+  // probability of that branch
+  Float_t pdf(const Vec3f &wo, const Vec3f &wi, const Vec3f &n, bool into) const { return pdf(wo, wi, n, into, roughness.value()); }
+  Float_t pdf(const Vec3f &wo, const Vec3f &wi, const Vec3f &n, bool into, Float_t r) const {
+    const Float_t ni = (into ? n1 : n2).value(), nt = (into ? n2 : n1).value();
+    Vec3f m;
+    if (!halfVector(wo, wi, n, ni / nt, m)) return 0.0;
+
+    const Float_t a2 = GGXBSDF::alpha2(r);
+    const Float_t cosO = n.dot(wo), cosOM = wo.dot(m), cosIM = wi.dot(m);
+    const Float_t R = fresnelDielectric(cosOM, ni, nt);
+    const Float_t visible = GGXBSDF::D(n.dot(m), a2) * cosOM / ((1 + GGXBSDF::lambda(cosO, a2)) * cosO);
+    if (n.dot(wi) > 0) return visible * R / (4 * cosOM);
+
+    const Float_t denom = cosIM + cosOM * ni / nt;
+    return visible * (1 - R) * -cosIM / (denom * denom);
+  }
+
+  private:
+    // Microfacet normal m, on the side of n, that takes wo to wi by reflection (same side) or by
+    // refraction with relative index ni / nt. False when there is none: wi along the surface, or
+    // wo or wi behind m
+    template <typename T>
+    static bool halfVector(const Vec3<T> &wo, const Vec3<T> &wi, const Vec3<T> &n, const T &eta, Vec3<T> &m) {
+      const Float_t cosO = value_of(n.dot(wo)), cosI = value_of(n.dot(wi));
+      if (cosO <= 0 || cosI == 0) return false;
+
+      const Vec3<T> h = cosI > 0 ? wo + wi : wo * eta + wi;
+      if (value_of(h.norm_squared()) < 1e-12) return false;
+      m = h.normalize();
+      if (value_of(n.dot(m)) < 0) m = -m;
+      return value_of(wo.dot(m)) > 0 && value_of(wi.dot(m)) * cosI > 0;
+    }
+};
+
+
+class BSDF {
+  public:
+    using Lobe = std::variant<DiffuseBSDF, SpecularBSDF, GGXBSDF, RefractiveBSDF, RoughRefractiveBSDF>;
+
+    template <typename L>
+    BSDF(L lobe_) : lobe(std::move(lobe_)) {}
+
+  private:
+    // One case per alternative of Lobe
+    template <typename F>
+    decltype(auto) dispatch(F &&f) const {
+      static_assert(std::variant_size_v<Lobe> == 5, "BSDF::dispatch needs a case for every lobe");
+      switch (lobe.index()) {
+        case 0: return f(*std::get_if<0>(&lobe));
+        case 1: return f(*std::get_if<1>(&lobe));
+        case 2: return f(*std::get_if<2>(&lobe));
+        case 3: return f(*std::get_if<3>(&lobe));
+        default: return f(*std::get_if<4>(&lobe));
+      }
+    }
+
   public:
-    explicit RefractiveBSDF(const Direction &k_, Float n1_, Float n2_)
-        : BSDF(k_), n1(n1_), n2(n2_) {}
+    // BSDF value f (without the cosine) for light arriving from wi and leaving towards wo
+    template <typename T>
+    Vec3<T> evaluate(const Vec3<T> &wo, const Vec3<T> &wi, const Vec3<T> &n, bool into) const {
+      return dispatch([&](const auto &l) { return l.evaluate(wo, wi, n, into); });
+    }
+    // n is the normal on the side of wo, into tells whether that is the outside of the object
+    template <typename T>
+    BSDFSample<T> sample(const Vec3<T> &wo, const Vec3<T> &n, bool into) const {
+      return dispatch([&](const auto &l) { return l.sample(wo, n, into); });
+    }
+    // Solid angle pdf of sample() returning wi
+    Float_t pdf(const Vec3f &wo, const Vec3f &wi, const Vec3f &n, bool into) const {
+      return dispatch([&](const auto &l) { return l.pdf(wo, wi, n, into); });
+    }
+    // LobeFlags of every sample the lobe can return
+    uint32_t flags() const { return dispatch([](const auto &l) { return l.flags; }); }
+
+    // Albedo of the lobe, it also sets how often the material picks it
+    Direction &albedo() { return std::visit([](auto &l) -> Direction & { return l.k; }, lobe); }
+    const Direction &albedo() const { return std::visit([](const auto &l) -> const Direction & { return l.k; }, lobe); }
+
+    // The lobe if it has type L, nullptr otherwise
+    template <typename L>
+    L *get() { return std::get_if<L>(&lobe); }
+    template <typename L>
+    const L *get() const { return std::get_if<L>(&lobe); }
+
+  private:
+    Lobe lobe;
+};
+
+
+// A material lobe as shaded at one hit: the BSDF, plus the roughness a texture gives a GGX
+// or rough dielectric lobe there (Material::evalRoughness). The roughness reaches the lobe as
+// a scalar of type T, so the lobe is not copied per hit
+template <typename T>
+struct HitBSDF {
+  const BSDF &bsdf;
+  std::optional<T> roughness = std::nullopt; // Replaces the roughness of the lobe if set
 
-    Direction evaluate(const Direction &wo, const Direction &wi, const Direction &n) const override;
-    Direction sample(const Direction &wo, const Direction &n) const override;
-    Float_t pdf(const Direction &, const Direction &, const Direction &) const override { return 1.0; }
-    // Optimization by not deviding on evaluate
-    Float_t cosThetaI(const Direction &, const Direction &) const override { return 1.0; }
+  Vec3<T> evaluate(const Vec3<T> &wo, const Vec3<T> &wi, const Vec3<T> &n, bool into) const {
+    return textured([&](const auto &l) { return l.evaluate(wo, wi, n, into, *roughness); },
+                    [&] { return bsdf.evaluate(wo, wi, n, into); });
+  }
+  BSDFSample<T> sample(const Vec3<T> &wo, const Vec3<T> &n, bool into) const {
+    return textured([&](const auto &l) { return l.sample(wo, n, into, *roughness); },
+                    [&] { return bsdf.sample(wo, n, into); });
+  }
+  Float_t pdf(const Vec3f &wo, const Vec3f &wi, const Vec3f &n, bool into) const {
+    return textured([&](const auto &l) { return l.pdf(wo, wi, n, into, Float_t(value_of(*roughness))); },
+                    [&] { return bsdf.pdf(wo, wi, n, into); });
+  }
+  uint32_t flags() const { return bsdf.flags(); }
 
   private:
-    Float n1, n2;
+    // rough(lobe) for a rough lobe with a textured roughness, plain() otherwise
+    template <typename R, typename P>
+    decltype(auto) textured(R &&rough, P &&plain) const {
+      if (roughness) {
+        if (const GGXBSDF *l = bsdf.get<GGXBSDF>()) return rough(*l);
+        if (const RoughRefractiveBSDF *l = bsdf.get<RoughRefractiveBSDF>()) return rough(*l);
+      }
+      return plain();
+    }
 };
@@ -0,0 +1,389 @@
+#include "bvh.h"
+
+static constexpr int BINS = 12;
+static constexpr int MAX_DEPTH = 60; // Keeps the traversal stack bounded
+
+struct Bin {
+  AABB bounds;
+  uint32_t count = 0;
+};
+
+void BVH::build(const std::vector<AABB> &prim_bounds, uint32_t max_leaf_size) {
+  const uint32_t n = prim_bounds.size();
+
+  nodes.clear();
+  indices.resize(n);
+  for (uint32_t i = 0; i < n; i++) indices[i] = i;
+  if (n == 0) return;
+
+  nodes.reserve(2 * n - 1);
+  nodes.push_back({AABB(), 0, n});
+
+  struct Task { uint32_t node; int depth; };
+  std::vector<Task> stack = {{0, 0}};
+
+  while (!stack.empty()) {
+    const auto [node_idx, depth] = stack.back();
+    stack.pop_back();
+
+    const uint32_t first = nodes[node_idx].left_first;
+    const uint32_t count = nodes[node_idx].count;
+
+    AABB bounds, centroids;
+    for (uint32_t i = first; i < first + count; i++) {
+      const AABB &b = prim_bounds[indices[i]];
+      const Float_t c[3] = {b.centroid(0), b.centroid(1), b.centroid(2)};
+      bounds.extend(b);
+      centroids.extend(c);
+    }
+    nodes[node_idx].bounds = bounds;
+
+    if (count == 1 || depth >= MAX_DEPTH) continue;
+
+    // Find the cheapest split plane among the bin boundaries of every axis
+    int best_axis = -1, best_split = 0;
+    Float_t best_cost = std::numeric_limits<Float_t>::max();
+
+    for (int axis = 0; axis < 3; axis++) {
+      const Float_t extent = centroids.max[axis] - centroids.min[axis];
+      if (extent <= 0) continue;
+
+      Bin bins[BINS];
+      const Float_t scale = BINS / extent;
+      for (uint32_t i = first; i < first + count; i++) {
+        const AABB &b = prim_bounds[indices[i]];
+        const int bin = std::min(BINS - 1, (int)((b.centroid(axis) - centroids.min[axis]) * scale));
+        bins[bin].bounds.extend(b);
+        bins[bin].count++;
+      }
+
+      // Sweep from the right to get the cost of every right-hand side, then from the left
+      Float_t right_area[BINS - 1];
+      uint32_t right_count[BINS - 1];
+      AABB acc;
+      uint32_t acc_count = 0;
+      for (int i = BINS - 1; i > 0; i--) {
+        acc.extend(bins[i].bounds);
+        acc_count += bins[i].count;
+        right_area[i - 1] = acc.area();
+        right_count[i - 1] = acc_count;
+      }
+
+      acc = AABB();
+      acc_count = 0;
+      for (int i = 0; i < BINS - 1; i++) {
+        acc.extend(bins[i].bounds);
+        acc_count += bins[i].count;
+        if (acc_count == 0 || right_count[i] == 0) continue;
+
+        const Float_t cost = acc_count * acc.area() + right_count[i] * right_area[i];
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_split = i;
+        }
+      }
+    }
+
+    // Surface area heuristic: traversal cost 1, intersection cost 1 per primitive
+    const Float_t leaf_cost = count;
+    const Float_t split_cost = 1.0 + best_cost / bounds.area();
+    if (count <= max_leaf_size && (best_axis < 0 || split_cost >= leaf_cost)) continue;
+
+    uint32_t mid;
+    if (best_axis >= 0) {
+      const Float_t extent = centroids.max[best_axis] - centroids.min[best_axis];
+      const Float_t scale = BINS / extent;
+      uint32_t *begin = indices.data() + first;
+      mid = std::partition(begin, begin + count, [&](uint32_t i) {
+        const int bin = std::min(BINS - 1, (int)((prim_bounds[i].centroid(best_axis) - centroids.min[best_axis]) * scale));
+        return bin <= best_split;
+      }) - indices.data();
+    } else {
+      // All centroids coincide, split the range in half so big leaves still get divided
+      mid = first + count / 2;
+    }
+
+    const uint32_t left = nodes.size();
+    nodes.push_back({AABB(), first, mid - first});
+    nodes.push_back({AABB(), mid, first + count - mid});
+    nodes[node_idx].left_first = left;
+    nodes[node_idx].count = 0;
+
+    stack.push_back({left, depth + 1});
+    stack.push_back({left + 1, depth + 1});
+  }
+}
+
+void BVH::refit(const std::vector<AABB> &prim_bounds) {
+  // Children are always stored after their parent
+  for (size_t i = nodes.size(); i-- > 0;) {
+    BVHNode &node = nodes[i];
+    node.bounds = AABB();
+    if (node.isLeaf()) {
+      for (uint32_t j = 0; j < node.count; j++)
+        node.bounds.extend(prim_bounds[indices[node.left_first + j]]);
+    } else {
+      node.bounds.extend(nodes[node.left_first].bounds);
+      node.bounds.extend(nodes[node.left_first + 1].bounds);
+    }
+  }
+}
+
+void QBVH::compress(const BVH &bvh) {
+  nodes.assign(bvh.nodes.size(), QBVHNode());
+  root = bvh.bounds();
+  if (bvh.empty()) return;
+
+  // Top-down, so every child is quantized against the box its parent decodes to
+  std::vector<std::pair<uint32_t, AABB>> stack = {{0, root}};
+  nodes[0] = {{0, 0, 0}, {255, 255, 255}, 0, 0};
+
+  while (!stack.empty()) {
+    const auto [idx, parent_box] = stack.back();
+    stack.pop_back();
+
+    const BVHNode &node = bvh.nodes[idx];
+    if (node.count > std::numeric_limits<uint16_t>::max()) {
+      std::cerr << "BVH leaf too large to compress." << std::endl;
+      exit(1);
+    }
+    nodes[idx].count = node.count;
+    nodes[idx].left_first = node.left_first;
+    if (node.isLeaf()) continue;
+
+    for (uint32_t child = node.left_first; child < node.left_first + 2; child++) {
+      const AABB &box = bvh.nodes[child].bounds;
+      QBVHNode &q = nodes[child];
+
+      for (int a = 0; a < 3; a++) {
+        const Float_t extent = parent_box.max[a] - parent_box.min[a];
+        const Float_t scale = extent > 0 ? 255.0 / extent : 0.0;
+        q.lo[a] = std::clamp<int>(std::floor((box.min[a] - parent_box.min[a]) * scale), 0, 255);
+        q.hi[a] = std::clamp<int>(std::ceil((box.max[a] - parent_box.min[a]) * scale), 0, 255);
+      }
+
+      // Rounding in decode() may still cut a hair off the real box, widen until it does not
+      AABB decoded = q.decode(parent_box);
+      for (int a = 0; a < 3; a++) {
+        while (q.lo[a] > 0 && decoded.min[a] > box.min[a]) {
+          q.lo[a]--;
+          decoded = q.decode(parent_box);
+        }
+        while (q.hi[a] < 255 && decoded.max[a] < box.max[a]) {
+          q.hi[a]++;
+          decoded = q.decode(parent_box);
+        }
+      }
+
+      stack.push_back({child, decoded});
+    }
+  }
+}
+
+void DynamicBVH::build(const std::vector<AABB> &prim_bounds, std::vector<uint32_t> &leaves) {
+  nodes.clear();
+  free_nodes.clear();
+  root = NONE;
+  leaves.assign(prim_bounds.size(), NONE);
+  if (prim_bounds.empty()) return;
+
+  // Same topology as a static SAH tree with one primitive per leaf
+  BVH bvh;
+  bvh.build(prim_bounds, 1);
+
+  nodes.resize(bvh.nodes.size());
+  for (size_t i = 0; i < bvh.nodes.size(); i++) {
+    const BVHNode &src = bvh.nodes[i];
+    DynamicBVHNode &dst = nodes[i];
+    dst.parent = NONE;
+    dst.height = 0;
+    if (src.isLeaf()) {
+      dst.id = bvh.indices[src.left_first];
+      dst.child[0] = dst.child[1] = NONE;
+      leaves[dst.id] = i;
+    } else {
+      dst.id = NONE;
+      dst.child[0] = src.left_first;
+      dst.child[1] = src.left_first + 1;
+    }
+  }
+
+  // Children are stored after their parent, so bounds and heights come out bottom-up
+  for (size_t i = nodes.size(); i-- > 0;) {
+    DynamicBVHNode &node = nodes[i];
+    if (node.isLeaf()) {
+      node.bounds = prim_bounds[node.id];
+    } else {
+      nodes[node.child[0]].parent = nodes[node.child[1]].parent = i;
+      refit(i);
+    }
+  }
+  root = 0;
+
+  // Leaves past the depth limit hold several primitives, the extra ones get their own leaf
+  for (const BVHNode &src : bvh.nodes) {
+    for (uint32_t k = 1; k < src.count; k++) {
+      const uint32_t id = bvh.indices[src.left_first + k];
+      leaves[id] = insert(prim_bounds[id], id);
+    }
+  }
+}
+
+uint32_t DynamicBVH::insert(const AABB &box, uint32_t id) {
+  const uint32_t leaf = allocate();
+  DynamicBVHNode &node = nodes[leaf];
+  node.bounds = box;
+  node.child[0] = node.child[1] = NONE;
+  node.id = id;
+  node.height = 0;
+
+  insertLeaf(leaf);
+  return leaf;
+}
+
+void DynamicBVH::remove(uint32_t leaf) {
+  removeLeaf(leaf);
+  release(leaf);
+}
+
+void DynamicBVH::move(uint32_t leaf, const AABB &box) {
+  removeLeaf(leaf);
+  nodes[leaf].bounds = box;
+  insertLeaf(leaf);
+}
+
+uint32_t DynamicBVH::allocate() {
+  if (free_nodes.empty()) {
+    nodes.emplace_back();
+    return nodes.size() - 1;
+  }
+  const uint32_t node = free_nodes.back();
+  free_nodes.pop_back();
+  return node;
+}
+
+void DynamicBVH::release(uint32_t node) {
+  free_nodes.push_back(node);
+}
+
+void DynamicBVH::insertLeaf(uint32_t leaf) {
+  if (root == NONE) {
+    root = leaf;
+    nodes[leaf].parent = NONE;
+    return;
+  }
+
+  // Walk down to the sibling that adds the least surface area. Going one level deeper
+  // also grows the current node, that growth is inherited by every choice below it.
+  const AABB box = nodes[leaf].bounds;
+  uint32_t sibling = root;
+  while (!nodes[sibling].isLeaf()) {
+    const DynamicBVHNode &node = nodes[sibling];
+    AABB combined = node.bounds;
+    combined.extend(box);
+
+    const Float_t cost = 2.0 * combined.area();
+    const Float_t inheritance = 2.0 * (combined.area() - node.bounds.area());
+
+    Float_t child_cost[2];
+    for (int c = 0; c < 2; c++) {
+      const DynamicBVHNode &child = nodes[node.child[c]];
+      AABB grown = child.bounds;
+      grown.extend(box);
+      child_cost[c] = grown.area() + inheritance - (child.isLeaf() ? 0.0 : child.bounds.area());
+    }
+
+    if (cost < child_cost[0] && cost < child_cost[1]) break;
+    sibling = node.child[child_cost[0] <= child_cost[1] ? 0 : 1];
+  }
+
+  const uint32_t old_parent = nodes[sibling].parent;
+  const uint32_t new_parent = allocate();
+  DynamicBVHNode &parent = nodes[new_parent];
+  parent.parent = old_parent;
+  parent.child[0] = sibling;
+  parent.child[1] = leaf;
+  parent.id = NONE;
+  nodes[sibling].parent = nodes[leaf].parent = new_parent;
+
+  if (old_parent == NONE) root = new_parent;
+  else nodes[old_parent].child[nodes[old_parent].child[0] == sibling ? 0 : 1] = new_parent;
+
+  refitUp(new_parent);
+}
+
+void DynamicBVH::removeLeaf(uint32_t leaf) {
+  if (leaf == root) {
+    root = NONE;
+    return;
+  }
+
+  // The parent goes away and the sibling takes its place
+  const uint32_t parent = nodes[leaf].parent;
+  const uint32_t grandparent = nodes[parent].parent;
+  const uint32_t sibling = nodes[parent].child[nodes[parent].child[0] == leaf ? 1 : 0];
+
+  nodes[sibling].parent = grandparent;
+  if (grandparent == NONE) {
+    root = sibling;
+  } else {
+    nodes[grandparent].child[nodes[grandparent].child[0] == parent ? 0 : 1] = sibling;
+    refitUp(grandparent);
+  }
+  release(parent);
+}
+
+void DynamicBVH::refitUp(uint32_t node) {
+  while (node != NONE) {
+    refit(node);
+    rotate(node);
+    node = nodes[node].parent;
+  }
+}
+
+void DynamicBVH::refit(uint32_t node) {
+  DynamicBVHNode &n = nodes[node];
+  const DynamicBVHNode &left = nodes[n.child[0]], &right = nodes[n.child[1]];
+  n.bounds = left.bounds;
+  n.bounds.extend(right.bounds);
+  n.height = 1 + std::max(left.height, right.height);
+}
+
+// Tries swapping one child of node with a grandchild on the other side, keeping the
+// swap that shrinks the area of the affected child most (Box2D v3's tree rotations).
+void DynamicBVH::rotate(uint32_t node) {
+  if (nodes[node].height < 2) return;
+
+  const uint32_t b = nodes[node].child[0], c = nodes[node].child[1];
+  Float_t best_gain = 0.0;
+  int best_side = -1, best_k = -1;
+
+  for (int side = 0; side < 2; side++) {
+    const uint32_t keep = side == 0 ? b : c;  // Child that would move down
+    const uint32_t inner = side == 0 ? c : b; // Child whose child would move up
+    if (nodes[inner].isLeaf()) continue;
+
+    for (int k = 0; k < 2; k++) {
+      AABB merged = nodes[keep].bounds;
+      merged.extend(nodes[nodes[inner].child[1 - k]].bounds);
+      const Float_t gain = nodes[inner].bounds.area() - merged.area();
+      if (gain > best_gain) {
+        best_gain = gain;
+        best_side = side;
+        best_k = k;
+      }
+    }
+  }
+  if (best_side < 0) return;
+
+  // keep moves into inner's slot k, inner's child k moves up to keep's slot
+  const uint32_t keep = best_side == 0 ? b : c, inner = best_side == 0 ? c : b;
+  const uint32_t up = nodes[inner].child[best_k];
+  nodes[node].child[best_side] = up;
+  nodes[up].parent = node;
+  nodes[inner].child[best_k] = keep;
+  nodes[keep].parent = inner;
+  refit(inner);
+  refit(node);
+}
@@ -0,0 +1,443 @@
+#pragma once
+
+#include "rtmath.h"
+#include <vector>
+#include <cstdint>
+
+struct BVHNode {
+  AABB bounds;
+  uint32_t left_first; // Inner node: index of the left child (right is left + 1). Leaf: first entry in indices
+  uint32_t count;      // Number of primitives, 0 for inner nodes
+
+  bool isLeaf() const { return count > 0; }
+};
+
+// Binary bounding volume hierarchy over primitive bounding boxes, built with binned SAH.
+// It only knows about boxes, primitives are tested through a callback so the same
+// structure serves as top level (objects) and bottom level (triangles of a mesh).
+class BVH {
+  public:
+    void build(const std::vector<AABB> &prim_bounds, uint32_t max_leaf_size = 4);
+    // Recomputes the boxes bottom-up keeping the topology, for primitives that moved a bit
+    void refit(const std::vector<AABB> &prim_bounds);
+
+    bool empty() const { return nodes.empty(); }
+    AABB bounds() const { return empty() ? AABB() : nodes[0].bounds; }
+
+    // Closest-hit traversal, near child first. leaf(node) is called for every visited
+    // leaf and is expected to shrink tmax when it finds a closer hit.
+    template <typename F>
+    void traverse(const FastRay &ray, const Float_t &tmax, F &&leaf) const {
+      if (!empty()) traverse(nodes.data(), ray, tmax, leaf);
+    }
+
+    // Any-hit traversal for shadow rays, stops as soon as leaf(node) reports a hit before tmax
+    template <typename F>
+    bool traverseAny(const FastRay &ray, Float_t tmax, F &&leaf) const {
+      return !empty() && traverseAny(nodes.data(), ray, tmax, leaf);
+    }
+
+    // Same traversals over a node array stored elsewhere (e.g. a mapped cache file)
+    template <typename F>
+    static void traverse(const BVHNode *nodes, const FastRay &ray, const Float_t &tmax, F &&leaf) {
+      Float_t tnear;
+      if (!nodes[0].bounds.intersect(ray, tmax, tnear)) return;
+
+      uint32_t stack[64];
+      int top = 0;
+      stack[top++] = 0;
+
+      while (top > 0) {
+        const uint32_t idx = stack[--top];
+        const BVHNode &node = nodes[idx];
+
+        if (node.isLeaf()) {
+          leaf(idx);
+          continue;
+        }
+
+        Float_t t_left, t_right;
+        const bool hit_left = nodes[node.left_first].bounds.intersect(ray, tmax, t_left);
+        const bool hit_right = nodes[node.left_first + 1].bounds.intersect(ray, tmax, t_right);
+
+        if (hit_left && hit_right) {
+          // Push the far child first so the near one is popped next
+          const bool left_first = t_left <= t_right;
+          stack[top++] = node.left_first + (left_first ? 1 : 0);
+          stack[top++] = node.left_first + (left_first ? 0 : 1);
+        } else if (hit_left) {
+          stack[top++] = node.left_first;
+        } else if (hit_right) {
+          stack[top++] = node.left_first + 1;
+        }
+      }
+    }
+
+    template <typename F>
+    static bool traverseAny(const BVHNode *nodes, const FastRay &ray, Float_t tmax, F &&leaf) {
+      uint32_t stack[64];
+      int top = 0;
+      stack[top++] = 0;
+
+      while (top > 0) {
+        const uint32_t idx = stack[--top];
+        const BVHNode &node = nodes[idx];
+
+        Float_t tnear;
+        if (!node.bounds.intersect(ray, tmax, tnear)) continue;
+
+        if (node.isLeaf()) {
+          if (leaf(idx)) return true;
+          continue;
+        }
+
+        stack[top++] = node.left_first + 1;
+        stack[top++] = node.left_first;
+      }
+      return false;
+    }
+
+    // Packet traversal: one walk for all rays, with the lanes still alive at each node.
+    // Packet is a RayPacket, tmax holds one distance per lane and leaf(node, mask) is
+    // called with the lanes that reached the leaf.
+    template <typename Packet, typename F>
+    static void traversePacket(const BVHNode *nodes, const Packet &packet, const Float_t *tmax, uint32_t active, F &&leaf) {
+      Float_t tnear;
+      active = packet.intersect(nodes[0].bounds, tmax, active, tnear);
+      if (active == 0) return;
+
+      struct Entry { uint32_t node, mask; };
+      Entry stack[64];
+      int top = 0;
+      stack[top++] = {0, active};
+
+      while (top > 0) {
+        const Entry entry = stack[--top];
+        const BVHNode &node = nodes[entry.node];
+
+        if (node.isLeaf()) {
+          leaf(entry.node, entry.mask);
+          continue;
+        }
+
+        Float_t t_left, t_right;
+        const uint32_t left = packet.intersect(nodes[node.left_first].bounds, tmax, entry.mask, t_left);
+        const uint32_t right = packet.intersect(nodes[node.left_first + 1].bounds, tmax, entry.mask, t_right);
+
+        // Near child first, judged by the closest entry over the packet
+        if (left != 0 && right != 0) {
+          const bool left_first = t_left <= t_right;
+          stack[top++] = left_first ? Entry{node.left_first + 1, right} : Entry{node.left_first, left};
+          stack[top++] = left_first ? Entry{node.left_first, left} : Entry{node.left_first + 1, right};
+        } else if (left != 0) {
+          stack[top++] = {node.left_first, left};
+        } else if (right != 0) {
+          stack[top++] = {node.left_first + 1, right};
+        }
+      }
+    }
+
+    // Same traversals, calling fn(prim) for every primitive of a visited leaf
+    template <typename F>
+    void intersect(const FastRay &ray, const Float_t &tmax, F &&fn) const {
+      traverse(ray, tmax, [&](uint32_t idx) {
+        const BVHNode &leaf = nodes[idx];
+        for (uint32_t i = 0; i < leaf.count; i++)
+          fn(indices[leaf.left_first + i]);
+      });
+    }
+
+    template <typename F>
+    bool occluded(const FastRay &ray, Float_t tmax, F &&fn) const {
+      return traverseAny(ray, tmax, [&](uint32_t idx) {
+        const BVHNode &leaf = nodes[idx];
+        for (uint32_t i = 0; i < leaf.count; i++)
+          if (fn(indices[leaf.left_first + i])) return true;
+        return false;
+      });
+    }
+
+  public:
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> indices; // Primitive indices, leaves reference contiguous ranges
+};
+
+// Compressed node, 12 bytes instead of 32. The box is quantized to 8 bits per plane
+// inside the parent's decoded box, rounded outwards so decoding is conservative.
+struct QBVHNode {
+  uint8_t lo[3], hi[3];
+  uint16_t count;      // Number of primitives, 0 for inner nodes
+  uint32_t left_first; // Same meaning as in BVHNode
+
+  bool isLeaf() const { return count > 0; }
+
+  AABB decode(const AABB &parent) const {
+    AABB box;
+    for (int a = 0; a < 3; a++) {
+      const Float_t step = (parent.max[a] - parent.min[a]) * (Float_t)(1.0 / 255.0);
+      box.min[a] = parent.min[a] + lo[a] * step;
+      box.max[a] = parent.min[a] + hi[a] * step;
+    }
+    return box;
+  }
+};
+static_assert(sizeof(QBVHNode) == 12);
+
+// Quantized copy of a BVH (same topology and node numbering) for big meshes, so the
+// top of the hierarchy fits in cache. Only the root box is kept in full precision and
+// every other box is decoded on the way down.
+class QBVH {
+  public:
+    void compress(const BVH &bvh);
+
+    bool empty() const { return nodes.empty(); }
+    AABB bounds() const { return root; }
+
+    // Same contract as BVH::traverse / BVH::traverseAny
+    template <typename F>
+    void traverse(const FastRay &ray, const Float_t &tmax, F &&leaf) const {
+      if (!empty()) traverse(nodes.data(), root, ray, tmax, leaf);
+    }
+
+    template <typename F>
+    bool traverseAny(const FastRay &ray, Float_t tmax, F &&leaf) const {
+      return !empty() && traverseAny(nodes.data(), root, ray, tmax, leaf);
+    }
+
+    template <typename F>
+    static void traverse(const QBVHNode *nodes, const AABB &root, const FastRay &ray, const Float_t &tmax, F &&leaf) {
+      Float_t tnear;
+      if (!root.intersect(ray, tmax, tnear)) return;
+
+      struct Entry { uint32_t node; AABB box; };
+      Entry stack[64];
+      int top = 0;
+      stack[top++] = {0, root};
+
+      while (top > 0) {
+        const Entry entry = stack[--top];
+        const QBVHNode &node = nodes[entry.node];
+
+        if (node.isLeaf()) {
+          leaf(entry.node);
+          continue;
+        }
+
+        const AABB box_left = nodes[node.left_first].decode(entry.box);
+        const AABB box_right = nodes[node.left_first + 1].decode(entry.box);
+
+        Float_t t_left, t_right;
+        const bool hit_left = box_left.intersect(ray, tmax, t_left);
+        const bool hit_right = box_right.intersect(ray, tmax, t_right);
+
+        if (hit_left && hit_right) {
+          if (t_left <= t_right) {
+            stack[top++] = {node.left_first + 1, box_right};
+            stack[top++] = {node.left_first, box_left};
+          } else {
+            stack[top++] = {node.left_first, box_left};
+            stack[top++] = {node.left_first + 1, box_right};
+          }
+        } else if (hit_left) {
+          stack[top++] = {node.left_first, box_left};
+        } else if (hit_right) {
+          stack[top++] = {node.left_first + 1, box_right};
+        }
+      }
+    }
+
+    template <typename F>
+    static bool traverseAny(const QBVHNode *nodes, const AABB &root, const FastRay &ray, Float_t tmax, F &&leaf) {
+      Float_t tnear;
+      if (!root.intersect(ray, tmax, tnear)) return false;
+
+      struct Entry { uint32_t node; AABB box; };
+      Entry stack[64];
+      int top = 0;
+      stack[top++] = {0, root};
+
+      while (top > 0) {
+        const Entry entry = stack[--top];
+        const QBVHNode &node = nodes[entry.node];
+
+        if (node.isLeaf()) {
+          if (leaf(entry.node)) return true;
+          continue;
+        }
+
+        for (uint32_t child = node.left_first; child < node.left_first + 2; child++) {
+          const AABB box = nodes[child].decode(entry.box);
+          if (box.intersect(ray, tmax, tnear)) stack[top++] = {child, box};
+        }
+      }
+      return false;
+    }
+
+  public:
+    AABB root;
+    std::vector<QBVHNode> nodes;
+};
+
+struct DynamicBVHNode {
+  AABB bounds;
+  uint32_t parent;
+  uint32_t child[2]; // Both NONE for leaves
+  uint32_t id;       // Leaf: user ID of the primitive
+  uint32_t height;   // 0 for leaves
+  bool isLeaf() const { return child[0] == std::numeric_limits<uint32_t>::max(); }
+};
+
+// Binary BVH with one primitive per leaf that supports inserting, removing and moving
+// primitives in O(log n) (as in Box2D's dynamic tree): a new leaf goes next to the
+// sibling that grows the total surface area least, and nodes on the way back up are
+// rotated when that lowers their area. build() makes a fresh binned SAH tree.
+class DynamicBVH {
+  public:
+    static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+    // Leaf i holds primitive i; returns the leaf handles in leaves
+    void build(const std::vector<AABB> &prim_bounds, std::vector<uint32_t> &leaves);
+    // Returns a handle that stays valid until the leaf is removed
+    uint32_t insert(const AABB &box, uint32_t id);
+    void remove(uint32_t leaf);
+    void move(uint32_t leaf, const AABB &box);
+
+    bool empty() const { return root == NONE; }
+    AABB bounds() const { return empty() ? AABB() : nodes[root].bounds; }
+
+    // Same contract as BVH::intersect / BVH::occluded, fn gets the leaf IDs
+    template <typename F>
+    void intersect(const FastRay &ray, const Float_t &tmax, F &&fn) const {
+      if (empty()) return;
+
+      Float_t tnear;
+      if (!nodes[root].bounds.intersect(ray, tmax, tnear)) return;
+
+      // A DFS never holds more than height + 1 nodes
+      uint32_t local[128];
+      std::vector<uint32_t> heap;
+      uint32_t *stack = local;
+      if (nodes[root].height >= 127) {
+        heap.resize(nodes[root].height + 1);
+        stack = heap.data();
+      }
+
+      int top = 0;
+      stack[top++] = root;
+      while (top > 0) {
+        const DynamicBVHNode &node = nodes[stack[--top]];
+
+        if (node.isLeaf()) {
+          fn(node.id);
+          continue;
+        }
+
+        Float_t t_left, t_right;
+        const bool hit_left = nodes[node.child[0]].bounds.intersect(ray, tmax, t_left);
+        const bool hit_right = nodes[node.child[1]].bounds.intersect(ray, tmax, t_right);
+
+        if (hit_left && hit_right) {
+          const bool left_first = t_left <= t_right;
+          stack[top++] = node.child[left_first ? 1 : 0];
+          stack[top++] = node.child[left_first ? 0 : 1];
+        } else if (hit_left) {
+          stack[top++] = node.child[0];
+        } else if (hit_right) {
+          stack[top++] = node.child[1];
+        }
+      }
+    }
+
+    // Packet version, see BVH::traversePacket. fn(id, mask) gets the lanes reaching each leaf
+    template <typename Packet, typename F>
+    void intersect(const Packet &packet, const Float_t *tmax, uint32_t active, F &&fn) const {
+      if (empty()) return;
+
+      Float_t tnear;
+      active = packet.intersect(nodes[root].bounds, tmax, active, tnear);
+      if (active == 0) return;
+
+      struct Entry { uint32_t node, mask; };
+      Entry local[128];
+      std::vector<Entry> heap;
+      Entry *stack = local;
+      if (nodes[root].height >= 127) {
+        heap.resize(nodes[root].height + 1);
+        stack = heap.data();
+      }
+
+      int top = 0;
+      stack[top++] = {root, active};
+      while (top > 0) {
+        const Entry entry = stack[--top];
+        const DynamicBVHNode &node = nodes[entry.node];
+
+        if (node.isLeaf()) {
+          fn(node.id, entry.mask);
+          continue;
+        }
+
+        Float_t t_left, t_right;
+        const uint32_t left = packet.intersect(nodes[node.child[0]].bounds, tmax, entry.mask, t_left);
+        const uint32_t right = packet.intersect(nodes[node.child[1]].bounds, tmax, entry.mask, t_right);
+
+        if (left != 0 && right != 0) {
+          const bool left_first = t_left <= t_right;
+          stack[top++] = left_first ? Entry{node.child[1], right} : Entry{node.child[0], left};
+          stack[top++] = left_first ? Entry{node.child[0], left} : Entry{node.child[1], right};
+        } else if (left != 0) {
+          stack[top++] = {node.child[0], left};
+        } else if (right != 0) {
+          stack[top++] = {node.child[1], right};
+        }
+      }
+    }
+
+    template <typename F>
+    bool occluded(const FastRay &ray, Float_t tmax, F &&fn) const {
+      if (empty()) return false;
+
+      uint32_t local[128];
+      std::vector<uint32_t> heap;
+      uint32_t *stack = local;
+      if (nodes[root].height >= 127) {
+        heap.resize(nodes[root].height + 1);
+        stack = heap.data();
+      }
+
+      int top = 0;
+      stack[top++] = root;
+      while (top > 0) {
+        const DynamicBVHNode &node = nodes[stack[--top]];
+
+        Float_t tnear;
+        if (!node.bounds.intersect(ray, tmax, tnear)) continue;
+
+        if (node.isLeaf()) {
+          if (fn(node.id)) return true;
+          continue;
+        }
+
+        stack[top++] = node.child[1];
+        stack[top++] = node.child[0];
+      }
+      return false;
+    }
+
+  private:
+    uint32_t allocate();
+    void release(uint32_t node);
+    void insertLeaf(uint32_t leaf);
+    void removeLeaf(uint32_t leaf);
+    // Refits (and rotates) every node from node up to the root
+    void refitUp(uint32_t node);
+    void rotate(uint32_t node);
+    void refit(uint32_t node);
+
+  public:
+    std::vector<DynamicBVHNode> nodes; // Pool, released nodes are reused
+    uint32_t root = NONE;
+
+  private:
+    std::vector<uint32_t> free_nodes;
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "bvh.h"
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// On-disk acceleration structure cache.
+// A file is a header followed by raw arrays (nodes, leaf ranges, packets), each starting
+// at a 64-byte boundary so they can be used in place once the file is memory-mapped.
+// The file only stores plain structs, so it is tied to the build (Float_t, SIMD width,
+// struct layout), all recorded in the header and checked on load.
+
+constexpr uint32_t BVH_CACHE_VERSION = 1;
+constexpr size_t BVH_CACHE_ALIGN = 64;
+
+struct BVHCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t float_size;  // sizeof(Float_t)
+  uint32_t node_size;   // sizeof(BVHNode) or sizeof(QBVHNode)
+  uint32_t packet_size; // sizeof(Packet)
+  uint32_t packet_width;
+  uint32_t compressed;
+  uint64_t key;         // Hash of the geometry the hierarchy was built for
+  uint64_t n_prims, n_nodes, n_packets;
+  AABB root;
+};
+
+inline size_t cacheAlign(size_t offset) {
+  return (offset + BVH_CACHE_ALIGN - 1) / BVH_CACHE_ALIGN * BVH_CACHE_ALIGN;
+}
+
+// 64-bit FNV-1a over 8-byte words, the tail is zero-padded
+inline uint64_t hashBytes(const void *data, size_t size, uint64_t hash = 14695981039346656037ull) {
+  const char *bytes = static_cast<const char *>(data);
+  const uint64_t prime = 1099511628211ull;
+
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes + i, 8);
+    hash = (hash ^ word) * prime;
+  }
+  if (i < size) {
+    uint64_t word = 0;
+    std::memcpy(&word, bytes + i, size - i);
+    hash = (hash ^ word) * prime;
+  }
+  return (hash ^ size) * prime;
+}
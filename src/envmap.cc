@@ -0,0 +1,97 @@
+#include "envmap.h"
+#include "texture.h"
+
+EnvironmentMap::EnvironmentMap(int width_, int height_, std::vector<Float_t> rgb)
+    : width(width_), height(height_), values(std::move(rgb)) {
+  if (width <= 0 || height <= 0 || values.size() != size_t(width) * height * 3) {
+    std::cerr << "Environment map size does not match its texels." << std::endl;
+    exit(1);
+  }
+  build();
+}
+
+// Solid angle pdf of a direction at sin(theta) = sin_theta in a texel picked with probability
+// pmf: the point in the texel is uniform in (u, v), and d omega = 2 pi^2 sin(theta) du dv
+static Float_t texelPdf(Float_t pmf, int width, int height, Float_t sin_theta) {
+  if (sin_theta <= 0) return 0.0;
+  return pmf * width * height / (2 * M_PI * M_PI * sin_theta);
+}
+
+bool EnvironmentMap::sample(Vec3f &wi, Float_t &pdf) const {
+  if (rows.empty()) return false;
+
+  const uint32_t i = rows.sample(uniform(0.0, 1.0));
+  const uint32_t j = columns[i].sample(uniform(0.0, 1.0));
+
+  const Float_t theta = M_PI * (i + uniform(0.0, 1.0)) / height;
+  const Float_t phi = 2 * M_PI * (j + uniform(0.0, 1.0)) / width;
+  const Float_t sin_theta = std::sin(theta);
+  wi = Vec3f(sin_theta * std::cos(phi), std::cos(theta), sin_theta * std::sin(phi));
+  pdf = texelPdf(rows.pmf(i) * columns[i].pmf(j), width, height, sin_theta);
+  return pdf > 0;
+}
+
+Float_t EnvironmentMap::pdf(const Vec3f &d) const {
+  if (rows.empty()) return 0.0;
+
+  const uint32_t t = index(d), i = t / width, j = t % width;
+  if (columns[i].empty()) return 0.0;
+  const Float_t sin_theta = std::sqrt(std::max(0.0f, 1 - d.y * d.y));
+  return texelPdf(rows.pmf(i) * columns[i].pmf(j), width, height, sin_theta);
+}
+
+std::vector<Direction> &EnvironmentMap::learnable() {
+  if (texels.empty()) {
+    texels.reserve(size_t(width) * height);
+    for (size_t i = 0; i < size_t(width) * height; i++) {
+      texels.emplace_back(values[3 * i], values[3 * i + 1], values[3 * i + 2]);
+      texels.back().requires_grad(true);
+    }
+  }
+  return texels;
+}
+
+void EnvironmentMap::update() {
+  if (texels.empty()) return;
+  for (size_t i = 0; i < texels.size(); i++) {
+    values[3 * i] = texels[i].x.value();
+    values[3 * i + 1] = texels[i].y.value();
+    values[3 * i + 2] = texels[i].z.value();
+  }
+  build();
+}
+
+void EnvironmentMap::build() {
+  columns.resize(height);
+  std::vector<Float_t> row_weights(height), weights(width);
+  for (int i = 0; i < height; i++) {
+    const Float_t sin_theta = std::sin(M_PI * (i + 0.5) / height);
+    Float_t sum = 0.0;
+    for (int j = 0; j < width; j++) {
+      const Float_t *rgb = &values[3 * (size_t(i) * width + j)];
+      weights[j] = std::max((rgb[0] + rgb[1] + rgb[2]) / 3, 0.0f) * sin_theta;
+      sum += weights[j];
+    }
+    columns[i].build(weights);
+    row_weights[i] = sum;
+  }
+  rows.build(row_weights);
+}
+
+uint32_t EnvironmentMap::index(const Vec3f &d) const {
+  const Float_t norm = d.norm();
+  const Float_t theta = std::acos(std::clamp(d.y / norm, -1.0f, 1.0f));
+  Float_t phi = std::atan2(d.z, d.x);
+  if (phi < 0) phi += 2 * M_PI;
+
+  const int i = std::min(int(theta / M_PI * height), height - 1);
+  const int j = std::min(int(phi / (2 * M_PI) * width), width - 1);
+  return uint32_t(i) * width + j;
+}
+
+std::shared_ptr<EnvironmentMap> loadPFM(const std::string &filename) {
+  int width, height;
+  std::vector<Float_t> rgb;
+  if (!readPFM(filename, width, height, rgb)) return nullptr;
+  return std::make_shared<EnvironmentMap>(width, height, std::move(rgb));
+}
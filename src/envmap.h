@@ -0,0 +1,59 @@
+#pragma once
+
+#include "rtmath.h"
+#include "alias.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// Infinite light around the scene, an HDR image in latitude-longitude layout: row 0 looks
+// straight up (+y), the last one down, and columns go around y starting from +x towards +z.
+// Radiance is constant over each texel.
+//
+// Directions are importance sampled from a piecewise-constant 2D distribution, texel value
+// times the solid angle it covers (sin theta): an alias table picks the row, then one per row
+// picks the column.
+class EnvironmentMap {
+  public:
+    // rgb holds width * height texels, row-major
+    EnvironmentMap(int width_, int height_, std::vector<Float_t> rgb);
+
+    // Radiance arriving along -d, i.e. seen by a ray leaving the scene in direction d
+    template <typename T>
+    Vec3<T> eval(const Vec3f &d) const {
+      const uint32_t i = index(d);
+      if constexpr (std::is_same_v<T, Float>)
+        if (!texels.empty()) return texels[i];
+      return Vec3<T>(values[3 * i], values[3 * i + 1], values[3 * i + 2]);
+    }
+
+    // Direction drawn in proportion to the radiance, and its solid angle pdf. False if the
+    // map is black
+    bool sample(Vec3f &wi, Float_t &pdf) const;
+    // Solid angle pdf of sample() returning d (unit)
+    Float_t pdf(const Vec3f &d) const;
+
+    // Turns the texels into parameters (Floats requiring gradients) and returns them, e.g. for
+    // optimizer.add_param. Until then they are plain floats, a Float per channel is much
+    // bigger than the float it holds
+    std::vector<Direction> &learnable();
+
+    // Reads the texel values back from the parameters and rebuilds the sampling distribution,
+    // if the map is learnable. The scene calls it when parameter values change (ad::param_epoch)
+    void update();
+
+  public:
+    const int width, height;
+
+  private:
+    void build();
+    uint32_t index(const Vec3f &d) const;
+
+    std::vector<Float_t> values;   // r g b per texel, what lookups and sampling read
+    std::vector<Direction> texels; // Parameters, empty unless learnable()
+    AliasTable rows;                 // Over the rows, by their total weight
+    std::vector<AliasTable> columns; // Over the texels of each row
+};
+
+// Environment map from a PFM file (see readPFM), nullptr on failure
+std::shared_ptr<EnvironmentMap> loadPFM(const std::string &filename);
@@ -0,0 +1,104 @@
+#include "grid.h"
+#include <cmath>
+
+static constexpr Float_t CELLS_PER_PRIM = 2.0; // Dense grids, see Wald et al. 2006
+static constexpr int MAX_RES = 1 << 20;        // Hashed grids, keeps the cell coordinates in range
+
+void Grid::build(const std::vector<AABB> &prim_bounds, bool hashed_) {
+  hashed = hashed_;
+  box = AABB();
+  cell_start.clear();
+  prims.clear();
+  if (prim_bounds.empty()) return;
+
+  Float_t mean_size = 0.0;
+  for (const AABB &b : prim_bounds) {
+    box.extend(b);
+    mean_size += std::max({b.max[0] - b.min[0], b.max[1] - b.min[1], b.max[2] - b.min[2]});
+  }
+  mean_size /= prim_bounds.size();
+
+  // Flat scenes still get a thin slab of cells
+  Float_t extent[3];
+  const Float_t max_extent = std::max({box.max[0] - box.min[0], box.max[1] - box.min[1], box.max[2] - box.min[2]});
+  for (int a = 0; a < 3; a++) {
+    extent[a] = std::max(box.max[a] - box.min[a], max_extent * (Float_t)1e-3);
+    if (extent[a] <= 0) extent[a] = 1.0;
+    box.max[a] = box.min[a] + extent[a];
+  }
+
+  if (hashed) {
+    // Cells about the size of a primitive, however big the scene is
+    const Float_t size = mean_size > 0 ? 2 * mean_size : max_extent / std::cbrt((Float_t)prim_bounds.size());
+    for (int a = 0; a < 3; a++) res[a] = std::clamp((int)std::ceil(extent[a] / size), 1, MAX_RES);
+    n_buckets = 1;
+    while (n_buckets < 2 * prim_bounds.size()) n_buckets <<= 1;
+  } else {
+    // About CELLS_PER_PRIM cells per primitive, as close to cubic as the box allows
+    const Float_t per_unit = std::cbrt(CELLS_PER_PRIM * prim_bounds.size() / (extent[0] * extent[1] * extent[2]));
+    for (int a = 0; a < 3; a++) res[a] = std::clamp((int)std::ceil(extent[a] * per_unit), 1, 512);
+    n_buckets = res[0] * res[1] * res[2];
+  }
+
+  for (int a = 0; a < 3; a++) {
+    cell_size[a] = extent[a] / res[a];
+    inv_cell_size[a] = 1.0 / cell_size[a];
+  }
+
+  // Blocks as small as possible while the bitmap stays within about 2n bits
+  occupied.clear();
+  if (hashed) {
+    block_shift = 0;
+    const auto blocks = [&](int a) { return ((res[a] - 1) >> block_shift) + 1; };
+    while ((uint64_t)blocks(0) * blocks(1) * blocks(2) > n_buckets) block_shift++;
+    for (int a = 0; a < 3; a++) block_res[a] = blocks(a);
+    occupied.assign(((uint64_t)block_res[0] * block_res[1] * block_res[2] + 63) / 64, 0);
+  }
+
+  // Cells overlapped by a primitive's box
+  const auto cellRange = [&](const AABB &b, int lo[3], int hi[3]) {
+    for (int a = 0; a < 3; a++) {
+      lo[a] = std::clamp((int)((b.min[a] - box.min[a]) * inv_cell_size[a]), 0, res[a] - 1);
+      hi[a] = std::clamp((int)((b.max[a] - box.min[a]) * inv_cell_size[a]), 0, res[a] - 1);
+    }
+  };
+
+  // In a hashed grid a box covering more cells than there are buckets simply goes into every bucket once
+  const auto forEachBucket = [&](const AABB &b, auto &&f) {
+    int lo[3], hi[3];
+    cellRange(b, lo, hi);
+
+    const uint64_t n = (uint64_t)(hi[0] - lo[0] + 1) * (hi[1] - lo[1] + 1) * (hi[2] - lo[2] + 1);
+    if (hashed && n >= n_buckets) {
+      for (uint32_t i = 0; i < n_buckets; i++) f(i);
+      return;
+    }
+
+    for (int z = lo[2]; z <= hi[2]; z++)
+      for (int y = lo[1]; y <= hi[1]; y++)
+        for (int x = lo[0]; x <= hi[0]; x++) f(bucket(x, y, z));
+  };
+
+  // Count, prefix sum, fill
+  cell_start.assign(n_buckets + 1, 0);
+  for (const AABB &b : prim_bounds)
+    forEachBucket(b, [&](uint32_t i) { cell_start[i + 1]++; });
+  for (uint32_t i = 0; i < n_buckets; i++) cell_start[i + 1] += cell_start[i];
+
+  prims.resize(cell_start[n_buckets]);
+  std::vector<uint32_t> fill(cell_start.begin(), cell_start.end() - 1);
+  for (uint32_t p = 0; p < prim_bounds.size(); p++)
+    forEachBucket(prim_bounds[p], [&](uint32_t i) { prims[fill[i]++] = p; });
+
+  if (!hashed) return;
+  for (const AABB &b : prim_bounds) {
+    int lo[3], hi[3];
+    cellRange(b, lo, hi);
+    for (int z = lo[2] >> block_shift; z <= hi[2] >> block_shift; z++)
+      for (int y = lo[1] >> block_shift; y <= hi[1] >> block_shift; y++)
+        for (int x = lo[0] >> block_shift; x <= hi[0] >> block_shift; x++) {
+          const uint32_t i = (z * block_res[1] + y) * block_res[0] + x;
+          occupied[i >> 6] |= (uint64_t)1 << (i & 63);
+        }
+  }
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "rtmath.h"
+#include <vector>
+#include <cstdint>
+
+// Acceleration structure used by a Scene or SphereSet
+enum class Accel { BVH, Grid, HashedGrid };
+
+// Uniform grid over primitive bounding boxes, traversed with a 3D-DDA (Amanatides & Woo).
+// Every primitive is listed in each cell its box overlaps, and the lists are laid out with
+// two counting passes, so building is O(n) and cheap enough to redo every frame for moving
+// primitives. Works best for many primitives of similar size (particles, sphere clouds).
+// The hashed variant sizes cells after the primitives instead of the scene and keeps only
+// about 2n buckets, cell (x, y, z) going to bucket hash(x, y, z), so sparse scenes do not
+// pay for their empty space in memory. Colliding cells just share a bucket. Rays skip
+// empty space a block of cells at a time, using a bitmap of the blocks that hold anything.
+class Grid {
+  public:
+    void build(const std::vector<AABB> &prim_bounds, bool hashed = false);
+
+    bool empty() const { return prims.empty(); }
+    AABB bounds() const { return box; }
+
+    // Same contract as BVH::intersect: fn(prim) is called for the primitives of every cell
+    // along the ray, front to back, and shrinks tmax when it finds a closer hit
+    template <typename F>
+    void intersect(const FastRay &ray, const Float_t &tmax, F &&fn) const {
+      traverse(ray, tmax, [&](uint32_t bucket, Float_t t_exit) {
+        for (uint32_t i = cell_start[bucket]; i < cell_start[bucket + 1]; i++) fn(prims[i]);
+        return tmax <= t_exit; // A hit inside the current cell is the closest one
+      });
+    }
+
+    template <typename F>
+    bool occluded(const FastRay &ray, Float_t tmax, F &&fn) const {
+      bool hit = false;
+      traverse(ray, tmax, [&](uint32_t bucket, Float_t) {
+        for (uint32_t i = cell_start[bucket]; i < cell_start[bucket + 1] && !hit; i++) hit = fn(prims[i]);
+        return hit;
+      });
+      return hit;
+    }
+
+  private:
+    uint32_t bucket(int x, int y, int z) const {
+      if (!hashed) return (z * res[1] + y) * res[0] + x;
+      return ((uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)z * 83492791u) & (n_buckets - 1);
+    }
+
+    bool blockOccupied(const int c[3]) const {
+      const uint32_t i = ((c[2] >> block_shift) * block_res[1] + (c[1] >> block_shift)) * block_res[0] + (c[0] >> block_shift);
+      return (occupied[i >> 6] >> (i & 63)) & 1;
+    }
+
+    // Walks the cells pierced by the ray before tmax, cell(bucket, t_exit) returns true to stop
+    template <typename F>
+    void traverse(const FastRay &ray, const Float_t &tmax, F &&cell) const {
+      if (empty()) return;
+
+      const Float_t *sides[2] = {box.min, box.max};
+      Float_t t0 = 0.0, t1 = tmax;
+      for (int a = 0; a < 3; a++) {
+        const Float_t tn = (sides[ray.sign[a]][a] - ray.o[a]) * ray.inv_d[a];
+        const Float_t tf = (sides[1 - ray.sign[a]][a] - ray.o[a]) * ray.inv_d[a];
+        t0 = tn > t0 ? tn : t0;
+        t1 = tf < t1 ? tf : t1;
+      }
+      if (t0 > t1) return;
+
+      int c[3], step[3], stop[3];
+      Float_t t_next[3], t_delta[3];
+      for (int a = 0; a < 3; a++) {
+        const Float_t p = ray.o[a] + ray.d[a] * t0;
+        c[a] = std::clamp((int)((p - box.min[a]) * inv_cell_size[a]), 0, res[a] - 1);
+        step[a] = ray.d[a] > 0 ? 1 : (ray.d[a] < 0 ? -1 : 0);
+        stop[a] = step[a] > 0 ? res[a] : -1;
+        t_delta[a] = step[a] != 0 ? cell_size[a] * std::abs(ray.inv_d[a]) : std::numeric_limits<Float_t>::infinity();
+      }
+
+      // Distance to the next cell boundary on each axis from cell c
+      const auto boundaries = [&]() {
+        for (int a = 0; a < 3; a++) {
+          const int edge = c[a] + (step[a] > 0);
+          t_next[a] = step[a] != 0 ? (box.min[a] + edge * cell_size[a] - ray.o[a]) * ray.inv_d[a]
+                                   : std::numeric_limits<Float_t>::infinity();
+        }
+      };
+      boundaries();
+
+      while (true) {
+        if (hashed && !blockOccupied(c)) {
+          // Jump to the cell where the ray leaves this block
+          const int block_size = 1 << block_shift;
+          Float_t t_block[3];
+          for (int a = 0; a < 3; a++) {
+            const int edge = ((c[a] >> block_shift) + (step[a] > 0)) * block_size;
+            t_block[a] = step[a] != 0 ? (box.min[a] + edge * cell_size[a] - ray.o[a]) * ray.inv_d[a]
+                                      : std::numeric_limits<Float_t>::infinity();
+          }
+          const int a = t_block[0] < t_block[1] ? (t_block[0] < t_block[2] ? 0 : 2) : (t_block[1] < t_block[2] ? 1 : 2);
+          if (t_block[a] > tmax) return;
+
+          for (int b = 0; b < 3; b++) {
+            if (b == a) continue;
+            const int lo = (c[b] >> block_shift) * block_size;
+            const Float_t p = ray.o[b] + ray.d[b] * t_block[a];
+            c[b] = std::clamp((int)((p - box.min[b]) * inv_cell_size[b]), lo, std::min(lo + block_size, res[b]) - 1);
+          }
+          c[a] = step[a] > 0 ? ((c[a] >> block_shift) + 1) * block_size : (c[a] >> block_shift) * block_size - 1;
+          if (step[a] > 0 ? c[a] >= res[a] : c[a] < 0) return;
+          boundaries();
+          continue;
+        }
+
+        const int a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+        if (cell(bucket(c[0], c[1], c[2]), t_next[a])) return;
+        if (t_next[a] > tmax) return;
+
+        c[a] += step[a];
+        if (c[a] == stop[a]) return;
+        t_next[a] += t_delta[a];
+      }
+    }
+
+  public:
+    AABB box;
+    int res[3] = {0, 0, 0};
+    Float_t cell_size[3], inv_cell_size[3];
+    bool hashed = false;
+    uint32_t n_buckets = 0;
+    std::vector<uint32_t> cell_start; // Primitives of bucket b are prims[cell_start[b]..cell_start[b + 1])
+    std::vector<uint32_t> prims;
+
+    // Hashed grids: one bit per block of 2^block_shift cells per axis
+    int block_shift = 0;
+    int block_res[3] = {0, 0, 0};
+    std::vector<uint64_t> occupied;
+};
@@ -0,0 +1,91 @@
+#include "lightbvh.h"
+
+void LightBVH::build(const std::vector<Vec3f> &positions, const std::vector<Float_t> &power) {
+  light_power = power;
+  light_bounds.resize(positions.size());
+  for (size_t i = 0; i < positions.size(); i++) {
+    const Float_t p[3] = {positions[i].x, positions[i].y, positions[i].z};
+    light_bounds[i] = AABB();
+    light_bounds[i].extend(p);
+  }
+  bvh.build(light_bounds, 1);
+
+  // Children are stored after their parent, so one reverse pass sums the powers bottom-up
+  node_power.assign(bvh.nodes.size(), 0.0f);
+  for (size_t i = bvh.nodes.size(); i-- > 0;) {
+    const BVHNode &node = bvh.nodes[i];
+    if (node.isLeaf()) {
+      for (uint32_t j = node.left_first; j < node.left_first + node.count; j++)
+        node_power[i] += std::max(light_power[bvh.indices[j]], 0.0f);
+    } else {
+      node_power[i] = node_power[node.left_first] + node_power[node.left_first + 1];
+    }
+  }
+}
+
+Float_t LightBVH::importance(const AABB &bounds, Float_t power, const Vec3f &x, const Vec3f &n) const {
+  if (power <= 0) return 0.0;
+
+  // Nothing in the box can light x if every corner is behind the tangent plane. Without a
+  // normal x sees both sides
+  bool visible = n.norm_squared() == 0;
+  for (int c = 0; c < 8 && !visible; c++) {
+    const Vec3f corner(c & 1 ? bounds.max[0] : bounds.min[0],
+                       c & 2 ? bounds.max[1] : bounds.min[1],
+                       c & 4 ? bounds.max[2] : bounds.min[2]);
+    visible = n.dot(corner - x) > 0;
+  }
+  if (!visible) return 0.0;
+
+  // Squared distance to the center, but no less than the box's own half diagonal squared so
+  // points inside or next to big clusters do not favour them without bound
+  const Vec3f center(bounds.centroid(0), bounds.centroid(1), bounds.centroid(2));
+  const Vec3f half(bounds.max[0] - center.x, bounds.max[1] - center.y, bounds.max[2] - center.z);
+  const Float_t distance_squared = std::max({(center - x).norm_squared(), half.norm_squared(), 1e-8f});
+  return power / distance_squared;
+}
+
+int LightBVH::sample(const Vec3f &x, const Vec3f &n, Float_t u, Float_t &pmf) const {
+  if (empty()) return -1;
+
+  pmf = 1.0;
+  uint32_t idx = 0;
+  while (!bvh.nodes[idx].isLeaf()) {
+    const uint32_t left = bvh.nodes[idx].left_first, right = left + 1;
+    const Float_t il = importance(bvh.nodes[left].bounds, node_power[left], x, n);
+    const Float_t ir = importance(bvh.nodes[right].bounds, node_power[right], x, n);
+    if (il + ir <= 0) return -1;
+
+    // Pick a child and rescale u to [0, 1) for the next decision
+    const Float_t p = il / (il + ir);
+    if (u < p) {
+      u = std::min(u / p, 0.99999994f);
+      pmf *= p;
+      idx = left;
+    } else {
+      u = std::min((u - p) / (1 - p), 0.99999994f);
+      pmf *= 1 - p;
+      idx = right;
+    }
+  }
+
+  // Leaves only hold several lights if they share a position (or the tree hit its depth limit)
+  const BVHNode &leaf = bvh.nodes[idx];
+  Float_t total = 0.0;
+  for (uint32_t j = leaf.left_first; j < leaf.left_first + leaf.count; j++)
+    total += importance(light_bounds[bvh.indices[j]], light_power[bvh.indices[j]], x, n);
+  if (total <= 0) return -1;
+
+  Float_t cdf = 0.0;
+  for (uint32_t j = leaf.left_first; j < leaf.left_first + leaf.count; j++) {
+    const uint32_t i = bvh.indices[j];
+    const Float_t w = importance(light_bounds[i], light_power[i], x, n);
+    cdf += w;
+    if (u * total < cdf || j + 1 == leaf.left_first + leaf.count) {
+      if (w <= 0) return -1;
+      pmf *= w / total;
+      return i;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "bvh.h"
+
+// Spatially aware light selection, after Conty & Kulla's light BVH reduced to point lights.
+// A BVH over the light positions stores the total power below every node. Sampling walks
+// down from the root choosing each child in proportion to its power over the squared
+// distance to its box (0 if the box is entirely behind the surface, unless the surface
+// transmits), so a shading point
+// mostly picks the lights near it and those far away are grouped into few coarse choices.
+class LightBVH {
+  public:
+    void build(const std::vector<Vec3f> &positions, const std::vector<Float_t> &power);
+
+    bool empty() const { return bvh.empty(); }
+
+    // Index of a light for the point x with normal n and its probability, -1 if no light
+    // can reach x. n = (0, 0, 0) takes lights on both sides (transmissive surfaces). u in [0, 1)
+    int sample(const Vec3f &x, const Vec3f &n, Float_t u, Float_t &pmf) const;
+
+  private:
+    Float_t importance(const AABB &bounds, Float_t power, const Vec3f &x, const Vec3f &n) const;
+
+    BVH bvh;
+    std::vector<Float_t> node_power, light_power;
+    std::vector<AABB> light_bounds;
+};
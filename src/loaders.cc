@@ -0,0 +1,427 @@
+#include "loaders.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <thread>
+
+// Parsing helpers, all working on [p, end) without copying
+
+inline static bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline static const char *skipBlanks(const char *p, const char *end) {
+  while (p < end && isBlank(*p)) p++;
+  return p;
+}
+
+inline static const char *skipWhitespace(const char *p, const char *end) {
+  while (p < end && (isBlank(*p) || *p == '\n')) p++;
+  return p;
+}
+
+inline static const char *nextLine(const char *p, const char *end) {
+  const char *nl = static_cast<const char *>(std::memchr(p, '\n', end - p));
+  return nl ? nl + 1 : end;
+}
+
+template <typename T>
+inline static const char *parseNumber(const char *p, const char *end, T &out) {
+  p = skipBlanks(p, end);
+  if (p < end && *p == '+') p++; // from_chars does not accept a leading '+'
+  const auto [ptr, ec] = std::from_chars(p, end, out);
+  return ec == std::errc() ? ptr : nullptr;
+}
+
+// OBJ
+
+struct OBJChunk {
+  const char *begin, *end;
+  size_t n_v = 0, n_vn = 0, n_vt = 0, n_tris = 0; // Counted in the first pass
+  size_t v_base = 0, vn_base = 0, vt_base = 0, tri_base = 0; // Offsets into the mesh buffers
+  bool ok = true;
+  bool paired_normals = true; // Every f uses the same index for v and vn
+  bool paired_uvs = true;     // And for v and vt
+};
+
+// Returns the number of vertices in the face line starting at p
+inline static size_t countFaceVertices(const char *p, const char *end) {
+  size_t n = 0;
+  while (true) {
+    p = skipBlanks(p, end);
+    if (p >= end || *p == '\n' || *p == '#') return n;
+    n++;
+    while (p < end && !isBlank(*p) && *p != '\n') p++;
+  }
+}
+
+static void countOBJ(OBJChunk &chunk) {
+  for (const char *p = chunk.begin; p < chunk.end; p = nextLine(p, chunk.end)) {
+    p = skipBlanks(p, chunk.end);
+    if (chunk.end - p < 2) continue;
+
+    if (p[0] == 'v' && isBlank(p[1])) chunk.n_v++;
+    else if (p[0] == 'v' && p[1] == 'n') chunk.n_vn++;
+    else if (p[0] == 'v' && p[1] == 't') chunk.n_vt++;
+    else if (p[0] == 'f' && isBlank(p[1])) {
+      const size_t n = countFaceVertices(p + 1, chunk.end);
+      if (n >= 3) chunk.n_tris += n - 2;
+    }
+  }
+}
+
+// Resolves a 1-based (or negative, relative) OBJ index into a 0-based one
+inline static bool resolveIndex(long idx, size_t defined, size_t total, uint32_t &out) {
+  if (idx > 0 && (size_t)idx <= total) out = idx - 1;
+  else if (idx < 0 && (size_t)-idx <= defined) out = defined + idx;
+  else return false;
+  return true;
+}
+
+static void parseOBJ(OBJChunk &chunk, TriangleMesh &mesh, size_t total_v, size_t total_vn, size_t total_vt) {
+  const char *end = chunk.end;
+  size_t v = chunk.v_base, vn = chunk.vn_base, vt = chunk.vt_base, tri = chunk.tri_base;
+
+  for (const char *p = chunk.begin; p < end && chunk.ok; p = nextLine(p, end)) {
+    p = skipBlanks(p, end);
+    if (end - p < 2) continue;
+
+    if (p[0] == 'v' && (isBlank(p[1]) || p[1] == 'n')) {
+      Float_t *dst = isBlank(p[1]) ? &mesh.positions[3 * v++] : &mesh.normals[3 * vn++];
+      p += 2;
+      for (int i = 0; i < 3 && p; i++) p = parseNumber(p, end, dst[i]);
+      if (!p) chunk.ok = false;
+    } else if (p[0] == 'v' && p[1] == 't') {
+      Float_t *dst = &mesh.uvs[2 * vt++];
+      p += 2;
+      for (int i = 0; i < 2 && p; i++) p = parseNumber(p, end, dst[i]); // An optional w is skipped
+      if (!p) chunk.ok = false;
+    } else if (p[0] == 'f' && isBlank(p[1])) {
+      p++;
+      uint32_t first = 0, prev = 0;
+      for (int k = 0; ; k++) {
+        p = skipBlanks(p, end);
+        if (p >= end || *p == '\n' || *p == '#') break;
+
+        long iv, ivt, ivn;
+        uint32_t cur, cur_n, cur_t;
+        if (!(p = parseNumber(p, end, iv)) || !resolveIndex(iv, v, total_v, cur)) { chunk.ok = false; break; }
+        if (p < end && *p == '/') {
+          p++;
+          if (p < end && *p != '/') {
+            if (!(p = parseNumber(p, end, ivt)) || !resolveIndex(ivt, vt, total_vt, cur_t)) { chunk.ok = false; break; }
+            chunk.paired_uvs &= cur_t == cur;
+          } else {
+            chunk.paired_uvs = false;
+          }
+          if (p < end && *p == '/') {
+            if (!(p = parseNumber(p + 1, end, ivn)) || !resolveIndex(ivn, vn, total_vn, cur_n)) { chunk.ok = false; break; }
+            chunk.paired_normals &= cur_n == cur;
+          } else {
+            chunk.paired_normals = false;
+          }
+        } else {
+          chunk.paired_normals = false;
+          chunk.paired_uvs = false;
+        }
+
+        if (k == 0) first = cur;
+        else if (k >= 2) {
+          uint32_t *dst = &mesh.indices[3 * tri++];
+          dst[0] = first;
+          dst[1] = prev;
+          dst[2] = cur;
+        }
+        prev = cur;
+      }
+    }
+  }
+}
+
+std::shared_ptr<TriangleMesh> loadOBJ(const std::string &filename, uint32_t material) {
+  MappedFile file(filename);
+  if (!file.valid()) return nullptr;
+
+  const char *data = file.data();
+  const size_t size = file.size();
+
+  // Split at line boundaries, roughly 4MB per chunk
+  const size_t max_chunks = std::max(1u, std::thread::hardware_concurrency());
+  const size_t n_chunks = std::clamp<size_t>(size >> 22, 1, max_chunks);
+  std::vector<OBJChunk> chunks(n_chunks);
+  const char *begin = data;
+  for (size_t i = 0; i < n_chunks; i++) {
+    const char *end = (i + 1 == n_chunks) ? data + size : nextLine(data + size * (i + 1) / n_chunks, data + size);
+    chunks[i].begin = begin;
+    chunks[i].end = std::max(begin, end);
+    begin = chunks[i].end;
+  }
+
+  const auto parallel = [&chunks](const auto &fn) {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < chunks.size(); i++) threads.emplace_back(fn, std::ref(chunks[i]));
+    fn(chunks[0]);
+    for (auto &thread : threads) thread.join();
+  };
+
+  // 1. Count elements per chunk, then turn the counts into offsets
+  parallel(countOBJ);
+
+  size_t n_v = 0, n_vn = 0, n_vt = 0, n_tris = 0;
+  for (auto &chunk : chunks) {
+    chunk.v_base = n_v;
+    chunk.vn_base = n_vn;
+    chunk.vt_base = n_vt;
+    chunk.tri_base = n_tris;
+    n_v += chunk.n_v;
+    n_vn += chunk.n_vn;
+    n_vt += chunk.n_vt;
+    n_tris += chunk.n_tris;
+  }
+
+  // 2. Parse every chunk straight into its slice of the mesh buffers
+  auto mesh = std::make_shared<TriangleMesh>(material);
+  mesh->positions.resize(3 * n_v);
+  mesh->normals.resize(3 * n_vn);
+  mesh->uvs.resize(2 * n_vt);
+  mesh->indices.resize(3 * n_tris);
+
+  parallel([&](OBJChunk &chunk) { parseOBJ(chunk, *mesh, n_v, n_vn, n_vt); });
+
+  bool paired_normals = n_vn == n_v, paired_uvs = n_vt == n_v;
+  for (size_t i = 0; i < n_chunks; i++) {
+    if (!chunks[i].ok) {
+      std::cerr << "Error parsing OBJ file: " << filename << std::endl;
+      return nullptr;
+    }
+    paired_normals &= chunks[i].paired_normals;
+    paired_uvs &= chunks[i].paired_uvs;
+  }
+  if (!paired_normals) mesh->normals.clear();
+  if (!paired_uvs) mesh->uvs.clear();
+
+  return mesh;
+}
+
+// PLY
+
+enum class PLYFormat { Ascii, BinaryLittleEndian, BinaryBigEndian };
+enum class PLYType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, Invalid };
+
+struct PLYProperty {
+  std::string name;
+  PLYType type;
+  PLYType count_type; // Invalid if not a list
+};
+
+struct PLYElement {
+  std::string name;
+  size_t count;
+  std::vector<PLYProperty> properties;
+};
+
+static PLYType plyType(std::string_view name) {
+  if (name == "char" || name == "int8") return PLYType::Int8;
+  if (name == "uchar" || name == "uint8") return PLYType::UInt8;
+  if (name == "short" || name == "int16") return PLYType::Int16;
+  if (name == "ushort" || name == "uint16") return PLYType::UInt16;
+  if (name == "int" || name == "int32") return PLYType::Int32;
+  if (name == "uint" || name == "uint32") return PLYType::UInt32;
+  if (name == "float" || name == "float32") return PLYType::Float32;
+  if (name == "double" || name == "float64") return PLYType::Float64;
+  return PLYType::Invalid;
+}
+
+class PLYReader {
+  public:
+    PLYReader(const char *p_, const char *end_, PLYFormat format_) : p(p_), end(end_), format(format_) {}
+
+    bool read(PLYType type, double &out) {
+      if (format == PLYFormat::Ascii) {
+        p = skipWhitespace(p, end);
+        return (p = parseNumber(p, end, out)) != nullptr;
+      }
+
+      switch (type) {
+        case PLYType::Int8:    return readBinary<int8_t>(out);
+        case PLYType::UInt8:   return readBinary<uint8_t>(out);
+        case PLYType::Int16:   return readBinary<int16_t>(out);
+        case PLYType::UInt16:  return readBinary<uint16_t>(out);
+        case PLYType::Int32:   return readBinary<int32_t>(out);
+        case PLYType::UInt32:  return readBinary<uint32_t>(out);
+        case PLYType::Float32: return readBinary<float>(out);
+        case PLYType::Float64: return readBinary<double>(out);
+        default:               return false;
+      }
+    }
+
+  private:
+    template <typename T>
+    bool readBinary(double &out) {
+      if (end - p < (long)sizeof(T)) return false;
+
+      char bytes[sizeof(T)];
+      std::memcpy(bytes, p, sizeof(T));
+      if (format == PLYFormat::BinaryBigEndian) std::reverse(bytes, bytes + sizeof(T));
+      p += sizeof(T);
+
+      T value;
+      std::memcpy(&value, bytes, sizeof(T));
+      out = value;
+      return true;
+    }
+
+  private:
+    const char *p, *end;
+    PLYFormat format;
+};
+
+static bool parsePLYHeader(const char *&p, const char *end, PLYFormat &format, std::vector<PLYElement> &elements) {
+  const auto word = [&]() {
+    p = skipBlanks(p, end);
+    const char *start = p;
+    while (p < end && !isBlank(*p) && *p != '\n') p++;
+    return std::string_view(start, p - start);
+  };
+
+  if (word() != "ply") return false;
+
+  for (p = nextLine(p, end); p < end; p = nextLine(p, end)) {
+    const std::string_view keyword = word();
+
+    if (keyword == "format") {
+      const std::string_view f = word();
+      if (f == "ascii") format = PLYFormat::Ascii;
+      else if (f == "binary_little_endian") format = PLYFormat::BinaryLittleEndian;
+      else if (f == "binary_big_endian") format = PLYFormat::BinaryBigEndian;
+      else return false;
+    } else if (keyword == "element") {
+      const std::string_view name = word();
+      size_t count;
+      if (!(p = parseNumber(p, end, count))) return false;
+      elements.push_back({std::string(name), count, {}});
+    } else if (keyword == "property") {
+      if (elements.empty()) return false;
+      std::string_view type = word();
+      PLYType count_type = PLYType::Invalid;
+      if (type == "list") {
+        if ((count_type = plyType(word())) == PLYType::Invalid) return false;
+        type = word();
+      }
+      const PLYType value_type = plyType(type);
+      if (value_type == PLYType::Invalid) return false;
+      elements.back().properties.push_back({std::string(word()), value_type, count_type});
+    } else if (keyword == "end_header") {
+      p = nextLine(p, end);
+      return true;
+    }
+    // comment, obj_info, ...: ignored
+  }
+  return false;
+}
+
+std::shared_ptr<TriangleMesh> loadPLY(const std::string &filename, uint32_t material) {
+  MappedFile file(filename);
+  if (!file.valid()) return nullptr;
+
+  const char *p = file.data();
+  const char *end = file.data() + file.size();
+
+  PLYFormat format = PLYFormat::Ascii;
+  std::vector<PLYElement> elements;
+  if (!parsePLYHeader(p, end, format, elements)) {
+    std::cerr << "Error parsing PLY header: " << filename << std::endl;
+    return nullptr;
+  }
+
+  auto mesh = std::make_shared<TriangleMesh>(material);
+  PLYReader reader(p, end, format);
+  size_t n_v = 0;
+
+  for (const auto &element : elements) {
+    // Where each property goes: 0-2 position, 3-5 normal, 6-7 texture coordinates, 8 face
+    // indices, -1 skipped
+    std::vector<int> slots;
+    bool has_normals = false, has_uvs = false;
+    for (const auto &property : element.properties) {
+      int slot = -1;
+      if (element.name == "vertex") {
+        static const char *names[] = {"x", "y", "z", "nx", "ny", "nz"};
+        static const char *uv_names[][2] = {{"u", "v"}, {"s", "t"}, {"texture_u", "texture_v"}, {"texture_s", "texture_t"}};
+        for (int i = 0; i < 6; i++)
+          if (property.name == names[i]) slot = i;
+        for (const auto &uv : uv_names)
+          for (int i = 0; i < 2; i++)
+            if (property.name == uv[i]) slot = 6 + i;
+        has_normals |= slot >= 3 && slot < 6;
+        has_uvs |= slot >= 6;
+      } else if (element.name == "face" && property.count_type != PLYType::Invalid &&
+                 (property.name == "vertex_indices" || property.name == "vertex_index")) {
+        slot = 8;
+      }
+      slots.push_back(slot);
+    }
+
+    // Every item takes at least a byte, larger counts can only come from a corrupt header
+    if (!element.properties.empty() && element.count > size_t(end - p)) goto error;
+
+    if (element.name == "vertex") {
+      n_v = element.count;
+      mesh->positions.resize(3 * n_v);
+      if (has_normals) mesh->normals.resize(3 * n_v);
+      if (has_uvs) mesh->uvs.resize(2 * n_v);
+    } else if (element.name == "face") {
+      mesh->indices.reserve(3 * element.count);
+    }
+
+    for (size_t item = 0; item < element.count; item++) {
+      for (size_t i = 0; i < element.properties.size(); i++) {
+        const PLYProperty &property = element.properties[i];
+        double value;
+
+        if (property.count_type == PLYType::Invalid) {
+          if (!reader.read(property.type, value)) goto error;
+          if (slots[i] >= 0 && slots[i] < 3) mesh->positions[3 * item + slots[i]] = value;
+          else if (slots[i] >= 3 && slots[i] < 6) mesh->normals[3 * item + slots[i] - 3] = value;
+          else if (slots[i] >= 6) mesh->uvs[2 * item + slots[i] - 6] = value;
+          continue;
+        }
+
+        // Counts and indices are checked as read, before any conversion to an unsigned type
+        double count;
+        if (!reader.read(property.count_type, count) || count < 0 || count > double(end - p)) goto error;
+
+        uint32_t first = 0, prev = 0;
+        for (size_t k = 0; k < (size_t)count; k++) {
+          if (!reader.read(property.type, value)) goto error;
+          if (slots[i] != 8) continue;
+
+          if (!(value >= 0 && value < double(n_v))) goto error;
+          const uint32_t cur = value;
+          if (k == 0) first = cur;
+          else if (k >= 2) mesh->indices.insert(mesh->indices.end(), {first, prev, cur});
+          prev = cur;
+        }
+      }
+    }
+  }
+
+  return mesh;
+
+error:
+  std::cerr << "Error parsing PLY file: " << filename << std::endl;
+  return nullptr;
+}
+
+std::shared_ptr<TriangleMesh> loadMesh(const std::string &filename, uint32_t material) {
+  const auto endsWith = [&filename](const char *ext) {
+    const size_t n = std::strlen(ext);
+    return filename.size() >= n && filename.compare(filename.size() - n, n, ext) == 0;
+  };
+
+  if (endsWith(".obj") || endsWith(".OBJ")) return loadOBJ(filename, material);
+  if (endsWith(".ply") || endsWith(".PLY")) return loadPLY(filename, material);
+
+  std::cerr << "Unknown mesh format: " << filename << std::endl;
+  return nullptr;
+}
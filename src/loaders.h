@@ -0,0 +1,20 @@
+#pragma once
+
+#include "mesh.h"
+#include <string>
+
+// Mesh loaders. Files are memory-mapped and parsed in place, straight into the
+// TriangleMesh buffers. Polygons are fan-triangulated. On failure the reason is
+// printed and nullptr is returned.
+
+// Wavefront OBJ (v, vn, vt, f). Large files are parsed in parallel chunks.
+// Normals and texture coordinates are only kept if they pair 1:1 with positions
+// (f v/t/n with t == v and n == v).
+std::shared_ptr<TriangleMesh> loadOBJ(const std::string &filename, uint32_t material);
+
+// Stanford PLY, ascii or binary (either endianness). Reads x/y/z, nx/ny/nz, u/v (or
+// s/t) and the vertex_indices list, everything else is skipped.
+std::shared_ptr<TriangleMesh> loadPLY(const std::string &filename, uint32_t material);
+
+// Picks the loader from the file extension
+std::shared_ptr<TriangleMesh> loadMesh(const std::string &filename, uint32_t material);
@@ -1,5 +1,8 @@
 #include <iostream>
 #include <fstream>
+#include <optional>
+#include <chrono>
+#include <filesystem>
 
 #define AUTOGRAD_IMPLEMENTATION
 #include "autograd.h"
@@ -7,87 +10,1338 @@
 
 #include "rtmath.h"
 #include "objects.h"
+#include "loaders.h"
+#include "raysort.h"
 #include "optim.h"
 
-Direction Li(const Scene &scene, const Ray &ray, int depth) {
+// Footprint of a ray as a cone [Akenine-Moller et al. 2019], it picks the MIP level of
+// texture lookups. The spread is the pixel angle and stays the same along the path
+struct RayCone {
+  Float_t width;  // At the ray origin
+  Float_t spread; // Growth of the width per unit of distance
+
+  RayCone at(Float_t t) const { return {width + spread * t, spread}; }
+};
+
+// The estimator is written once for any scalar type T: float or double for primal renders,
+// Float when gradients are needed. pdf is the solid angle pdf of the BSDF sample that produced
+// the ray, 0 for camera rays and after specular bounces (no light sampling could find the
+// emitter it hits)
+template <typename T>
+Vec3<T> shade(const Scene &scene, const SurfaceHit<T> &hit, int depth, Float_t pdf, const RayCone &cone);
+
+template <typename T>
+Vec3<T> Li(const Scene &scene, const Ray3<T> &ray, int depth, Float_t pdf, const RayCone &cone) {
+  SurfaceHit<T> hit;
+
+  if (depth == 0) return Vec3<T>(0, 0, 0);
+
+  if (!scene.intersect(ray, hit)) return scene.environment(ray, pdf);
+
+  return shade(scene, hit, depth, pdf, cone.at(value_of(hit.t)));
+}
+
+// One step of the estimator at a surface hit: L gets the radiance emitted or reflected from
+// the lights towards hit.wo and, unless the path ends here, the next ray is returned with
+// the weight of the radiance it brings back and its pdf (see Li). width is the footprint of
+// the incoming ray at the hit (RayCone)
+template <typename T>
+std::optional<Ray3<T>> scatter(const Scene &scene, const SurfaceHit<T> &hit, Float_t pdf, Float_t width,
+                               Vec3<T> &L, Vec3<T> &weight, Float_t &next_pdf) {
   const Float_t eps = 1e-4;
 
-  ObjectHit hit;
+  const Material &material = scene.materials[hit.material];
+  const TexCoord tc = hit.texCoord(width);
 
-  if (depth == 0) return Direction(0, 0, 0);
+  const Vec3<T> Le = material.template evalEmission<T>(tc);
+  if (value_of(Le.max()) > 0) { // Emission from the object, return it directly
+    L = Le;
+    // The previous vertex may have sampled this emitter as an area light too, its MIS weight
+    // then splits the emission between both estimates
+    if (pdf > 0 && hit.light >= 0 && scene.areaLightSampling()) {
+      const Vec3f p(hit.p), wo(hit.wo);
+      L = Le * T(scene.emissionMISWeight(hit.light, p + wo * value_of(hit.t), p, Vec3f(hit.n), pdf));
+    }
+    return std::nullopt;
+  }
 
-  if (!scene.intersect(ray, hit)) return Direction(0, 0, 0);
+  const Point3<T> &x = hit.p;
+  const Vec3<T> n = hit.into ? hit.n : -hit.n; // On the side of wo
 
-  const auto &material = hit.material;
+  L = Vec3<T>(0, 0, 0);
+  const auto [lobe, prob] = material.rr();
+  if (lobe == nullptr) return std::nullopt; // Absorption
 
-  const Direction Le = material->evalEmission();
-  if (Le.max().value() > 0) return Le; // Emission from the object, return it directly
+  // A roughness map gives a rough lobe its roughness at the hit
+  HitBSDF<T> bsdf{*lobe};
+  if (material.roughness_map) {
+    if (const GGXBSDF *ggx = lobe->get<GGXBSDF>()) bsdf.roughness = material.template evalRoughness<T>(*ggx, tc);
+    if (const RoughRefractiveBSDF *glass = lobe->get<RoughRefractiveBSDF>()) bsdf.roughness = material.template evalRoughness<T>(*glass, tc);
+  }
 
-  const Point &x = hit.p;
-  const Direction &n = hit.n;
+  // Every lobe is linear in its albedo, the albedo map scales what they return
+  const std::optional<Vec3<T>> albedo = material.template evalAlbedo<T>(tc);
 
-  const auto [bsdf, prob] = material->rr();
-  if (bsdf == nullptr) return Direction(0, 0, 0); // Absorption
+  const BSDFSample<T> s = bsdf.sample(hit.wo, n, hit.into);
 
-  Direction wi = bsdf->sample(hit.wo, n);
-  Direction fr = bsdf->evaluate(hit.wo, wi, n) / prob;
-  Float_t cosThetaI = bsdf->cosThetaI(wi, n);
-  Float_t pdf = bsdf->pdf(hit.wo, wi, n);
+  // Lights can not be reached through a delta lobe
+  if (!s.specular()) {
+    L = (scene.pointLightNEE(hit, bsdf) + scene.areaLightNEE(hit, bsdf) + scene.environmentNEE(hit, bsdf)) / T(prob);
+    if (albedo) L = L * *albedo;
+  }
+  if (s.pdf <= 0) return std::nullopt; // No valid direction (e.g. below a rough surface)
+  weight = s.weight / T(prob);
+  if (albedo) weight = weight * *albedo;
+  next_pdf = s.specular() ? 0 : s.pdf;
 
-  const Direction L_indirect = Li(scene, Ray(x + n * eps, wi), depth - 1) * M_PI * fr * cosThetaI / pdf;
+  // Offset to the side the ray leaves through
+  return Ray3<T>(x + n * T(s.flags & LOBE_TRANSMISSION ? -eps : eps), s.wi);
+}
 
-  const Direction L_direct = scene.pointLightNEE(hit) * fr; // * cosThetaI / pdf; already taken into account
+// Radiance leaving the surface found by the caller towards hit.wo
+template <typename T>
+Vec3<T> shade(const Scene &scene, const SurfaceHit<T> &hit, int depth, Float_t pdf, const RayCone &cone) {
+  Vec3<T> L_direct, weight;
+  Float_t next_pdf;
+  const std::optional<Ray3<T>> next = scatter(scene, hit, pdf, cone.width, L_direct, weight, next_pdf);
+  if (!next) return L_direct;
 
+  const Vec3<T> L_indirect = Li(scene, *next, depth - 1, next_pdf, cone) * weight;
   return L_indirect + L_direct;
 }
 
-void render(const Scene &scene, Direction *image, int width, int height, int depth, int spp) {
-  // Camera setup
-  const Point eye(0, 0, -3); // Camera position
-  const Direction forward(0, 0, 3); // Camera forward direction
-  const Direction up(0, 1, 0); // Camera up direction
-  const Direction left(-1, 0, 0); // Camera left direction
+template <typename T>
+void render(const Scene &scene, Vec3<T> *image, int width, int height, int depth, int spp) {
+  // Camera setup, camera rays carry no gradient
+  const Point3f eye(0, 0, -3); // Camera position
+  const Vec3f forward(0, 0, 3); // Camera forward direction
+  const Vec3f up(0, 1, 0); // Camera up direction
+  const Vec3f left(-1, 0, 0); // Camera left direction
   const Float_t delta_u = 2.0 / (Float_t)width;
   const Float_t delta_v = 2.0 / (Float_t)height;
+  const RayCone camera = {0.0f, 2 * left.norm() / (width * forward.norm())}; // Spread of a pixel
 
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      Direction L(0, 0, 0);
+  if (depth == 0) {
+    for (int i = 0; i < width * height; i++) image[i] = Vec3<T>(0, 0, 0);
+    return;
+  }
+
+  // Camera rays are traced in 4x4 pixel tiles that share one BVH traversal, the bounces
+  // after the first hit are incoherent and go one by one through Li
+  const int tile = 4;
+  for (int ty = 0; ty < height; ty += tile) {
+    for (int tx = 0; tx < width; tx += tile) {
+      const int tile_w = std::min(tile, width - tx), tile_h = std::min(tile, height - ty);
+
+      Vec3<T> L[PACKET_SIZE];
       for (int s = 0; s < spp; ++s) {
+        std::vector<Ray3<T>> rays;
+        RayPacket<PACKET_SIZE> packet;
+        for (int y = ty; y < ty + tile_h; ++y) {
+          for (int x = tx; x < tx + tile_w; ++x) {
+            const Float_t su = uniform(0, delta_u);
+            const Float_t sv = uniform(0, delta_v);
+
+            const Float_t u = x / (Float_t)width + su;
+            const Float_t v = y / (Float_t)height + sv;
+
+            const Vec3f d = forward +
+                            left * (1.0 - 2.0 * u) +
+                            up * (1.0 - 2.0 * v);
+
+            rays.emplace_back(Ray3f(eye, d));
+            packet.add(FastRay(rays.back()));
+          }
+        }
+        packet.prepare();
+
+        PacketHit hits;
+        scene.intersect(packet, hits);
+        for (int i = 0; i < packet.count; i++) {
+          SurfaceHit<T> hit;
+          if (scene.surface(rays[i], hits, i, hit)) L[i] = L[i] + shade(scene, hit, depth, 0.0f, camera.at(value_of(hit.t)));
+          else L[i] = L[i] + scene.environment(rays[i], 0.0f);
+        }
+      }
+
+      for (int i = 0; i < tile_w * tile_h; i++)
+        image[(ty + i / tile_w) * width + tx + i % tile_w] = L[i] / T(spp);
+    }
+  }
+}
+
+// Same estimator as render(), traced breadth-first: every bounce of a sample pass over the
+// whole image is one batch of rays, sorted for coherence before tracing
+template <typename T>
+void renderWavefront(const Scene &scene, Vec3<T> *image, int width, int height, int depth, int spp) {
+  // Camera setup, camera rays carry no gradient
+  const Point3f eye(0, 0, -3); // Camera position
+  const Vec3f forward(0, 0, 3); // Camera forward direction
+  const Vec3f up(0, 1, 0); // Camera up direction
+  const Vec3f left(-1, 0, 0); // Camera left direction
+  const Float_t delta_u = 2.0 / (Float_t)width;
+  const Float_t delta_v = 2.0 / (Float_t)height;
+  const RayCone camera = {0.0f, 2 * left.norm() / (width * forward.norm())}; // Spread of a pixel
+
+  struct Path {
+    Ray3<T> ray;
+    Vec3<T> beta; // Weight of the radiance found along ray
+    int pixel;
+    Float_t pdf;  // Of the BSDF sample that produced ray, see Li
+    RayCone cone;
+  };
+
+  std::vector<Vec3<T>> L(width * height);
+  for (int s = 0; s < spp; ++s) {
+    std::vector<Path> paths;
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
         const Float_t su = uniform(0, delta_u);
         const Float_t sv = uniform(0, delta_v);
 
         const Float_t u = x / (Float_t)width + su;
         const Float_t v = y / (Float_t)height + sv;
 
-        const Direction d = forward +
-                            left * (1.0 - 2.0 * u) +
-                            up * (1.0 - 2.0 * v);
+        const Vec3f d = forward +
+                        left * (1.0 - 2.0 * u) +
+                        up * (1.0 - 2.0 * v);
+
+        paths.push_back({Ray3<T>(Ray3f(eye, d)), Vec3<T>(1, 1, 1), y * width + x, 0.0f, camera});
+      }
+    }
+
+    for (int bounce = 0; bounce < depth && !paths.empty(); ++bounce) {
+      std::vector<FastRay> rays;
+      rays.reserve(paths.size());
+      for (const Path &path : paths) rays.emplace_back(path.ray);
+
+      // Camera rays are coherent in scanline order, the bounces are sorted by direction
+      // octant and origin. The paths are reordered too, so shading walks them in order
+      if (bounce > 0) {
+        std::vector<uint32_t> order;
+        sortRays(rays, scene.bounds(), order);
+
+        std::vector<Path> sorted_paths;
+        std::vector<FastRay> sorted_rays;
+        sorted_paths.reserve(paths.size());
+        sorted_rays.reserve(rays.size());
+        for (const uint32_t i : order) {
+          sorted_paths.push_back(std::move(paths[i]));
+          sorted_rays.push_back(rays[i]);
+        }
+        paths.swap(sorted_paths);
+        rays.swap(sorted_rays);
+      }
+
+      std::vector<SceneHit> hits;
+      scene.intersect(rays, hits);
 
-        L = L + Li(scene, Ray(eye, d), depth);
+      std::vector<Path> next;
+      for (size_t i = 0; i < paths.size(); ++i) {
+        SurfaceHit<T> hit;
+        if (!scene.surface(paths[i].ray, hits[i], hit)) {
+          L[paths[i].pixel] = L[paths[i].pixel] + paths[i].beta * scene.environment(paths[i].ray, paths[i].pdf);
+          continue;
+        }
+
+        Vec3<T> L_direct, weight;
+        Float_t pdf;
+        const RayCone cone = paths[i].cone.at(value_of(hit.t));
+        const std::optional<Ray3<T>> ray = scatter(scene, hit, paths[i].pdf, cone.width, L_direct, weight, pdf);
+        L[paths[i].pixel] = L[paths[i].pixel] + paths[i].beta * L_direct;
+        if (ray) next.push_back({*ray, paths[i].beta * weight, paths[i].pixel, pdf, cone});
       }
-      image[y * width + x] = L / spp;
+      paths.swap(next);
     }
   }
+
+  for (int i = 0; i < width * height; i++) image[i] = L[i] / T(spp);
 }
 
-Float MSELoss(const Direction *image1, const Direction *image2, int width, int height) {
+// The target is a plain render, only the prediction carries gradients
+Float MSELoss(const Vec3f *target, const Direction *image, int width, int height) {
   Float mse = 0.0;
   for (int i = 0; i < width * height; i++) {
-    const Direction &L1 = image1[i];
-    const Direction &L2 = image2[i];
+    const Direction L1(target[i]);
+    const Direction &L2 = image[i];
     mse = mse + (L1 - L2).norm_squared();
   }
   return mse / (width * height);
 }
 
-void saveImage(const std::string &filename, const Direction *image, int width, int height);
+// Renders the scene twice with the plain-float estimator and once with the differentiable one.
+// All three are independent unbiased estimates of the same image, so the Float render has to
+// be as far from the first float render as the second one is, and the channel means of the
+// two must agree within the noise
+bool checkPrimal(const Scene &scene, int width, int height, int depth, int spp) {
+  const int n = width * height;
+  std::vector<Vec3f> a(n), b(n);
+  std::vector<Direction> c(n);
+
+  const auto t0 = std::chrono::steady_clock::now();
+  render(scene, a.data(), width, height, depth, spp);
+  render(scene, b.data(), width, height, depth, spp);
+  const auto t1 = std::chrono::steady_clock::now();
+  render(scene, c.data(), width, height, depth, spp);
+  const auto t2 = std::chrono::steady_clock::now();
+
+  const double t_float = std::chrono::duration<double>(t1 - t0).count() / 2;
+  const double t_Float = std::chrono::duration<double>(t2 - t1).count();
+  std::cout << "float: " << t_float << "s, Float: " << t_Float << "s (" << t_Float / t_float << "x)" << std::endl;
+
+  bool ok = true;
+  std::vector<double> error_ab(n, 0.0), error_ac(n, 0.0);
+  for (int axis = 0; axis < 3; axis++) {
+    double sum = 0.0, sum_squared = 0.0;
+    for (int i = 0; i < n; i++) {
+      const double d = value_of(c[i][axis]) - b[i][axis];
+      sum += d;
+      sum_squared += d * d;
+      error_ab[i] += (b[i][axis] - a[i][axis]) * (b[i][axis] - a[i][axis]);
+      error_ac[i] += (value_of(c[i][axis]) - a[i][axis]) * (value_of(c[i][axis]) - a[i][axis]);
+    }
+    const double mean = sum / n;
+    const double z = mean / std::sqrt((sum_squared / n - mean * mean) / n);
+    std::cout << "channel " << axis << ": mean difference " << mean << " (z = " << z << ")" << std::endl;
+    if (std::abs(z) > 4.0) ok = false;
+  }
+
+  // Medians rather than means of the squared errors, a few fireflies (e.g. next to an area
+  // light) would otherwise decide the ratio
+  const auto median = [](std::vector<double> &v) {
+    std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+    return v[v.size() / 2];
+  };
+  const double ratio = median(error_ac) / median(error_ab);
+  std::cout << "median squared error (float, Float) / (float, float) = " << ratio << std::endl;
+  if (ratio < 0.8 || ratio > 1.25) ok = false;
+
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// The camera and a diffuse sphere inside a uniformly emitting sphere, rendered with and
+// without area light sampling. NEE has to find the emitter from inside it too, the two
+// renders must agree within the noise
+bool checkAreaLightInterior(int width, int height, int depth, int spp) {
+  const auto render_with = [&](bool nee, std::vector<Vec3f> &image) {
+    Scene scene;
+    const Direction black(0, 0, 0);
+    scene.add(std::make_shared<Sphere>(Point(0, 0, 0), 5.0, scene.addMaterial(Material(Direction(1, 1, 1), black, black, black))));
+    scene.add(std::make_shared<Sphere>(Point(0, 0, 0.5), 0.5, scene.addMaterial(Material(black, Direction(0.5, 0.5, 0.5), black, black))));
+    scene.setAreaLightSampling(nee);
+    image.resize(width * height);
+    render(scene, image.data(), width, height, depth, spp);
+  };
+  std::vector<Vec3f> a, b;
+  render_with(true, a);
+  render_with(false, b);
+
+  double sum = 0.0, sum_squared = 0.0;
+  for (int i = 0; i < width * height; i++) {
+    const double d = (a[i].x + a[i].y + a[i].z - b[i].x - b[i].y - b[i].z) / 3;
+    sum += d;
+    sum_squared += d * d;
+  }
+  const int n = width * height;
+  const double mean = sum / n;
+  const double z = mean / std::sqrt(std::max((sum_squared / n - mean * mean) / n, 1e-12));
+  std::cout << "inside an area light, NEE on - off: mean difference " << mean << " (z = " << z << ")" << std::endl;
+
+  const bool ok = std::abs(z) <= 4.0;
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// Writes small OBJ and PLY files (ascii, binary of both endiannesses) into a temporary
+// directory and loads them back: fans become the expected triangles, and malformed lists
+// (negative counts, indices out of range) are rejected instead of read
+bool checkLoaders() {
+  const std::filesystem::path dir = std::filesystem::temp_directory_path() / ("diffrt_check_" + std::to_string(getpid()));
+  std::filesystem::create_directories(dir);
+  const auto write = [&](const std::string &name, const std::string &data) {
+    std::ofstream(dir / name, std::ios::binary) << data;
+    return (dir / name).string();
+  };
+  // Binary PLY with one list of int32 indices behind an int8 count
+  const auto binaryPLY = [&](const std::string &name, bool big_endian, int8_t count, const std::vector<int32_t> &face) {
+    std::string data = std::string("ply\nformat ") + (big_endian ? "binary_big_endian" : "binary_little_endian") +
+                       " 1.0\nelement vertex 4\nproperty float x\nproperty float y\nproperty float z\n"
+                       "element face 1\nproperty list char int vertex_indices\nend_header\n";
+    const auto append = [&](const auto &value) {
+      char bytes[sizeof(value)];
+      std::memcpy(bytes, &value, sizeof(value));
+      if (big_endian) std::reverse(bytes, bytes + sizeof(value));
+      data.append(bytes, sizeof(value));
+    };
+    const float xyz[] = {0, 0, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0};
+    for (const float x : xyz) append(x);
+    append(count);
+    for (const int32_t i : face) append(i);
+    return write(name, data);
+  };
+  const auto triangles = [](const std::shared_ptr<TriangleMesh> &mesh) {
+    return mesh ? mesh->indices : std::vector<uint32_t>{0xffffffff};
+  };
+
+  bool ok = true;
+  const auto expect = [&](const char *what, bool passed) {
+    std::cout << what << ": " << (passed ? "ok" : "wrong") << std::endl;
+    ok &= passed;
+  };
+
+  // A pentagon with positions, texture coordinates and normals paired 1:1, and a quad
+  // with a relative index
+  const std::shared_ptr<TriangleMesh> obj = loadOBJ(write("fan.obj",
+    "v 0 0 0\nv 1 0 0\nv 2 1 0\nv 1 2 0\nv 0 1 0\n"
+    "vt 0 0\nvt 1 0\nvt 1 1\nvt 0.5 1\nvt 0 1\n"
+    "vn 0 0 1\nvn 0 0 1\nvn 0 0 1\nvn 0 0 1\nvn 0 0 1\n"
+    "f 1/1/1 2/2/2 3/3/3 4/4/4 5/5/5\n"
+    "f 1 2 3 -1\n"), 0);
+  expect("OBJ fan", triangles(obj) == std::vector<uint32_t>{0, 1, 2, 0, 2, 3, 0, 3, 4, 0, 1, 2, 0, 2, 4} &&
+                    obj->numVertices() == 5 && obj->normals.empty() && obj->uvs.empty());
+  expect("OBJ index out of range", loadOBJ(write("bad.obj", "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 4\n"), 0) == nullptr);
+
+  const std::shared_ptr<TriangleMesh> ascii = loadPLY(write("quad.ply",
+    "ply\nformat ascii 1.0\ncomment a quad\nelement vertex 4\nproperty float x\nproperty float y\nproperty float z\n"
+    "property float u\nproperty float v\nelement face 1\nproperty list uchar int vertex_indices\nend_header\n"
+    "0 0 0 0 0\n1 0 0 1 0\n1 1 0 1 1\n0 1 0 0 1\n4 0 1 2 3\n"), 0);
+  expect("ascii PLY", triangles(ascii) == std::vector<uint32_t>{0, 1, 2, 0, 2, 3} && ascii->uvs.size() == 8 && ascii->uvs[5] == 1);
+  expect("ascii PLY negative index", loadPLY(write("negative.ply",
+    "ply\nformat ascii 1.0\nelement vertex 3\nproperty float x\nproperty float y\nproperty float z\n"
+    "element face 1\nproperty list uchar int vertex_indices\nend_header\n0 0 0\n1 0 0\n0 1 0\n3 0 1 -1\n"), 0) == nullptr);
+
+  for (const bool big_endian : {false, true}) {
+    const std::shared_ptr<TriangleMesh> binary = loadPLY(binaryPLY("quad.ply", big_endian, 4, {0, 1, 2, 3}), 0);
+    expect(big_endian ? "binary big endian PLY" : "binary little endian PLY",
+           triangles(binary) == std::vector<uint32_t>{0, 1, 2, 0, 2, 3} && binary->positions[6] == 1 && binary->positions[7] == 1);
+  }
+  expect("binary PLY negative count", loadPLY(binaryPLY("count.ply", false, -1, {0, 1, 2, 3}), 0) == nullptr);
+  expect("binary PLY negative index", loadPLY(binaryPLY("index.ply", false, 3, {0, 1, -2}), 0) == nullptr);
+  expect("binary PLY index out of range", loadPLY(binaryPLY("range.ply", true, 3, {0, 1, 4}), 0) == nullptr);
+
+  std::filesystem::remove_all(dir);
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// n triangles with corners scattered over the cube [-1, 1]^3, for the acceleration checks
+std::shared_ptr<TriangleMesh> randomMesh(int n, uint32_t material) {
+  auto mesh = std::make_shared<TriangleMesh>(material);
+  for (int i = 0; i < n; i++) {
+    const Vec3f c(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1));
+    for (int k = 0; k < 3; k++) mesh->addVertex(c.x + uniform(-0.2, 0.2), c.y + uniform(-0.2, 0.2), c.z + uniform(-0.2, 0.2));
+    mesh->addTriangle(3 * i, 3 * i + 1, 3 * i + 2);
+  }
+  return mesh;
+}
+
+// Casts the same random rays, from around the cube [-2, 2]^3 through it, at two scenes and
+// returns how many closest hits differ (hit or miss, distance, normal). The rays go one by
+// one, and through packets and occlusion queries in the first scene too
+int countHitMismatches(const Scene &a, const Scene &b, int n_rays) {
+  const auto same = [](bool hit_a, const SurfaceHit<float> &ha, bool hit_b, const SurfaceHit<float> &hb) {
+    if (hit_a != hit_b) return false;
+    return !hit_a || (std::abs(ha.t - hb.t) <= 1e-4f * std::max(1.0f, ha.t) && (ha.n - hb.n).norm() <= 1e-3f);
+  };
+
+  int mismatches = 0;
+  for (int first = 0; first < n_rays; first += PACKET_SIZE) {
+    std::vector<Ray3f> rays;
+    RayPacket<PACKET_SIZE> packet;
+    for (int i = first; i < std::min(first + PACKET_SIZE, n_rays); i++) {
+      const Point3f o(uniform(-2, 2), uniform(-2, 2), uniform(-2, 2));
+      const Point3f target(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1));
+      rays.emplace_back(o, target - o);
+      packet.add(FastRay(rays.back()));
+    }
+    packet.prepare();
+    PacketHit packet_hits;
+    a.intersect(packet, packet_hits);
+
+    for (size_t i = 0; i < rays.size(); i++) {
+      SurfaceHit<float> ha, hb, hp;
+      const bool hit_a = a.intersect(rays[i], ha), hit_b = b.intersect(rays[i], hb);
+      const bool hit_p = a.surface(rays[i], packet_hits, i, hp);
+      const bool occluded = a.occluded(FastRay(rays[i]), std::numeric_limits<Float_t>::max());
+      mismatches += !same(hit_a, ha, hit_b, hb) || !same(hit_a, ha, hit_p, hp) || occluded != hit_a;
+    }
+  }
+  return mismatches;
+}
+
+// Two instances of a mesh against two copies of it with the transforms applied to the
+// vertices: the hits must be the same, up to float rounding at triangle edges
+bool checkInstances() {
+  const Direction black(0, 0, 0);
+  const Material material(black, Direction(0.5, 0.5, 0.5), black, black);
+  Scene instanced, flat;
+  const std::shared_ptr<TriangleMesh> mesh = randomMesh(200, instanced.addMaterial(material));
+  flat.addMaterial(material);
+
+  const Transform transforms[] = {
+    Transform::translate(0.3, -0.2, 0.1) * Transform::rotate(Direction(1, 2, 3), 0.7) * Transform::scale(0.6, 0.8, 0.5),
+    Transform::translate(-0.4, 0.5, 0.0) * Transform::rotate(Direction(0, 1, 0), 2.0) * Transform::scale(0.7, 0.7, 0.7),
+  };
+  for (const Transform &transform : transforms) {
+    instanced.add(std::make_shared<Instance>(mesh, transform));
+
+    auto copy = std::make_shared<TriangleMesh>(0);
+    for (size_t i = 0; i < mesh->numVertices(); i++) {
+      const Point3f p = transform(mesh->vertex<Float_t>(i));
+      copy->addVertex(p.x, p.y, p.z);
+    }
+    copy->indices = mesh->indices;
+    flat.add(copy);
+  }
+
+  const int n = 4096, mismatches = countHitMismatches(instanced, flat, n);
+  std::cout << "instances against transformed copies: " << mismatches << "/" << n << " hits differ" << std::endl;
+  const bool ok = mismatches <= n / 1000;
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// Boxes in 20 small clusters far apart: the SAH build separates the clusters first, so the
+// inner boxes add up to a few times the root's area. Empty bins used to make every split look
+// infinitely expensive and the build halve the primitives blindly, which leaves the inner
+// boxes nearly as big as the root
+bool checkBVHBuild() {
+  std::vector<Vec3f> clusters(20);
+  for (Vec3f &c : clusters) c = Vec3f(uniform(-10, 10), uniform(-10, 10), uniform(-10, 10));
+  std::vector<AABB> boxes(20000);
+  for (size_t i = 0; i < boxes.size(); i++) {
+    const Vec3f c = clusters[i % clusters.size()] + Vec3f(uniform(-0.3, 0.3), uniform(-0.3, 0.3), uniform(-0.3, 0.3));
+    const Float_t lo[3] = {c.x - 0.02f, c.y - 0.02f, c.z - 0.02f}, hi[3] = {c.x + 0.02f, c.y + 0.02f, c.z + 0.02f};
+    boxes[i].extend(lo);
+    boxes[i].extend(hi);
+  }
+  BVH bvh;
+  bvh.build(boxes, 1);
+
+  double inner_area = 0.0;
+  for (const BVHNode &node : bvh.nodes)
+    if (!node.isLeaf()) inner_area += node.bounds.area();
+  const double ratio = inner_area / bvh.bounds().area();
+  std::cout << "clustered BVH: inner box area " << ratio << " times the root's" << std::endl;
+
+  const bool ok = ratio <= 20.0;
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// A mesh with 8-bit quantized BVH nodes against the same mesh with float nodes. Quantized
+// boxes are conservative, so every hit must be the same
+bool checkCompressedBVH() {
+  const Direction black(0, 0, 0);
+  const Material material(black, Direction(0.5, 0.5, 0.5), black, black);
+  Scene compressed, reference;
+  const std::shared_ptr<TriangleMesh> mesh = randomMesh(5000, compressed.addMaterial(material));
+  reference.addMaterial(material);
+
+  auto copy = std::make_shared<TriangleMesh>(0);
+  copy->positions = mesh->positions;
+  copy->indices = mesh->indices;
+  mesh->compressBVH(true);
+  compressed.add(mesh);
+  reference.add(copy);
+
+  const int n = 4096, mismatches = countHitMismatches(compressed, reference, n);
+  std::cout << "quantized BVH against float BVH: " << mismatches << "/" << n << " hits differ" << std::endl;
+  const bool ok = mismatches == 0;
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// Builds a mesh BVH into an empty cache directory, then opens copies of the mesh: the first
+// maps the cached file, the others find it corrupted (a child index of the root, then a
+// primitive index of a packet) and must rebuild. Every copy must hit like the original
+bool checkBVHCache() {
+  const std::filesystem::path dir = std::filesystem::temp_directory_path() / ("diffrt_cache_" + std::to_string(getpid()));
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+
+  const Direction black(0, 0, 0);
+  const Material material(black, Direction(0.5, 0.5, 0.5), black, black);
+  const std::shared_ptr<TriangleMesh> mesh = randomMesh(5000, 0);
+  const auto open = [&](Scene &scene) {
+    scene.addMaterial(material);
+    auto copy = std::make_shared<TriangleMesh>(0);
+    copy->positions = mesh->positions;
+    copy->indices = mesh->indices;
+    copy->cacheBVH(dir.string());
+    scene.add(copy);
+    scene.bounds(); // Builds or maps the BVH
+    return copy;
+  };
+  // Overwrites 4 bytes of the only cache file
+  const auto corrupt = [&](const auto &offset) {
+    const std::filesystem::path file = std::filesystem::directory_iterator(dir)->path();
+    BVHCacheHeader header;
+    std::ifstream(file, std::ios::binary).read((char *)&header, sizeof(header));
+    std::fstream out(file, std::ios::binary | std::ios::in | std::ios::out);
+    out.seekp(offset(header));
+    const uint32_t garbage = 0xfffffff0;
+    out.write((const char *)&garbage, sizeof(garbage));
+  };
+
+  bool ok = true;
+  const auto expect = [&](const char *what, bool cached, Scene &scene, Scene &reference) {
+    const int n = 2048, mismatches = countHitMismatches(scene, reference, n);
+    std::cout << what << ": " << (cached ? "mapped" : "built") << ", " << mismatches << "/" << n << " hits differ" << std::endl;
+    ok &= mismatches == 0;
+  };
+
+  Scene built, mapped, bad_child, bad_prim;
+  ok &= !open(built)->cachedBVH();
+  const bool hit = open(mapped)->cachedBVH();
+  ok &= hit;
+  expect("BVH cache round trip", hit, mapped, built);
+
+  const size_t nodes_offset = cacheAlign(sizeof(BVHCacheHeader));
+  corrupt([&](const BVHCacheHeader &) { return nodes_offset + offsetof(BVHNode, left_first); });
+  const bool child_cached = open(bad_child)->cachedBVH();
+  ok &= !child_cached;
+  expect("corrupt child index", child_cached, bad_child, built);
+
+  corrupt([&](const BVHCacheHeader &header) {
+    const size_t leaf_offset = cacheAlign(nodes_offset + header.n_nodes * header.node_size);
+    const size_t packets_offset = cacheAlign(leaf_offset + (header.n_nodes + 1) * sizeof(uint32_t));
+    return packets_offset + offsetof(TrianglePacket<SIMD_WIDTH>, prim);
+  });
+  const bool prim_cached = open(bad_prim)->cachedBVH();
+  ok &= !prim_cached;
+  expect("corrupt primitive index", prim_cached, bad_prim, built);
+
+  std::filesystem::remove_all(dir);
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// Spheres, triangles and mesh instances added, removed and moved one at a time in a built
+// scene, against a scene built from scratch over the objects that are left. The incremental
+// top-level BVH must find the same hits
+bool checkDynamicScene() {
+  const Direction black(0, 0, 0);
+  const Material material(black, Direction(0.5, 0.5, 0.5), black, black);
+  Scene dynamic, rebuilt;
+  dynamic.addMaterial(material);
+  rebuilt.addMaterial(material);
+  const std::shared_ptr<TriangleMesh> mesh = randomMesh(50, 0);
+
+  const auto random_point = []() { return Point(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1)); };
+  const auto random_transform = []() {
+    return Transform::translate(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1)) *
+           Transform::rotate(Direction(uniform(-1, 1), uniform(-1, 1), 1), uniform(0, 6)) * Transform::scale(0.3, 0.3, 0.3);
+  };
+  const auto random_object = [&](int i) -> std::shared_ptr<IObject> {
+    if (i % 3 == 0) return std::make_shared<Sphere>(random_point(), uniform(0.05, 0.2), 0);
+    if (i % 3 == 1) return std::make_shared<Triangle>(random_point(), random_point(), random_point(), Direction(0, 0, 1), 0);
+    return std::make_shared<Instance>(mesh, random_transform());
+  };
+
+  std::vector<std::shared_ptr<IObject>> objects;
+  for (int i = 0; i < 30; i++) objects.push_back(random_object(i));
+  for (const auto &object : objects) dynamic.add(object);
+  dynamic.bounds(); // Builds the scene, the edits below are incremental
+
+  for (int step = 0; step < 60; step++) {
+    const int action = step % 3;
+    const size_t i = size_t(uniform(0, 1) * objects.size()) % objects.size();
+    if (action == 0) {
+      objects.push_back(random_object(step));
+      dynamic.add(objects.back());
+    } else if (action == 1) {
+      dynamic.remove(objects[i]);
+      objects.erase(objects.begin() + i);
+    } else if (auto instance = std::dynamic_pointer_cast<Instance>(objects[i])) {
+      instance->transform = random_transform();
+      dynamic.update(instance);
+    }
+  }
+  for (const auto &object : objects) rebuilt.add(object);
+
+  const int n = 4096, mismatches = countHitMismatches(dynamic, rebuilt, n);
+  std::cout << "incremental scene edits against a rebuilt scene: " << mismatches << "/" << n << " hits differ" << std::endl;
+  const bool ok = mismatches == 0 && dynamic.objects.size() == objects.size();
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// The same spheres and triangles under a uniform and a hashed grid top level, each with a
+// sphere cloud using the same grid, against BVHs everywhere. Grids only change which
+// primitives are tested, so every hit must be the same
+bool checkGrids() {
+  const Direction black(0, 0, 0);
+  const Material material(black, Direction(0.5, 0.5, 0.5), black, black);
+  const auto random_point = []() { return Point(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1)); };
+
+  std::vector<std::shared_ptr<IObject>> objects;
+  for (int i = 0; i < 300; i++) {
+    if (i % 2) objects.push_back(std::make_shared<Sphere>(random_point(), uniform(0.01, 0.1), 0));
+    else objects.push_back(std::make_shared<Triangle>(random_point(), random_point(), random_point(), Direction(0, 0, 1), 0));
+  }
+  std::vector<Float_t> cloud;
+  for (int i = 0; i < 4 * 3000; i++) cloud.push_back(i % 4 == 3 ? uniform(0.005, 0.03) : uniform(-1, 1));
+
+  const auto make_scene = [&](Scene &scene, Accel accel) {
+    scene.addMaterial(material);
+    scene.setAccel(accel);
+    for (const auto &object : objects) scene.add(object);
+    auto spheres = std::make_shared<SphereSet>(0);
+    for (size_t i = 0; i < cloud.size(); i += 4) spheres->addSphere(cloud[i], cloud[i + 1], cloud[i + 2], cloud[i + 3]);
+    spheres->setAccel(accel);
+    scene.add(spheres);
+  };
+  Scene bvh, grid, hashed;
+  make_scene(bvh, Accel::BVH);
+  make_scene(grid, Accel::Grid);
+  make_scene(hashed, Accel::HashedGrid);
+
+  const int n = 4096;
+  const int grid_mismatches = countHitMismatches(grid, bvh, n), hashed_mismatches = countHitMismatches(hashed, bvh, n);
+  std::cout << "grid against BVH: " << grid_mismatches << "/" << n << " hits differ, hashed grid: " << hashed_mismatches << "/" << n << std::endl;
+  const bool ok = grid_mismatches == 0 && hashed_mismatches == 0;
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// A learnable mesh, three instances of another learnable mesh and a triangle move through an
+// SGD step and Float::update, without any commit. The next queries must hit the moved
+// geometry, like a scene built from static copies of it
+bool checkParameterRefresh() {
+  const Direction black(0, 0, 0);
+  const Material material(black, Direction(0.5, 0.5, 0.5), black, black);
+  Scene learned, moved;
+  learned.addMaterial(material);
+  moved.addMaterial(material);
+
+  const std::shared_ptr<TriangleMesh> mesh = randomMesh(200, 0), shared = randomMesh(200, 0);
+  const auto triangle = std::make_shared<Triangle>(Point(-1, -1, 0), Point(1, -1, 0), Point(0, 1, 0), Direction(0, 0, 1), 0);
+  const Transform transforms[] = {Transform::translate(0.5, 0, 0) * Transform::scale(0.5, 0.5, 0.5),
+                                  Transform::translate(-0.5, 0, 0) * Transform::scale(0.5, 0.5, 0.5),
+                                  Transform::rotate(Direction(0, 1, 0), 1.0) * Transform::scale(0.5, 0.5, 0.5)};
+  learned.add(mesh);
+  for (const Transform &transform : transforms) learned.add(std::make_shared<Instance>(shared, transform));
+  learned.add(triangle);
+  learned.bounds(); // Builds every BVH at the current vertices
+
+  // A made-up gradient on every vertex coordinate, one step of SGD follows it
+  optim::SGD optimizer(1.0);
+  for (const auto &m : {mesh, shared}) {
+    m->requires_grad(true);
+    optimizer.add_param(m->parameters());
+  }
+  optimizer.zero_grad();
+  for (const auto &m : {mesh, shared})
+    for (const Float &param : m->parameters()) *param._ctx->grad = uniform(-0.2, 0.2);
+  optimizer.step();
+  triangle->v2.y.update(0.5);
+  triangle->v1.x.update(0.2);
+
+  const auto copy = [](const TriangleMesh &m) {
+    auto c = std::make_shared<TriangleMesh>(0);
+    c->positions = m.positions;
+    c->indices = m.indices;
+    return c;
+  };
+  moved.add(copy(*mesh));
+  const std::shared_ptr<TriangleMesh> shared_copy = copy(*shared);
+  for (const Transform &transform : transforms) moved.add(std::make_shared<Instance>(shared_copy, transform));
+  moved.add(std::make_shared<Triangle>(Point(-1, -1, 0), Point(0.2, -1, 0), Point(0, 0.5, 0), Direction(0, 0, 1), 0));
+
+  const int n = 4096, mismatches = countHitMismatches(learned, moved, n);
+  std::cout << "after an SGD step and Float::update: " << mismatches << "/" << n << " hits differ from the moved geometry" << std::endl;
+  const bool ok = mismatches == 0;
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// A rough lobe's sample weight averages to its albedo, which quadrature over the sphere gives,
+// and its roughness gradient to the finite difference of that albedo
+bool checkRoughnessGradient() {
+  const Vec3f n(0, 0, 1), wo(std::sin(0.7f), 0, std::cos(0.7f));
+  const Float_t r = 0.5, h = 1e-2;
+  const auto check = [&](const char *name, const auto &lobe) {
+    // Midpoint rule over (cos theta, phi) of f * |cos|, first channel
+    const auto albedo = [&](Float_t rough) {
+      const int n_cos = 1000, n_phi = 1000;
+      double sum = 0.0;
+      for (int i = 0; i < n_cos; i++) {
+        const Float_t cos = -1 + 2 * (i + 0.5f) / n_cos, sin = std::sqrt(1 - cos * cos);
+        for (int j = 0; j < n_phi; j++) {
+          const Float_t phi = 2 * M_PI * (j + 0.5f) / n_phi;
+          const Vec3f wi(sin * std::cos(phi), sin * std::sin(phi), cos);
+          sum += lobe.evaluate(wo, wi, n, true, rough).x * std::abs(cos);
+        }
+      }
+      return sum * (2.0 / n_cos) * (2 * M_PI / n_phi);
+    };
+    const double a = albedo(r), fd = (albedo(r + h) - albedo(r - h)) / (2 * h);
+
+    const int samples = 20000;
+    double w_sum = 0.0, w_squared = 0.0, g_sum = 0.0, g_squared = 0.0;
+    for (int i = 0; i < samples; i++) {
+      const Float_t before = lobe.roughness.grad();
+      Float w = lobe.sample(Direction(wo), Direction(n), true).weight.x;
+      w.backward();
+      const double g = lobe.roughness.grad() - before;
+      w_sum += w.value();
+      w_squared += w.value() * w.value();
+      g_sum += g;
+      g_squared += g * g;
+    }
+    const auto z = [&](double sum, double sum_squared, double expected) {
+      const double mean = sum / samples;
+      return (mean - expected) / std::sqrt(std::max((sum_squared / samples - mean * mean) / samples, 1e-12));
+    };
+    const double z_w = z(w_sum, w_squared, a), z_g = z(g_sum, g_squared, fd);
+    std::cout << name << ": albedo sampled " << w_sum / samples << ", quadrature " << a << " (z = " << z_w << "); "
+              << "d / d roughness sampled " << g_sum / samples << ", finite differences " << fd << " (z = " << z_g << ")" << std::endl;
+    return std::abs(z_w) <= 4.0 && std::abs(z_g) <= 4.0;
+  };
+
+  const Direction k(0.8, 0.8, 0.8);
+  const bool ok = check("GGX", GGXBSDF{k, Float(r, true)}) &
+                  check("GGX conductor", GGXBSDF{k, Float(r, true), Direction(0.18, 0.42, 1.37), Direction(3.42, 2.35, 1.77)}) &
+                  check("rough dielectric", RoughRefractiveBSDF{k, Float(r, true), 1.0f, 1.5f});
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// Mean of samples of f and its z-score against the expected value
+struct SampleMean {
+  double sum = 0.0, sum_squared = 0.0;
+  int n = 0;
+
+  void add(double x) { sum += x; sum_squared += x * x; n++; }
+  double mean() const { return sum / n; }
+  double variance() const { return std::max(sum_squared / n - mean() * mean(), 0.0); }
+  double z(double expected) const { return (mean() - expected) / std::sqrt(std::max(variance() / n, 1e-12)); }
+};
+
+// z score of the difference of the means of two independent samples
+double zDifference(const SampleMean &a, const SampleMean &b) {
+  return (a.mean() - b.mean()) / std::sqrt(std::max(a.variance() / a.n + b.variance() / b.n, 1e-12));
+}
+
+// Red channel of the radiance of `paths` independent paths along one camera ray
+SampleMean tracePaths(const Scene &scene, const Ray3f &camera, int depth, int paths) {
+  SampleMean L;
+  for (int i = 0; i < paths; i++) L.add(Li(scene, camera, depth, 0.0f, RayCone{0, 0}).x);
+  return L;
+}
+
+// Smooth dielectric sampling, entering and leaving the object at a few angles: the lobe
+// reflects as often as fresnelDielectric says (always under total internal reflection), every
+// weight is k, and the mean of weight * cos(wi) and its gradient with respect to n2 match the
+// exact F cos(theta_i) - (1 - F) cos(theta_t) and its finite difference
+bool checkDielectricFresnel() {
+  const Float_t n1 = 1.0f, n2 = 1.5f, h = 1e-3f;
+  const Vec3f n(0, 0, 1);
+  const auto expected = [&](double cos, bool into, double inside) {
+    const double ni = into ? n1 : inside, nt = into ? inside : n1;
+    const double F = fresnelDielectric(cos, ni, nt), sin2T = (ni / nt) * (ni / nt) * (1 - cos * cos);
+    return sin2T >= 1 ? cos : F * cos - (1 - F) * std::sqrt(1 - sin2T);
+  };
+  // Exact results, e.g. under total internal reflection, have no variance to test against
+  const auto agrees = [](const SampleMean &sample, double expected) {
+    return std::abs(sample.z(expected)) <= 4.0 || std::abs(sample.mean() - expected) <= 1e-5;
+  };
+
+  bool ok = true;
+  for (const bool into : {true, false}) {
+    for (const Float_t cos : {0.95f, 0.8f, 0.25f}) {
+      RefractiveBSDF lobe{Direction(1, 1, 1), n1, Float(n2, true)};
+      const Vec3f wo(std::sqrt(1 - cos * cos), 0, cos);
+      const double F = fresnelDielectric<double>(cos, into ? n1 : n2, into ? n2 : n1);
+
+      const int samples = 20000;
+      SampleMean reflected, projected, gradient;
+      double weight_error = 0.0;
+      for (int i = 0; i < samples; i++) {
+        const Float_t before = lobe.n2.grad();
+        const BSDFSample<Float> s = lobe.sample(Direction(wo), Direction(n), into);
+        Float p = s.weight.x * s.wi.dot(Direction(n));
+        p.backward();
+        reflected.add((s.flags & LOBE_REFLECTION) != 0);
+        weight_error = std::max(weight_error, std::abs(s.weight.x.value() - 1.0));
+        projected.add(p.value());
+        gradient.add(lobe.n2.grad() - before);
+      }
+      const double exact = expected(cos, into, n2), fd = (expected(cos, into, n2 + h) - expected(cos, into, n2 - h)) / (2 * h);
+      std::cout << "dielectric " << (into ? "entering" : "leaving") << " at cos " << cos << ": reflected " << reflected.mean()
+                << ", Fresnel " << F << " (z = " << reflected.z(F) << "), weight error " << weight_error << "; mean cos "
+                << projected.mean() << ", exact " << exact << "; d / d n2 " << gradient.mean() << ", finite differences " << fd
+                << " (z = " << gradient.z(fd) << ")" << std::endl;
+      ok &= agrees(reflected, F) && weight_error <= 1e-5 && agrees(projected, exact) && agrees(gradient, fd);
+    }
+  }
+
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// The environment map's pdf integrates to 1 and its samples fall on the texels in proportion
+// to it. Along a camera ray, a diffuse sphere under the map reflects the radiance that
+// quadrature over the hemisphere gives (its albedo under a white sky), with less variance
+// than without NEE, and the gradient of each texel matches the finite difference of that
+// quadrature. Path and wavefront renders of the sphere agree
+bool checkEnvironmentMap() {
+  const int w = 16, h = 8, sun = 3 * w + 11; // The sun is in front of the sphere
+  std::vector<Float_t> sky(3 * w * h);
+  for (Float_t &v : sky) v = uniform(0.1, 1.0);
+  for (int c = 0; c < 3; c++) sky[3 * sun + c] = 200;
+  const auto env = std::make_shared<EnvironmentMap>(w, h, sky);
+  bool ok = true;
+
+  // Integrals over the sphere, by the midpoint rule on a grid of s x s points per texel in
+  // (theta, phi). f * sin(theta) is smooth inside a texel
+  const auto integrate = [&](const auto &f) {
+    const int s = 8;
+    double sum = 0.0;
+    for (int i = 0; i < h * s; i++) {
+      const Float_t theta = M_PI * (i + 0.5f) / (h * s);
+      for (int j = 0; j < w * s; j++) {
+        const Float_t phi = 2 * M_PI * (j + 0.5f) / (w * s);
+        sum += f(Vec3f(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi))) * std::sin(theta);
+      }
+    }
+    return sum * (M_PI / (h * s)) * (2 * M_PI / (w * s));
+  };
+  const double total = integrate([&](const Vec3f &d) { return env->pdf(d); });
+  std::cout << "environment map pdf integrates to " << total << std::endl;
+  ok &= std::abs(total - 1) < 1e-3;
+
+  // Chi-square of the texel each sample falls on against its probability
+  const int samples = 200000;
+  std::vector<int> count(w * h, 0);
+  for (int i = 0; i < samples; i++) {
+    Vec3f d;
+    Float_t pdf;
+    env->sample(d, pdf);
+    const Float_t theta = std::acos(std::clamp(d.y, -1.0f, 1.0f));
+    Float_t phi = std::atan2(d.z, d.x);
+    if (phi < 0) phi += 2 * M_PI;
+    count[std::min(int(theta / M_PI * h), h - 1) * w + std::min(int(phi / (2 * M_PI) * w), w - 1)]++;
+  }
+  double chi2 = 0.0;
+  for (int t = 0; t < w * h; t++) {
+    const Float_t theta = M_PI * (t / w + 0.5f) / h, phi = 2 * M_PI * (t % w + 0.5f) / w;
+    const Vec3f d(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+    const double expected = samples * env->pdf(d) * std::sin(theta) * (M_PI / h) * (2 * M_PI / w);
+    chi2 += (count[t] - expected) * (count[t] - expected) / expected;
+  }
+  const int dof = w * h - 1;
+  std::cout << "environment map samples against the pdf: chi2 " << chi2 << " with " << dof << " degrees of freedom" << std::endl;
+  ok &= chi2 < dof + 6 * std::sqrt(2.0 * dof);
+
+  // Diffuse sphere seen head on, the hit normal is -z
+  const Float_t albedo = 0.5;
+  const Direction black(0, 0, 0);
+  Scene scene;
+  scene.add(std::make_shared<Sphere>(Point(0, 0, 0), 0.5, scene.addMaterial(Material(black, Direction(albedo, albedo, albedo), black, black))));
+  const Ray3f camera(Point3f(0, 0, -3), Vec3f(0, 0, 1));
+  const int depth = 3, paths = 20000;
+  const auto reflected = [&](const EnvironmentMap &map) {
+    return integrate([&](const Vec3f &d) { return map.eval<float>(d).x * std::max(-d.z, 0.0f); }) * albedo * M_1_PI;
+  };
+  const auto trace = [&](const std::shared_ptr<EnvironmentMap> &map, bool nee) {
+    scene.setEnvironment(map);
+    scene.setAreaLightSampling(nee);
+    SampleMean L;
+    for (int i = 0; i < paths; i++) L.add(Li(scene, camera, depth, 0.0f, RayCone{0, 0}).x);
+    return L;
+  };
+
+  const SampleMean white = trace(std::make_shared<EnvironmentMap>(w, h, std::vector<Float_t>(3 * w * h, 1.0f)), true);
+  std::cout << "diffuse sphere under a white sky: " << white.mean() << " for an albedo of " << albedo << std::endl;
+  ok &= std::abs(white.mean() - albedo) <= 4 * std::sqrt(white.variance() / paths) + 1e-4;
+
+  const double expected = reflected(*env);
+  const SampleMean nee = trace(env, true), bsdf = trace(env, false);
+  std::cout << "diffuse sphere under a sun: " << nee.mean() << ", quadrature " << expected << " (z = " << nee.z(expected)
+            << "), variance " << nee.variance() << " with NEE and " << bsdf.variance() << " without" << std::endl;
+  ok &= std::abs(nee.z(expected)) <= 4.0 && nee.variance() < bsdf.variance();
+
+  // Gradients of the sun, a texel in front of the sphere and one behind it
+  const int checked[] = {sun, 5 * w + 13, 4 * w + 3};
+  const Float_t step = 0.05;
+  std::vector<Direction> &texels = env->learnable();
+  SampleMean grads[3];
+  for (int i = 0; i < paths; i++) {
+    Float_t before[3];
+    for (int k = 0; k < 3; k++) before[k] = texels[checked[k]].x.grad();
+    Li(scene, Ray(camera), depth, 0.0f, RayCone{0, 0}).x.backward();
+    for (int k = 0; k < 3; k++) grads[k].add(texels[checked[k]].x.grad() - before[k]);
+  }
+  for (int k = 0; k < 3; k++) {
+    std::vector<Float_t> up = sky, down = sky;
+    up[3 * checked[k]] += step;
+    down[3 * checked[k]] -= step;
+    const double fd = (reflected(EnvironmentMap(w, h, up)) - reflected(EnvironmentMap(w, h, down))) / (2 * step);
+    std::cout << "d L / d texel " << checked[k] << ": sampled " << grads[k].mean() << ", finite differences " << fd
+              << " (z = " << grads[k].z(fd) << ")" << std::endl;
+    ok &= std::abs(grads[k].z(fd)) <= 4.0;
+  }
+
+  // Path against wavefront renders, z-test of the mean difference as in checkAreaLightInterior
+  const int size = 16, spp = 16;
+  std::vector<Vec3f> a(size * size), b(size * size);
+  render(scene, a.data(), size, size, depth, spp);
+  renderWavefront(scene, b.data(), size, size, depth, spp);
+  SampleMean difference;
+  for (int i = 0; i < size * size; i++) difference.add((a[i].x + a[i].y + a[i].z - b[i].x - b[i].y - b[i].z) / 3);
+  std::cout << "environment lit path - wavefront render: mean difference " << difference.mean() << " (z = " << difference.z(0) << ")" << std::endl;
+  ok &= std::abs(difference.z(0)) <= 4.0;
+
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// Square [-s, s]^2 at depth z facing the camera, with UVs from 0 to 1
+std::shared_ptr<TriangleMesh> texturedQuad(Float_t s, Float_t z, uint32_t material) {
+  auto quad = std::make_shared<TriangleMesh>(material);
+  const Float_t corners[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+  for (const auto &c : corners) {
+    quad->addVertex(c[0] * s, c[1] * s, z);
+    quad->addUV((c[0] + 1) / 2, (c[1] + 1) / 2);
+  }
+  quad->addTriangle(0, 1, 2);
+  quad->addTriangle(0, 2, 3);
+  return quad;
+}
+
+// Constant albedo, roughness and emission maps render like the constants they multiply into.
+// Over a far footprint, filtered lookups of a checkerboard vary much less than full-resolution
+// ones. Through a camera path that is deterministic (one diffuse lobe of albedo 1, a point
+// light, one bounce), the gradient of every texel of a learnable albedo map matches finite
+// differences of the plain render
+bool checkTextures() {
+  bool ok = true;
+  const Direction black(0, 0, 0);
+  const auto constant = [](Float_t value) { return std::make_shared<Texture>(4, 4, std::vector<Float_t>(48, value)); };
+
+  const auto render_with = [&](bool maps, std::vector<Vec3f> &image) {
+    Scene scene;
+    Material wall(black, Direction(0.5, 0.5, 0.5), black, black), lamp(Direction(1, 1, 1), black, black, black);
+    wall.addLobe(GGXBSDF{Direction(0.5, 0.5, 0.5), 0.6});
+    if (maps) {
+      wall.albedo_map = constant(0.8);
+      wall.roughness_map = constant(0.5);
+      lamp.emission_map = constant(2);
+    } else {
+      wall.lobe<DiffuseBSDF>().k = Direction(0.4, 0.4, 0.4);
+      wall.lobe<GGXBSDF>().k = Direction(0.4, 0.4, 0.4);
+      wall.lobe<GGXBSDF>().roughness = 0.3;
+      lamp.emission = Direction(2, 2, 2);
+      wall.update();
+    }
+    scene.add(texturedQuad(1.5, 1, scene.addMaterial(wall)));
+    scene.add(texturedQuad(0.3, -1, scene.addMaterial(lamp)));
+    scene.add(std::make_shared<PointLight>(Point(0.5, 0.5, -1), Direction(2, 2, 2)));
+    image.resize(24 * 24);
+    render(scene, image.data(), 24, 24, 4, 16);
+  };
+  std::vector<Vec3f> a, b;
+  render_with(true, a);
+  render_with(false, b);
+  SampleMean difference;
+  for (size_t i = 0; i < a.size(); i++) difference.add((a[i].x + a[i].y + a[i].z - b[i].x - b[i].y - b[i].z) / 3);
+  std::cout << "constant maps - constant parameters: mean difference " << difference.mean() << " (z = " << difference.z(0) << ")" << std::endl;
+  ok &= std::abs(difference.z(0)) <= 4.0;
+
+  // 64x64 checkerboard, footprints 8 texels wide
+  std::vector<Float_t> checker(64 * 64 * 3);
+  for (int t = 0; t < 64 * 64; t++)
+    for (int c = 0; c < 3; c++) checker[3 * t + c] = (t / 64 + t % 64) % 2;
+  const Texture board(64, 64, checker);
+  SampleMean filtered, full;
+  for (int i = 0; i < 4096; i++) {
+    const Float_t u = uniform(0.3, 0.3 + 8 / 64.0f), v = uniform(0.6, 0.6 + 8 / 64.0f);
+    filtered.add(board.lookup<float>(TexCoord{u, v, 8 / 64.0f}).x);
+    full.add(board.lookup<float>(TexCoord{u, v, 0}).x);
+  }
+  std::cout << "far checkerboard lookups: variance " << filtered.variance() << " filtered, " << full.variance() << " at full resolution" << std::endl;
+  ok &= filtered.variance() * 3 <= full.variance();
+
+  std::vector<Float_t> rgb(8 * 8 * 3);
+  for (Float_t &value : rgb) value = uniform(0.2, 0.9);
+  const auto albedo = std::make_shared<Texture>(8, 8, rgb);
+  std::vector<Direction> &texels = albedo->learnable();
+  Scene scene;
+  Material material(black, Direction(1, 1, 1), black, black);
+  material.albedo_map = albedo;
+  scene.add(texturedQuad(1, 0, scene.addMaterial(material)));
+  scene.add(std::make_shared<PointLight>(Point(0.2, -0.3, -2), Direction(5, 5, 5)));
+
+  const Ray3f camera(Point3f(0, 0, -3), Vec3f(0.13, 0.27, 3));
+  Li(scene, Ray(camera), 1, 0.0f, RayCone{0, 0}).x.backward();
+  const Float_t step = 1e-2;
+  int reached = 0, mismatches = 0;
+  for (Direction &texel : texels) {
+    const Float_t value = texel.x.value();
+    texel.x.update(value + step);
+    const Float_t up = Li(scene, camera, 1, 0.0f, RayCone{0, 0}).x;
+    texel.x.update(value - step);
+    const Float_t down = Li(scene, camera, 1, 0.0f, RayCone{0, 0}).x;
+    texel.x.update(value);
+
+    const Float_t fd = (up - down) / (2 * step), g = texel.x.grad();
+    reached += g != 0;
+    mismatches += std::abs(g - fd) > 1e-3f + 1e-2f * std::abs(fd);
+  }
+  std::cout << "albedo texel gradients: " << reached << " texels reached, " << mismatches << "/" << texels.size()
+            << " differ from finite differences" << std::endl;
+  ok &= reached > 0 && mismatches == 0;
+
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// The triangles of an emissive mesh, placed directly and through an instance, get the MIS
+// weights of the same triangles added one by one: hits find their own triangle's area light,
+// with its power and pdf in world space. Emissive meshes then light a wall, a quad placed
+// directly, and through instances random triangles and a quad with textured emission. Along
+// camera rays to the wall, paths with area light sampling on and off agree, with less variance on
+bool checkMeshAreaLights() {
+  const Direction black(0, 0, 0);
+  bool ok;
+  {
+    const Material lamp(Direction(3, 3, 3), black, black, black);
+    Scene meshes, triangles;
+    meshes.addMaterial(lamp);
+    triangles.addMaterial(lamp);
+    const std::shared_ptr<TriangleMesh> direct = randomMesh(20, 0), shared = randomMesh(20, 0);
+    const Transform transform = Transform::translate(0.3, 0.2, 0) * Transform::rotate(Direction(0, 1, 0), 0.7) * Transform::scale(0.5, 0.8, 0.6);
+    meshes.add(direct);
+    meshes.add(std::make_shared<Instance>(shared, transform));
+
+    std::vector<Point3f> corners; // World vertices of every triangle
+    for (const auto &[mesh, placed] : {std::make_pair(direct, false), std::make_pair(shared, true)})
+      for (uint32_t i : mesh->indices) corners.push_back(placed ? transform(mesh->vertex<float>(i)) : mesh->vertex<float>(i));
+    for (size_t i = 0; i < corners.size(); i += 3) {
+      const Point3f &a = corners[i], &b = corners[i + 1], &c = corners[i + 2];
+      triangles.add(std::make_shared<Triangle>(Point(a.x, a.y, a.z), Point(b.x, b.y, b.z), Point(c.x, c.y, c.z),
+                                               Direction((b - a).cross(c - a).normalize()), 0));
+    }
+
+    int hits = 0, mismatches = 0;
+    for (int i = 0; i < 2048; i++) {
+      // From outside the meshes towards a point of a random triangle
+      const Vec3f x(uniform(-3, 3), uniform(-3, 3), -3);
+      const size_t t = 3 * size_t(uniform(0, corners.size() / 3 - 1e-3f));
+      const Float_t u = uniform(0, 1), v = uniform(0, 1 - u);
+      const Vec3f target = Vec3f(corners[t]) * (1 - u - v) + Vec3f(corners[t + 1]) * u + Vec3f(corners[t + 2]) * v;
+      const Ray3f ray(Point3f(x.x, x.y, x.z), (target - x).normalize());
+
+      SurfaceHit<float> a, b;
+      if (!meshes.intersect(ray, a) || !triangles.intersect(ray, b)) continue;
+      hits++;
+      const Vec3f pa(a.p), pb(b.p);
+      const Float_t wa = meshes.emissionMISWeight(a.light, x, pa, Vec3f(a.n), 1.0f);
+      const Float_t wb = triangles.emissionMISWeight(b.light, x, pb, Vec3f(b.n), 1.0f);
+      mismatches += a.light < 0 || std::abs(wa - wb) > 1e-3f * std::max(1.0f, wb);
+    }
+    std::cout << "emissive mesh triangles against single triangles: " << mismatches << "/" << hits << " MIS weights differ" << std::endl;
+    ok = hits > 0 && mismatches == 0;
+  }
+
+  Scene scene;
+  std::vector<Float_t> checker(8 * 8 * 3);
+  for (int t = 0; t < 8 * 8; t++)
+    for (int c = 0; c < 3; c++) checker[3 * t + c] = (t / 8 + t % 8) % 2 ? 1.0f : 0.2f;
+  Material textured(Direction(4, 4, 4), black, black, black);
+  textured.emission_map = std::make_shared<Texture>(8, 8, checker);
+
+  scene.add(texturedQuad(1.5, 1, scene.addMaterial(Material(black, Direction(0.7, 0.7, 0.7), black, black))));
+  const uint32_t lamp = scene.addMaterial(Material(Direction(3, 3, 3), black, black, black));
+  scene.add(texturedQuad(0.15, 0.5, lamp));
+  scene.add(std::make_shared<Instance>(randomMesh(6, lamp), Transform::translate(0.5, -0.5, -0.2) * Transform::scale(0.25, 0.25, 0.25)));
+  scene.add(std::make_shared<Instance>(texturedQuad(0.3, 0, scene.addMaterial(textured)),
+                                       Transform::translate(-0.6, 0.6, 0.3) * Transform::rotate(Direction(1, 0, 0), 1.2)));
+
+  // Along camera rays to points of the wall, the radiance with and without area light sampling
+  const Vec3f targets[] = {{-0.9, 0.9, 1}, {-0.3, 0.9, 1}, {-0.9, 0.2, 1}, {0.9, -0.9, 1}, {0.9, 0.9, 1}};
+  const int paths = 20000;
+  double variance_on = 0.0, variance_off = 0.0;
+  for (const Vec3f &target : targets) {
+    const Vec3f origin(0, 0, -3);
+    const Ray3f camera(Point3f(origin.x, origin.y, origin.z), (target - origin).normalize());
+    SampleMean on, off;
+    for (const auto &[nee, L] : {std::make_pair(true, &on), std::make_pair(false, &off)}) {
+      scene.setAreaLightSampling(nee);
+      for (int i = 0; i < paths; i++) L->add(Li(scene, camera, 3, 0.0f, RayCone{0, 0}).x);
+    }
+    const double z = (on.mean() - off.mean()) / std::sqrt(std::max((on.variance() + off.variance()) / paths, 1e-12));
+    std::cout << "emissive meshes towards (" << target.x << ", " << target.y << "): " << on.mean() << " with NEE, "
+              << off.mean() << " without (z = " << z << ")" << std::endl;
+    ok &= std::abs(z) <= 4.0;
+    variance_on += on.variance();
+    variance_off += off.variance();
+  }
+  std::cout << "emissive meshes: variance " << variance_on << " with NEE and " << variance_off << " without" << std::endl;
+  ok &= variance_on < variance_off;
+
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+template <typename T>
+void saveImage(const std::string &filename, const Vec3<T> *image, int width, int height);
 void CornellBox(Scene &scene);
-inline Float tonemap(Float x, Float_t clmp = 1.0, Float_t gamma = 2.2) {
-  return (clamp(x, 0, clmp) / clmp).pow(1.0 / gamma);
+
+// Point lights on both sides of a rough dielectric slab. Inside it, NEE reaches those behind
+// through transmission, and every way of picking lights gives the same radiance: all of them,
+// by power and through the light BVH, which must not cull lights behind a transmissive surface
+bool checkTransmittedLightSampling() {
+  const Direction black(0, 0, 0);
+  Scene scene;
+  Material glass(black, black, black, black);
+  glass.addLobe(RoughRefractiveBSDF{Direction(1, 1, 1), 0.5, 1.0, 1.5});
+
+  // Front face at z = 0 towards the camera, back face at z = 0.1 away from it
+  auto slab = std::make_shared<TriangleMesh>(scene.addMaterial(glass));
+  for (const Float_t z : {0.0f, 0.1f})
+    for (const auto &c : {std::make_pair(-2, -2), std::make_pair(2, -2), std::make_pair(2, 2), std::make_pair(-2, 2)})
+      slab->addVertex(c.first, c.second, z);
+  slab->addTriangle(0, 2, 1);
+  slab->addTriangle(0, 3, 2);
+  slab->addTriangle(4, 5, 6);
+  slab->addTriangle(4, 6, 7);
+  scene.add(slab);
+  // A 3x3 grid of lights behind the slab and another one in front
+  for (int i = 0; i < 18; i++)
+    scene.add(std::make_shared<PointLight>(Point(0.4 * (i % 3 - 1), 0.4 * (i / 3 % 3 - 1), i < 9 ? 0.5 : -0.8), Direction(1, 1, 1) * 0.1));
+
+  bool ok = true;
+  const int paths = 20000;
+  for (const Vec3f &target : {Vec3f(0, 0, 0), Vec3f(0.3, -0.2, 0), Vec3f(-0.4, 0.4, 0)}) {
+    const Vec3f origin(0, 0, -3);
+    const Ray3f camera(Point3f(origin.x, origin.y, origin.z), (target - origin).normalize());
+    scene.setLightSampling(LightSampling::All);
+    const SampleMean all = tracePaths(scene, camera, 3, paths);
+    scene.setLightSampling(LightSampling::Power);
+    const SampleMean power = tracePaths(scene, camera, 3, paths);
+    scene.setLightSampling(LightSampling::BVH);
+    const SampleMean bvh = tracePaths(scene, camera, 3, paths);
+
+    std::cout << "slab towards (" << target.x << ", " << target.y << "): " << all.mean() << " with all lights, "
+              << power.mean() << " by power (z = " << zDifference(power, all) << "), " << bvh.mean()
+              << " through the light BVH (z = " << zDifference(bvh, all) << ")" << std::endl;
+    ok &= std::abs(zDifference(power, all)) <= 4.0 && std::abs(zDifference(bvh, all)) <= 4.0;
+  }
+
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// The Cornell box with 200 more point lights, rendered with NEE to all of them, to one picked
+// by power and to one picked through the light BVH. Both sampled renders agree with the
+// exhaustive one, and the light BVH, which favours the lights near each point, is less noisy
+// than picking by power alone
+bool checkLightSelection() {
+  Scene scene;
+  CornellBox(scene);
+  for (int i = 0; i < 200; i++)
+    scene.add(std::make_shared<PointLight>(Point(uniform(-0.9, 0.9), uniform(-0.9, 0.9), uniform(0.1, 0.9)),
+                                           Direction(1, 1, 1) * uniform(0.002, 0.02)));
+
+  const int width = 32, height = 32, depth = 2, spp = 8;
+  const auto render_with = [&](LightSampling mode, std::vector<Vec3f> &image) {
+    scene.setLightSampling(mode);
+    image.resize(width * height);
+    render(scene, image.data(), width, height, depth, spp);
+  };
+  const auto gray = [](const Vec3f &c) { return (c.x + c.y + c.z) / 3; };
+
+  std::vector<Vec3f> all;
+  render_with(LightSampling::All, all);
+  bool ok = true;
+  double variance[2];
+  for (const LightSampling mode : {LightSampling::Power, LightSampling::BVH}) {
+    // The mean difference to the exhaustive render, and the spread of two renders in this mode
+    std::vector<Vec3f> a, b;
+    render_with(mode, a);
+    render_with(mode, b);
+    SampleMean difference, noise;
+    for (int i = 0; i < width * height; i++) {
+      difference.add(gray(a[i]) - gray(all[i]));
+      noise.add(gray(a[i]) - gray(b[i]));
+    }
+    const bool bvh = mode == LightSampling::BVH;
+    variance[bvh] = noise.variance();
+    std::cout << "200 point lights, " << (bvh ? "light BVH" : "power") << " - all: mean difference " << difference.mean()
+              << " (z = " << difference.z(0) << "), variance " << variance[bvh] << std::endl;
+    ok &= std::abs(difference.z(0)) <= 4.0;
+  }
+  ok &= variance[1] <= variance[0];
+
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+// A GGX floor, partly diffuse, under a spherical light. Along camera rays to the floor,
+// light sampling alone (MISHeuristic::None), BSDF sampling alone and both combined with the
+// balance or power heuristic give the same radiance. Over the rays, which see the light's
+// highlight as well as diffuse reflection, both combinations have less variance relative to
+// the mean than either strategy alone
+bool checkMIS() {
+  const Direction black(0, 0, 0);
+  Scene scene;
+  Material floor(black, Direction(0.3, 0.3, 0.3), black, black);
+  floor.addLobe(GGXBSDF{Direction(0.6, 0.6, 0.6), 0.1});
+  const uint32_t material = scene.addMaterial(floor);
+  scene.add(std::make_shared<Triangle>(Point(-2, -1, -1), Point(2, -1, -1), Point(-2, -1, 3), Direction(0, 1, 0), material));
+  scene.add(std::make_shared<Triangle>(Point(2, -1, -1), Point(2, -1, 3), Point(-2, -1, 3), Direction(0, 1, 0), material));
+  scene.add(std::make_shared<Sphere>(Point(0, 0, 1.5), 0.5, scene.addMaterial(Material(Direction(5, 5, 5), black, black, black))));
+
+  struct Strategy {
+    const char *name;
+    bool nee;
+    MISHeuristic heuristic;
+    double variance = 0.0;
+  } strategies[] = {{"BSDF sampling", false, MISHeuristic::Power},
+                    {"light sampling", true, MISHeuristic::None},
+                    {"balance heuristic", true, MISHeuristic::Balance},
+                    {"power heuristic", true, MISHeuristic::Power}};
+
+  bool ok = true;
+  const int paths = 20000;
+  // The first ray sees the reflection of the light, the others glossy and diffuse falloff
+  for (const Vec3f &target : {Vec3f(0, -1, -0.75), Vec3f(0.2, -1, -0.5), Vec3f(-0.6, -1, 0.8)}) {
+    const Vec3f origin(0, 0, -3);
+    const Ray3f camera(Point3f(origin.x, origin.y, origin.z), (target - origin).normalize());
+    SampleMean L[4];
+    for (int i = 0; i < 4; i++) {
+      scene.setAreaLightSampling(strategies[i].nee);
+      scene.setMIS(strategies[i].heuristic);
+      L[i] = tracePaths(scene, camera, 2, paths);
+      strategies[i].variance += L[i].variance() / std::max(L[i].mean() * L[i].mean(), 1e-12);
+    }
+
+    std::cout << "GGX floor at (" << target.x << ", " << target.z << "): " << L[0].mean() << " by BSDF sampling";
+    for (int i = 1; i < 4; i++) {
+      std::cout << ", " << L[i].mean() << " by " << strategies[i].name << " (z = " << zDifference(L[i], L[0]) << ")";
+      ok &= std::abs(zDifference(L[i], L[0])) <= 4.0;
+    }
+    std::cout << std::endl;
+  }
+
+  std::cout << "GGX floor relative variance:";
+  for (const Strategy &strategy : strategies) std::cout << " " << strategy.variance << " by " << strategy.name << ",";
+  std::cout << std::endl;
+  for (int i = 2; i < 4; i++) ok &= strategies[i].variance < std::min(strategies[0].variance, strategies[1].variance);
+
+  std::cout << (ok ? "OK" : "FAILED") << std::endl;
+  return ok;
+}
+
+inline Float_t tonemap(Float_t x, Float_t clmp = 1.0, Float_t gamma = 2.2) {
+  return std::pow(std::clamp(x, (Float_t)0.0, clmp) / clmp, 1.0 / gamma);
 }
 
-int main() {
+int main(int argc, char **argv) {
   const int width = 100,
             height = 100,
             spp = 128,
@@ -100,14 +1354,39 @@ int main() {
   Scene scene;
   CornellBox(scene);
 
+  // 1 traces every bounce of the image as one sorted batch instead of path by path
+  #define WAVEFRONT 0
+  #if WAVEFRONT
+  const auto render = [](const Scene &scene, auto *image, int width, int height, int depth, int spp) {
+    renderWavefront(scene, image, width, height, depth, spp);
+  };
+  #endif
+
+  // Checks that the plain-float renderer used for the target matches the differentiable one, that
+  // area light sampling agrees with BSDF sampling inside an emitter, that meshes load, that SAH
+  // builds separate clustered primitives, that instances, quantized and cached BVHs, incremental
+  // scene edits and grids hit like the meshes and structures they stand for, that hits follow
+  // parameter updates, that sampled roughness gradients match finite differences, that smooth
+  // dielectrics reflect and refract by Fresnel with the right n2 gradient, and that environment
+  // lighting is sampled and differentiated without bias, as are textures, that emissive meshes are
+  // sampled as area lights, that lights picked by power or through the light BVH match all lights,
+  // also through transmissive surfaces, and that MIS combines light and BSDF sampling with less
+  // variance
+  if (argc > 1 && std::string(argv[1]) == "--check")
+    return checkPrimal(scene, 64, 64, depth, 16) & checkAreaLightInterior(32, 32, depth, 16) & checkLoaders() &
+           checkInstances() & checkBVHBuild() & checkCompressedBVH() & checkBVHCache() & checkDynamicScene() &
+           checkGrids() & checkParameterRefresh() & checkRoughnessGradient() & checkDielectricFresnel() &
+           checkEnvironmentMap() & checkTextures() & checkMeshAreaLights() & checkLightSelection() &
+           checkTransmittedLightSampling() & checkMIS() ? 0 : 1;
+
   #if 0
-  Direction *im = new Direction[width * height];
+  Vec3f *im = new Vec3f[width * height];
   render(scene, im, width, height, depth, spp);
   saveImage("output.ppm", im, width, height);
   delete[] im;
   return 0;
   #else
-  Direction *obj = new Direction[width * height];
+  Vec3f *obj = new Vec3f[width * height]; // Target, nothing to differentiate
   Direction *pred = new Direction[width * height];
 
   render(scene, obj, width, height, depth, spp);
@@ -115,9 +1394,10 @@ int main() {
 
   // Learn the color of the right wall
   // Change color (Changing the color of just one triangle is enough, since both triangles share the same material)
-  scene.objects[8]->material->diffuseBSDF->k.x.update(0.0);
-  scene.objects[8]->material->diffuseBSDF->k.y.update(0.0);
-  scene.objects[8]->material->diffuseBSDF->k.z.update(0.9);
+  Direction &k = scene.materials[scene.objects[8]->material].lobe<DiffuseBSDF>().k;
+  k.x.update(0.0);
+  k.y.update(0.0);
+  k.z.update(0.9);
 
   #define OPT 1
   #if OPT == 0
@@ -129,9 +1409,9 @@ int main() {
   optim::Adam optimizer(0.1, 0.01); // From what i have tested, this Adam config makes it converge around 2x faster than SGD
   #endif
 
-  scene.objects[8]->material->diffuseBSDF->k.requires_grad(true);
+  k.requires_grad(true);
 
-  optimizer.add_param(scene.objects[8]->material->diffuseBSDF->k);
+  optimizer.add_param(k);
 
   int n = 20;
   for (int i = 1; i < n+1; i++) {
@@ -157,7 +1437,8 @@ int main() {
   #endif
 }
 
-void saveImage(const std::string &filename, const Direction *image, int width, int height) {
+template <typename T>
+void saveImage(const std::string &filename, const Vec3<T> *image, int width, int height) {
   std::ofstream file(filename, std::ios::binary);
   if (!file) {
     std::cerr << "Error opening file for writing: " << filename << std::endl;
@@ -166,45 +1447,45 @@ void saveImage(const std::string &filename, const Direction *image, int width, i
   file << "P3\n" << width << " " << height << "\n255\n";
   for (int y = 0; y < height; ++y) {
     for (int x = 0; x < width; ++x) {
-      const Direction &L = image[y * width + x];
-      file << int(tonemap(L.x).value() * 255) << " "
-            << int(tonemap(L.y).value() * 255) << " "
-            << int(tonemap(L.z).value() * 255) << "\n";
+      const Vec3f L(image[y * width + x]);
+      file << int(tonemap(L.x) * 255) << " "
+            << int(tonemap(L.y) * 255) << " "
+            << int(tonemap(L.z) * 255) << "\n";
     }
   }
   file.close();
 }
 
 void CornellBox(Scene &scene) {
-  auto backWallMaterial = std::make_shared<Material>(
+  const uint32_t backWallMaterial = scene.addMaterial(Material(
     Direction(0, 0, 0),       // Emission
     Direction(0.9, 0.9, 0.9), // Diffuse albedo
     Direction(0, 0, 0),       // Specular albedo
-    Direction(0, 0, 0));      // Refractive albedo
+    Direction(0, 0, 0)));     // Refractive albedo
   
-  auto ceilingMaterial = std::make_shared<Material>(
+  const uint32_t ceilingMaterial = scene.addMaterial(Material(
     Direction(1, 1, 1),       // Emission
     Direction(0.9, 0.9, 0.9), // Diffuse albedo
     Direction(0, 0, 0),       // Specular albedo
-    Direction(0, 0, 0));      // Refractive albedo
+    Direction(0, 0, 0)));     // Refractive albedo
   
-  auto floorMaterial = std::make_shared<Material>(
+  const uint32_t floorMaterial = scene.addMaterial(Material(
     Direction(0, 0, 0),       // Emission
     Direction(0.9, 0.9, 0.9), // Diffuse albedo
     Direction(0, 0, 0),       // Specular albedo
-    Direction(0, 0, 0));      // Refractive albedo
+    Direction(0, 0, 0)));     // Refractive albedo
   
-  auto leftWallMaterial = std::make_shared<Material>(
+  const uint32_t leftWallMaterial = scene.addMaterial(Material(
     Direction(0, 0, 0),       // Emission
     Direction(0.9, 0, 0),     // Diffuse albedo
     Direction(0, 0, 0),       // Specular albedo
-    Direction(0, 0, 0));      // Refractive albedo
+    Direction(0, 0, 0)));     // Refractive albedo
   
-  auto rightWallMaterial = std::make_shared<Material>(
+  const uint32_t rightWallMaterial = scene.addMaterial(Material(
     Direction(0, 0, 0),       // Emission
     Direction(0, 0.9, 0),     // Diffuse albedo
     Direction(0, 0, 0),       // Specular albedo
-    Direction(0, 0, 0));      // Refractive albedo
+    Direction(0, 0, 0)));     // Refractive albedo
   
   // Back wall
   scene.add(std::make_shared<Triangle>(Point(-1, -1, 1), Point(1, -1, 1), Point(-1, 1, 1), Direction(0, 0, -1), backWallMaterial));
@@ -232,16 +1513,17 @@ void CornellBox(Scene &scene) {
   // Left sphere
   scene.add(std::make_shared<Sphere>(
     Point(-0.5, -0.7, 0.5), 0.3,
-    Material(Direction(0, 0, 0),           // Emission
-             Direction(0.55290, 0.9, 0.9), // Diffuse albedo
-             Direction(0.02, 0.02, 0.02),  // Specular albedo
-             Direction(0, 0, 0))));        // Refractive albedo
+    scene.addMaterial(Material(Direction(0, 0, 0),           // Emission
+                               Direction(0.55290, 0.9, 0.9), // Diffuse albedo
+                               Direction(0.02, 0.02, 0.02),  // Specular albedo
+                               Direction(0, 0, 0)))));       // Refractive albedo
   
-  // Right sphere
-  // scene.add(std::make_shared<Sphere>(
-  //   Point(0.5, -0.7, -0.25), 0.3,
-  //   Material(Direction(0, 0, 0), // Emission
-  //            Direction(0, 0, 0), // Diffuse albedo
-  //            Direction(0, 0, 0), // Specular albedo
-  //            Direction(1, 1, 1), 1.0f, 1.5f))); // Refractive albedo
+  // Right sphere (glass)
+  scene.add(std::make_shared<Sphere>(
+    Point(0.5, -0.7, -0.25), 0.3,
+    scene.addMaterial(Material(Direction(0, 0, 0),     // Emission
+                               Direction(0, 0, 0),     // Diffuse albedo
+                               Direction(0, 0, 0),     // Specular albedo
+                               Direction(1, 1, 1),     // Refractive albedo
+                               1.0f, 1.5f))));         // Outside and inside index
 }
\ No newline at end of file
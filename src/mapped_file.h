@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Read-only memory mapping of a whole file (POSIX). data() is nullptr if the
+// file could not be mapped. advice is passed to madvise (sequential scan by default).
+class MappedFile {
+  public:
+    explicit MappedFile(const std::string &filename, int advice = MADV_SEQUENTIAL) {
+      const int fd = open(filename.c_str(), O_RDONLY);
+      if (fd < 0) {
+        std::cerr << "Error opening file: " << filename << std::endl;
+        return;
+      }
+
+      struct stat st;
+      if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED) {
+          _data = static_cast<const char *>(ptr);
+          _size = st.st_size;
+          madvise(ptr, _size, advice);
+        } else {
+          std::cerr << "Error mapping file: " << filename << std::endl;
+        }
+      }
+      close(fd); // The mapping keeps its own reference to the file
+    }
+
+    ~MappedFile() {
+      if (_data != nullptr) munmap(const_cast<char *>(_data), _size);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const { return _data; }
+    size_t size() const { return _size; }
+    bool valid() const { return _data != nullptr; }
+
+  private:
+    const char *_data = nullptr;
+    size_t _size = 0;
+};
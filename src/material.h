@@ -1,53 +1,118 @@
 #pragma once
 
 #include "bsdf.h"
+#include "alias.h"
+#include "texture.h"
+#include <optional>
+#include <vector>
 
 struct RussianRouletteEvent {
-  std::shared_ptr<BSDF> bsdf;
+  const BSDF *bsdf;
   Float_t prob;
 };
 
+// Materials live in the scene's material table (Scene::addMaterial) and are referenced by
+// their index, so hits and objects carry a 32-bit ID instead of a pointer
 class Material {
   public:
-    Material(const Direction &emission_, const Direction &kd, const Direction &ks, 
+    Material(const Direction &emission_, const Direction &kd, const Direction &ks,
              const Direction &kr, Float n1 = 1.0f, Float n2 = 1.5f)
-        : emission(emission_), diffuseBSDF(std::make_shared<DiffuseBSDF>(kd)),
-          specularBSDF(std::make_shared<SpecularBSDF>(ks)),
-          refractiveBSDF(std::make_shared<RefractiveBSDF>(kr, n1, n2)),
-          prob_d(kd.max().value()), prob_s(ks.max().value()), prob_r(kr.max().value()) {
-
-      if (prob_d + prob_s + prob_r > 1.0f) {
-        std::cerr << "Warning: Probabilities sum to more than 1.0, normalizing." << std::endl;
-        Float_t total_prob = prob_d + prob_s + prob_r;
-        prob_d /= total_prob;
-        prob_s /= total_prob;
-        prob_r /= total_prob;
-        
-        diffuseBSDF->k = diffuseBSDF->k / total_prob;
-        specularBSDF->k = specularBSDF->k / total_prob;
-        refractiveBSDF->k = refractiveBSDF->k / total_prob;
-      }
+        : emission(emission_) {
+      lobes.push_back(DiffuseBSDF{kd});
+      lobes.push_back(SpecularBSDF{ks});
+      lobes.push_back(RefractiveBSDF{kr, n1, n2});
+      normalize();
+      update();
+    }
+
+    // Adds another lobe, e.g. addLobe(GGXBSDF{k, roughness}). Like the others it is picked
+    // with probability k.max()
+    Material &addLobe(const BSDF &lobe) {
+      lobes.push_back(lobe);
+      normalize();
+      update();
+      return *this;
     }
-    
-    Direction evalEmission() const { return emission; }
 
+    template <typename T = Float>
+    Vec3<T> evalEmission() const { return vec_cast<Vec3<T>>(emission); }
+    template <typename T>
+    Vec3<T> evalEmission(const TexCoord &tc) const {
+      if (!emission_map) return evalEmission<T>();
+      return evalEmission<T>() * emission_map->lookup<T>(tc);
+    }
+    // Emitted radiance averaged over the channels and the emission map, area lights are picked
+    // by it times their area
+    Float_t meanEmission() const {
+      Vec3f Le(emission);
+      if (emission_map) Le = Le * emission_map->mean();
+      return (Le.x + Le.y + Le.z) / 3;
+    }
+    // Factor of the albedo of every lobe at tc, nullopt without an albedo map
+    template <typename T>
+    std::optional<Vec3<T>> evalAlbedo(const TexCoord &tc) const {
+      if (!albedo_map) return std::nullopt;
+      return albedo_map->lookup<T>(tc);
+    }
+    // Roughness of a GGX or rough dielectric lobe at tc, scaled by the roughness map (first channel)
+    template <typename T, typename L>
+    T evalRoughness(const L &lobe, const TexCoord &tc) const {
+      return scalar_cast<T>(lobe.roughness) * roughness_map->lookup<T>(tc).x;
+    }
+
+    // Picks a lobe (or absorption) in O(1) through the alias table
     RussianRouletteEvent rr() const {
-      const Float_t p = uniform(0.0f, 1.0f);
-
-      if (p < prob_d) {
-        return {diffuseBSDF, prob_d};
-      } else if (p < prob_d + prob_s) {
-        return {specularBSDF, prob_s};
-      } else if (p < prob_d + prob_s + prob_r) {
-        return {refractiveBSDF, prob_r};
-      } else {
-        return {nullptr, 0.0f}; // absorption
+      const uint32_t i = table.sample(uniform(0.0f, 1.0f));
+      if (i == lobes.size()) return {nullptr, 0.0f}; // absorption
+      return {&lobes[i], table.pmf(i)};
+    }
+
+    // Recomputes the lobe probabilities from the current albedos and refreshes learnable maps.
+    // The scene calls it when parameter values change (ad::param_epoch), albedos being learned
+    // are not rescaled
+    void update() const {
+      for (const auto &map : {albedo_map, roughness_map, emission_map})
+        if (map) map->update();
+
+      std::vector<Float_t> probs;
+      Float_t total_prob = 0.0;
+      for (const BSDF &lobe : lobes) {
+        probs.push_back(std::max(lobe.albedo().max().value(), 0.0f));
+        total_prob += probs.back();
       }
+      if (total_prob > 1.0f)
+        for (Float_t &prob : probs) prob /= total_prob;
+
+      probs.push_back(std::max(1.0f - total_prob, 0.0f)); // Absorption
+      table.build(probs);
+    }
+
+    // First lobe of type L, e.g. material.lobe<DiffuseBSDF>().k
+    template <typename L>
+    L &lobe() {
+      for (BSDF &bsdf : lobes)
+        if (L *l = bsdf.get<L>()) return *l;
+      std::cerr << "Material has no lobe of the requested type." << std::endl;
+      exit(1);
     }
-  
+
   private:
+    // Scales the albedos down if the lobes would reflect more than they receive
+    void normalize() {
+      Float_t total_prob = 0.0;
+      for (const BSDF &lobe : lobes) total_prob += lobe.albedo().max().value();
+      if (total_prob <= 1.0f) return;
+
+      std::cerr << "Warning: Probabilities sum to more than 1.0, normalizing." << std::endl;
+      for (BSDF &lobe : lobes) lobe.albedo() = lobe.albedo() / total_prob;
+    }
+
   public:
     Direction emission;
-    std::shared_ptr<BSDF> diffuseBSDF, specularBSDF, refractiveBSDF;
-    Float_t prob_d, prob_s, prob_r;
-};
\ No newline at end of file
+    std::vector<BSDF> lobes;
+    // Optional textures over the UVs of meshes, each multiplies the parameter it is named after
+    std::shared_ptr<Texture> albedo_map, roughness_map, emission_map;
+
+  private:
+    mutable AliasTable table; // Over the lobes, then absorption
+};
@@ -0,0 +1,236 @@
+#include "mesh.h"
+
+uint32_t TriangleMesh::addVertex(Float_t x, Float_t y, Float_t z) {
+  if (!params.empty()) {
+    std::cerr << "Cannot add vertices to a mesh with learnable vertices." << std::endl;
+    exit(1);
+  }
+  positions.insert(positions.end(), {x, y, z});
+  return numVertices() - 1;
+}
+
+void TriangleMesh::addNormal(Float_t x, Float_t y, Float_t z) {
+  normals.insert(normals.end(), {x, y, z});
+}
+
+void TriangleMesh::addUV(Float_t u, Float_t v) {
+  uvs.insert(uvs.end(), {u, v});
+}
+
+void TriangleMesh::addTriangle(uint32_t i0, uint32_t i1, uint32_t i2, uint32_t materialID) {
+  if (materialID >= materials.size()) {
+    std::cerr << "Material ID " << materialID << " out of range." << std::endl;
+    exit(1);
+  }
+
+  // Only pay for per-triangle IDs once some triangle needs one
+  if (materialIDs.empty() && materialID != 0)
+    materialIDs.resize(numTriangles(), 0);
+  if (!materialIDs.empty())
+    materialIDs.push_back(materialID);
+
+  indices.insert(indices.end(), {i0, i1, i2});
+}
+
+void TriangleMesh::requires_grad(bool requires_grad) {
+  if (!requires_grad) {
+    params.clear();
+    return;
+  }
+  if (!params.empty()) return;
+
+  params.reserve(positions.size());
+  for (auto &value : positions) {
+    Float param(value, true);
+    // Non-owning alias into the vertex buffer, the mesh outlives its parameters
+    param._ctx->value = std::shared_ptr<Float_t>(std::shared_ptr<Float_t>(), &value);
+    params.push_back(param);
+  }
+}
+
+AABB TriangleMesh::triangleBounds(uint32_t tri) const {
+  AABB box;
+  for (int k = 0; k < 3; k++)
+    box.extend(&positions[3 * indices[3 * tri + k]]);
+  return box;
+}
+
+void TriangleMesh::fillPacket(TrianglePacket<SIMD_WIDTH> &packet, int lane, uint32_t tri) const {
+  const uint32_t *idx = &indices[3 * tri];
+  packet.set(lane, tri, &positions[3 * idx[0]], &positions[3 * idx[1]], &positions[3 * idx[2]]);
+}
+
+uint64_t TriangleMesh::geometryHash() const {
+  uint64_t hash = hashBytes(positions.data(), positions.size() * sizeof(Float_t));
+  hash = hashBytes(indices.data(), indices.size() * sizeof(uint32_t), hash);
+  return hashBytes(&accel.compressed, sizeof(accel.compressed), hash);
+}
+
+void TriangleMesh::update() {
+  const bool rebuild = accel.size() != numTriangles();
+  if (!rebuild && (params.empty() || refit_epoch == ad::param_epoch)) return;
+  refit_epoch = ad::param_epoch;
+
+  // Learnable meshes move every step, caching them would only fill the disk
+  std::string cache_file;
+  uint64_t key = 0;
+  if (rebuild && params.empty() && !cache_dir.empty()) {
+    key = geometryHash();
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+    cache_file = cache_dir + "/" + name;
+    if (accel.load(cache_file, key, numTriangles())) return;
+  }
+
+  std::vector<AABB> bounds(numTriangles());
+  for (size_t tri = 0; tri < bounds.size(); tri++)
+    bounds[tri] = triangleBounds(tri);
+
+  const auto fill = [this](TrianglePacket<SIMD_WIDTH> &packet, int lane, uint32_t tri) { fillPacket(packet, lane, tri); };
+  if (rebuild) accel.build(bounds, fill);
+  else accel.refit(bounds, fill);
+
+  if (!cache_file.empty()) accel.save(cache_file, key);
+}
+
+void TriangleMesh::compressBVH(bool enable) {
+  if (accel.compressed == enable) return;
+  accel = decltype(accel)(); // Empty, so the next update() rebuilds it
+  accel.compressed = enable;
+}
+
+bool TriangleMesh::closestHit(const FastRay &ray, RayHit &hit) const {
+  return accel.intersect(ray, hit.t, hit.prim);
+}
+
+bool TriangleMesh::occluded(const FastRay &ray, Float_t tmax) const {
+  return accel.occluded(ray, tmax);
+}
+
+// Reconstruction of the hit on a single triangle, differentiable for Float
+template <typename T>
+void TriangleMesh::surfaceHit(const Ray3<T> &ray, uint32_t tri, SurfaceHit<T> &hit, const Transform *transform) const {
+  const uint32_t *idx = &indices[3 * tri];
+  Point3<T> v0 = vertex<T>(idx[0]), v1 = vertex<T>(idx[1]), v2 = vertex<T>(idx[2]);
+  if (transform != nullptr) {
+    v0 = (*transform)(v0);
+    v1 = (*transform)(v1);
+    v2 = (*transform)(v2);
+  }
+
+  const Vec3<T> e1 = v1 - v0;
+  const Vec3<T> e2 = v2 - v0;
+  const Vec3<T> ray_x_e2 = ray.d.cross(e2);
+  const T inv_det = 1.0 / e1.dot(ray_x_e2);
+
+  const Vec3<T> b = ray.o - v0;
+  const Vec3<T> ray_x_e1 = b.cross(e1);
+  const T t = e2.dot(ray_x_e1) * inv_det;
+
+  if (normals.empty()) {
+    hit.n = e1.cross(e2).normalize();
+  } else {
+    const T u = b.dot(ray_x_e2) * inv_det;
+    const T v = ray.d.dot(ray_x_e1) * inv_det;
+    const auto normal = [&](uint32_t i) {
+      const Vec3<T> n(normals[3 * i], normals[3 * i + 1], normals[3 * i + 2]);
+      return transform != nullptr ? transform->normal(n) : n;
+    };
+    hit.n = (normal(idx[0]) * (1.0 - u - v) + normal(idx[1]) * u + normal(idx[2]) * v).normalize();
+  }
+
+  if (!uvs.empty()) {
+    // Plain floats, texture coordinates only pick texels
+    const Vec3f e1f(e1), e2f(e2), bf(b), df(ray.d), ray_x_e2f(ray_x_e2);
+    const Float_t inv_detf = value_of(inv_det);
+    const Float_t u = bf.dot(ray_x_e2f) * inv_detf, v = df.dot(bf.cross(e1f)) * inv_detf;
+    const Float_t *t0 = &uvs[2 * idx[0]], *t1 = &uvs[2 * idx[1]], *t2 = &uvs[2 * idx[2]];
+    hit.uv[0] = t0[0] * (1 - u - v) + t1[0] * u + t2[0] * v;
+    hit.uv[1] = t0[1] * (1 - u - v) + t1[1] * u + t2[1] * v;
+
+    // Square root of the ratio of the areas in UV and world space
+    const Float_t uv_area = std::abs((t1[0] - t0[0]) * (t2[1] - t0[1]) - (t2[0] - t0[0]) * (t1[1] - t0[1]));
+    const Float_t area = e1f.cross(e2f).norm();
+    hit.uv_scale = area > 0 ? std::sqrt(uv_area / area) : 0.0f;
+  }
+
+  hit.p = ray.at(t);
+  hit.wo = -ray.d;
+  hit.t = t;
+  hit.into = value_of(hit.n.dot(ray.d)) < 0;
+  hit.material = triangleMaterial(tri);
+  if (hit.light >= 0) hit.light += tri; // Emissive meshes have an area light per triangle
+}
+
+template <typename T>
+bool TriangleMesh::sampleDirection(uint32_t tri, const Transform *transform, const Point3<T> &x, Float_t u1, Float_t u2,
+                                   LightSample<T> &s) const {
+  const uint32_t *idx = &indices[3 * tri];
+  Float_t w[3];
+  if (!sampleTriangle(worldVertex<T>(idx[0], transform), worldVertex<T>(idx[1], transform), worldVertex<T>(idx[2], transform),
+                      x, u1, u2, s, w))
+    return false;
+
+  if (!uvs.empty())
+    for (int c = 0; c < 2; c++) s.uv[c] = w[0] * uvs[2 * idx[0] + c] + w[1] * uvs[2 * idx[1] + c] + w[2] * uvs[2 * idx[2] + c];
+  return true;
+}
+
+template bool TriangleMesh::sampleDirection(uint32_t, const Transform *, const Point3<float> &, Float_t, Float_t, LightSample<float> &) const;
+template bool TriangleMesh::sampleDirection(uint32_t, const Transform *, const Point3<double> &, Float_t, Float_t, LightSample<double> &) const;
+template bool TriangleMesh::sampleDirection(uint32_t, const Transform *, const Point &, Float_t, Float_t, LightSample<Float> &) const;
+
+Float_t TriangleMesh::pdfDirection(uint32_t tri, const Transform *transform, const Vec3f &x, const Vec3f &p) const {
+  const uint32_t *idx = &indices[3 * tri];
+  const Point3f v0 = worldVertex<float>(idx[0], transform);
+  const Vec3f cross = (worldVertex<float>(idx[1], transform) - v0).cross(worldVertex<float>(idx[2], transform) - v0);
+  const Float_t norm = cross.norm();
+  return norm > 0 ? trianglePdf(cross / norm, 0.5f * norm, x, p) : 0.0f;
+}
+
+Float_t TriangleMesh::area(uint32_t tri, const Transform *transform) const {
+  const uint32_t *idx = &indices[3 * tri];
+  const Point3f v0 = worldVertex<float>(idx[0], transform);
+  return 0.5f * (worldVertex<float>(idx[1], transform) - v0).cross(worldVertex<float>(idx[2], transform) - v0).norm();
+}
+
+template class ObjectBase<TriangleMesh>;
+
+void Instance::update() {
+  // Builds the shared mesh on first use and refits it when its vertices are learnable (static
+  // meshes, and meshes another instance already refit since the last parameter change, return
+  // right away), the world bounds below then follow the new vertices
+  mesh->update();
+
+  if (!transform.inverse(to_object)) {
+    std::cerr << "Singular instance transform." << std::endl;
+    exit(1);
+  }
+
+  // World bounds from the 8 transformed corners of the mesh bounds
+  Float_t m[12];
+  transform.values(m);
+  const AABB local = mesh->bounds();
+  world_bounds = AABB();
+  for (int corner = 0; corner < 8; corner++) {
+    const Float_t p[3] = {(corner & 1) ? local.max[0] : local.min[0],
+                          (corner & 2) ? local.max[1] : local.min[1],
+                          (corner & 4) ? local.max[2] : local.min[2]};
+    Float_t q[3];
+    Transform::applyPoint(m, p, q);
+    world_bounds.extend(q);
+  }
+}
+
+bool Instance::closestHit(const FastRay &ray, RayHit &hit) const {
+  return mesh->closestHit(toObject(ray), hit);
+}
+
+uint32_t Instance::closestHit(const RayPacket<PACKET_SIZE> &packet, uint32_t active, Float_t *t, uint32_t *prim) const {
+  RayPacket<PACKET_SIZE> local;
+  for (int i = 0; i < packet.count; i++) local.add(toObject(packet.ray(i)));
+  local.prepare();
+  return mesh->closestHit(local, active, t, prim);
+}
+
+template class ObjectBase<Instance>;
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "objects.h"
+#include "transform.h"
+#include "simd.h"
+#include <cstdint>
+#include <string>
+
+// Indexed triangle mesh.
+// Vertex data lives in flat Float_t buffers shared by every triangle, so a triangle
+// costs 12 bytes of indices (+4 if it has its own material ID) instead of a full
+// IObject. The closest hit is searched on plain floats through a per-mesh BVH, whose
+// leaves keep the triangles as SIMD packets, and only the winning triangle is rebuilt
+// with autograd.
+class TriangleMesh : public ObjectBase<TriangleMesh> {
+  public:
+    explicit TriangleMesh(uint32_t material_)
+        : ObjectBase(material_), materials{material_} {}
+    // Scene material IDs, addTriangle's materialID indexes into this list
+    explicit TriangleMesh(const std::vector<uint32_t> &materials_)
+        : ObjectBase(materials_.at(0)), materials(materials_) {}
+
+    uint32_t addVertex(Float_t x, Float_t y, Float_t z);
+    uint32_t addVertex(const Point &p) { return addVertex(p.x.value(), p.y.value(), p.z.value()); }
+    // Per-vertex normals are optional, if present there must be one per vertex
+    void addNormal(Float_t x, Float_t y, Float_t z);
+    // Texture coordinates are optional too, one pair per vertex
+    void addUV(Float_t u, Float_t v);
+    void addTriangle(uint32_t i0, uint32_t i1, uint32_t i2, uint32_t materialID = 0);
+
+    size_t numVertices() const { return positions.size() / 3; }
+    size_t numTriangles() const { return indices.size() / 3; }
+
+    // Learnable vertices come back with their gradients as Points, plain types get the values
+    template <typename T = Float>
+    Point3<T> vertex(uint32_t i) const {
+      if (std::is_same_v<T, Float> && !params.empty())
+        return Point3<T>(scalar_cast<T>(params[3 * i]), scalar_cast<T>(params[3 * i + 1]), scalar_cast<T>(params[3 * i + 2]));
+      return Point3<T>(positions[3 * i], positions[3 * i + 1], positions[3 * i + 2]);
+    }
+    uint32_t triangleMaterial(uint32_t tri) const {
+      return materials[materialIDs.empty() ? 0 : materialIDs[tri]];
+    }
+    std::vector<uint32_t> usedMaterials() const override { return materials; }
+
+    // Makes every vertex coordinate learnable. The returned Floats alias the positions
+    // buffer, so optimizer.step() writes straight into it. Do not add vertices afterwards.
+    void requires_grad(bool requires_grad);
+    const std::vector<Float> &parameters() const { return params; }
+
+    bool closestHit(const FastRay &ray, RayHit &hit) const override;
+    uint32_t closestHit(const RayPacket<PACKET_SIZE> &packet, uint32_t active, Float_t *t, uint32_t *prim) const override {
+      return accel.intersect(packet, active, t, prim);
+    }
+    template <typename T>
+    void surfaceT(const Ray3<T> &ray, const RayHit &rayHit, SurfaceHit<T> &hit) const {
+      surfaceHit(ray, rayHit.prim, hit);
+    }
+    bool occluded(const FastRay &ray, Float_t tmax) const override;
+    AABB bounds() const override { return accel.bounds(); }
+    // Only learnable vertices move with the parameters, static meshes are left alone
+    bool parametric() const override { return !params.empty(); }
+    // Builds the BVH on first use, refits it if the vertices are learnable. A mesh shared by
+    // many instances is refit once per parameter change (ad::param_epoch), not once per instance
+    void update() override;
+    // Stores the BVH with 8-bit quantized boxes (12 instead of 32 bytes per node), worth
+    // it for big static meshes. Takes effect on the next update()
+    void compressBVH(bool enable);
+    // Keeps built BVHs in directory, keyed by a hash of the geometry, and maps them back
+    // instead of rebuilding when the same mesh is opened again
+    void cacheBVH(const std::string &directory) { cache_dir = directory; }
+    // Whether the current BVH was mapped from the cache rather than built
+    bool cachedBVH() const { return accel.mapped(); }
+
+    // Hit on triangle tri, optionally with the mesh placed by a transform. Differentiable for Float
+    template <typename T>
+    void surfaceHit(const Ray3<T> &ray, uint32_t tri, SurfaceHit<T> &hit, const Transform *transform = nullptr) const;
+
+    // Triangle tri as an area light, placed by transform unless nullptr: direction to a point
+    // uniformly distributed over it (see sampleTriangle), with its texture coordinates
+    template <typename T>
+    bool sampleDirection(uint32_t tri, const Transform *transform, const Point3<T> &x, Float_t u1, Float_t u2, LightSample<T> &s) const;
+    Float_t pdfDirection(uint32_t tri, const Transform *transform, const Vec3f &x, const Vec3f &p) const;
+    Float_t area(uint32_t tri, const Transform *transform) const;
+
+  private:
+    AABB triangleBounds(uint32_t tri) const;
+    template <typename T>
+    Point3<T> worldVertex(uint32_t i, const Transform *transform) const {
+      return transform != nullptr ? (*transform)(vertex<T>(i)) : vertex<T>(i);
+    }
+    void fillPacket(TrianglePacket<SIMD_WIDTH> &packet, int lane, uint32_t tri) const;
+    uint64_t geometryHash() const;
+
+  public:
+    std::vector<Float_t> positions;    // x0 y0 z0 x1 y1 z1 ...
+    std::vector<Float_t> normals;      // Same layout as positions, or empty for flat shading
+    std::vector<Float_t> uvs;          // u0 v0 u1 v1 ..., or empty
+    std::vector<uint32_t> indices;     // 3 per triangle
+    std::vector<uint32_t> materialIDs; // 1 per triangle, or empty if the whole mesh uses materials[0]
+    std::vector<uint32_t> materials;   // Scene material IDs
+
+  private:
+    std::vector<Float> params; // Single parameter block over positions (empty if not learnable)
+    PacketBVH<TrianglePacket<SIMD_WIDTH>> accel;
+    uint64_t refit_epoch = 0; // ad::param_epoch of the last build or refit
+    std::string cache_dir; // Empty if BVHs are not cached
+};
+extern template class ObjectBase<TriangleMesh>;
+
+// Places a shared mesh in the scene. Only the transform is stored per instance, the
+// mesh and its BVH (the bottom level) are shared, so changing the transform only
+// touches the scene's top-level BVH.
+class Instance : public ObjectBase<Instance> {
+  public:
+    Instance(std::shared_ptr<TriangleMesh> mesh_, const Transform &transform_ = Transform())
+        : ObjectBase(mesh_->material), mesh(std::move(mesh_)), transform(transform_) { update(); }
+
+    bool closestHit(const FastRay &ray, RayHit &hit) const override;
+    uint32_t closestHit(const RayPacket<PACKET_SIZE> &packet, uint32_t active, Float_t *t, uint32_t *prim) const override;
+    template <typename T>
+    void surfaceT(const Ray3<T> &ray, const RayHit &rayHit, SurfaceHit<T> &hit) const {
+      mesh->surfaceHit(ray, rayHit.prim, hit, &transform);
+    }
+    bool occluded(const FastRay &ray, Float_t tmax) const override { return mesh->occluded(toObject(ray), tmax); }
+    AABB bounds() const override { return world_bounds; }
+    std::vector<uint32_t> usedMaterials() const override { return mesh->usedMaterials(); }
+    // Refreshes the cached inverse and world bounds from the current transform values, and the
+    // mesh BVH if its vertices are learnable
+    void update() override;
+
+  public:
+    std::shared_ptr<TriangleMesh> mesh;
+    Transform transform;
+
+  private:
+    // The object-space direction is not renormalized, so t is the same in both spaces
+    FastRay toObject(const FastRay &ray) const {
+      Float_t o[3], d[3];
+      Transform::applyPoint(to_object, ray.o, o);
+      Transform::applyVector(to_object, ray.d, d);
+      return FastRay(o, d);
+    }
+
+  private:
+    Float_t to_object[12];
+    AABB world_bounds;
+};
+extern template class ObjectBase<Instance>;
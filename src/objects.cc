@@ -1,47 +1,241 @@
 #include "objects.h"
+#include "mesh.h"
 
-bool Sphere::intersect(const Ray &ray, ObjectHit &hit) const {
-  // https://link.springer.com/content/pdf/10.1007/978-1-4842-4427-2_7.pdf#0004286892.INDD%3AAnchor%2019%3A19
-  const Direction f = ray.o - this->c;
+uint32_t IObject::closestHit(const RayPacket<PACKET_SIZE> &packet, uint32_t active, Float_t *t, uint32_t *prim) const {
+  uint32_t found = 0;
+  for (; active != 0; active &= active - 1) {
+    const int lane = __builtin_ctz(active);
+    RayHit hit;
+    hit.t = t[lane];
+    if (closestHit(packet.ray(lane), hit)) {
+      t[lane] = hit.t;
+      prim[lane] = hit.prim;
+      found |= 1u << lane;
+    }
+  }
+  return found;
+}
 
-  const Float b = (-f).dot(ray.d);
-  const Float c = f.dot(f) - this->r * this->r;
+void Sphere::update() {
+  center[0] = c.x.value();
+  center[1] = c.y.value();
+  center[2] = c.z.value();
+  radius = r.value();
+}
 
-  Direction l = f + ray.d * b;
-  const Float d = r*r - l.dot(l);
+bool Sphere::closestHit(const FastRay &ray, RayHit &hit) const {
+  if (!intersectSphere(ray, center, radius, hit.t)) return false;
+  hit.prim = 0;
+  return true;
+}
+
+// Same quadratic as intersectSphere on any scalar type, the hit itself has already been decided
+template <typename T>
+static void sphereSurface(const Ray3<T> &ray, const Point3<T> &center, const T &radius, SurfaceHit<T> &hit) {
+  using std::sqrt;
+  const Vec3<T> f = ray.o - center;
+
+  const T b = (-f).dot(ray.d);
+  const T c = f.dot(f) - radius * radius;
 
-  if (d.value() < 0) return false;
+  Vec3<T> l = f + ray.d * b;
+  const T d = radius * radius - l.dot(l);
 
-  const Float q = b + sign(b) * d.sqrt();
+  const T q = b + sign(b) * sqrt(d);
 
-  Float t0 = c / q;
-  Float t1 = q;
+  T t0 = c / q;
+  T t1 = q;
 
-  if (t1.value() < t0.value()) std::swap(t0, t1);
-  if (t1.value() <= 0) return false;
+  if (value_of(t1) < value_of(t0)) std::swap(t0, t1);
 
-  hit.t = t0.value() <= 0 ? t1 : t0;
+  hit.t = value_of(t0) <= 0 ? t1 : t0;
 
   hit.p = ray.at(hit.t);
-  hit.n = (hit.p - this->c).normalize();
+  hit.n = (hit.p - center).normalize();
   hit.wo = -ray.d;
-  hit.t = (t0.value() <= 0) ? t1 : t0;
-  hit.into = hit.n.dot(ray.d).value() < 0;
+  hit.into = value_of(hit.n.dot(ray.d)) < 0;
+}
+
+template <typename T>
+void Sphere::surfaceT(const Ray3<T> &ray, const RayHit &, SurfaceHit<T> &hit) const {
+  sphereSurface(ray, vec_cast<Point3<T>>(c), scalar_cast<T>(r), hit);
+}
+
+template class ObjectBase<Sphere>;
+
+AABB Sphere::bounds() const {
+  const Float_t lo[3] = {center[0] - radius, center[1] - radius, center[2] - radius};
+  const Float_t hi[3] = {center[0] + radius, center[1] + radius, center[2] + radius};
+  AABB box;
+  box.extend(lo);
+  box.extend(hi);
+  return box;
+}
+
+// 1 - cos(theta_max) of the cone a sphere subtends, from sin^2(theta_max), without the
+// cancellation of small cones
+template <typename T>
+static T coneSolidAngleFactor(const T &sin2) {
+  using std::sqrt;
+  if (value_of(sin2) < 1e-4) return sin2 * 0.5;
+  return 1.0 - sqrt(1.0 - sin2);
+}
+
+template <typename T>
+bool Sphere::sampleDirection(const Point3<T> &x, Float_t u1, Float_t u2, LightSample<T> &s) const {
+  using std::sqrt;
+  const Vec3f xf(x), cf(center[0], center[1], center[2]);
+  const Float_t dc2 = (cf - xf).norm_squared();
+
+  if (dc2 <= radius * radius) {
+    // Inside, uniform over the area: pdf = d^2 / (cos A)
+    const Float_t z = 1 - 2 * u1, rz = std::sqrt(std::max(0.0f, 1 - z * z)), phi = 2 * M_PI * u2;
+    const Vec3<T> dir(Vec3f(rz * std::cos(phi), rz * std::sin(phi), z));
+    const Vec3<T> d = (vec_cast<Point3<T>>(c) + dir * scalar_cast<T>(r)) - x;
+    const T distance = d.norm();
+    s.wi = d / distance;
+
+    // Two-sided like triangles: from inside, x sees the inner face of every point
+    const T cosL = dir.dot(s.wi) * sign(dir.dot(s.wi));
+    if (value_of(cosL) <= 0) return false; // Seen edge-on
+    s.inv_pdf = cosL * scalar_cast<T>(r) * scalar_cast<T>(r) * (4.0 * M_PI) / (distance * distance);
+    s.pdf = 1.0 / value_of(s.inv_pdf);
+    s.distance = value_of(distance);
+    s.uv[0] = s.uv[1] = 0;
+    return true;
+  }
+
+  // Uniform in the cone around the direction to the center: pdf = 1 / (2 pi (1 - cos(theta_max)))
+  const Float_t dc = std::sqrt(dc2);
+  const Float_t one_minus_cos_max = coneSolidAngleFactor(radius * radius / dc2);
+  const Float_t cos_theta = 1 - u1 * one_minus_cos_max;
+  const Float_t sin_theta = std::sqrt(std::max(0.0f, 1 - cos_theta * cos_theta));
+  const Float_t phi = 2 * M_PI * u2;
 
+  const Vec3f w = (cf - xf) / dc;
+  Vec3f a, b;
+  makeBasis(w, a, b);
+  const Vec3f wi = a * (sin_theta * std::cos(phi)) + b * (sin_theta * std::sin(phi)) + w * cos_theta;
+
+  // Nearest intersection along wi, clamped to the tangent point for rays grazing the cone's rim
+  const Float_t dt = dc * cos_theta;
+  s.distance = dt - std::sqrt(std::max(0.0f, radius * radius - dc2 * sin_theta * sin_theta));
+  s.wi = Vec3<T>(wi);
+
+  // The solid angle keeps the gradient of the center and radius
+  const Vec3<T> dcT = vec_cast<Point3<T>>(c) - x;
+  const T &rT = scalar_cast<T>(r);
+  s.inv_pdf = coneSolidAngleFactor(rT * rT / dcT.norm_squared()) * (2.0 * M_PI);
+  s.pdf = 1.0 / (2 * M_PI * one_minus_cos_max);
+  s.uv[0] = s.uv[1] = 0;
+  return true;
+}
+
+Float_t Sphere::pdfDirection(const Vec3f &x, const Vec3f &p, const Vec3f &np) const {
+  const Vec3f cf(center[0], center[1], center[2]);
+  const Float_t dc2 = (cf - x).norm_squared();
+  if (dc2 <= radius * radius) {
+    const Vec3f d = p - x;
+    const Float_t cosL = std::abs(np.dot(d.normalize()));
+    return cosL > 0 ? d.norm_squared() / (cosL * area()) : 0.0f;
+  }
+  return 1.0 / (2 * M_PI * coneSolidAngleFactor(radius * radius / dc2));
+}
+
+void SphereSet::addSphere(Float_t x, Float_t y, Float_t z, Float_t radius) {
+  centers.insert(centers.end(), {x, y, z});
+  radii.push_back(radius);
+}
+
+AABB SphereSet::sphereBounds(uint32_t i) const {
+  const Float_t *c = &centers[3 * i];
+  const Float_t lo[3] = {c[0] - radii[i], c[1] - radii[i], c[2] - radii[i]};
+  const Float_t hi[3] = {c[0] + radii[i], c[1] + radii[i], c[2] + radii[i]};
+  AABB box;
+  box.extend(lo);
+  box.extend(hi);
+  return box;
+}
+
+void SphereSet::update() {
+  std::vector<AABB> bounds(size());
+  for (size_t i = 0; i < bounds.size(); i++)
+    bounds[i] = sphereBounds(i);
+
+  if (accel_type != Accel::BVH) {
+    grid.build(bounds, accel_type == Accel::HashedGrid);
+    accel = decltype(accel)();
+    return;
+  }
+
+  grid = Grid();
+  accel.build(bounds, [this](SpherePacket<SIMD_WIDTH> &packet, int lane, uint32_t i) {
+    packet.set(lane, i, &centers[3 * i], radii[i]);
+  });
+}
+
+bool SphereSet::closestHit(const FastRay &ray, RayHit &hit) const {
+  if (accel_type == Accel::BVH) return accel.intersect(ray, hit.t, hit.prim);
+
+  bool found = false;
+  grid.intersect(ray, hit.t, [&](uint32_t i) {
+    if (intersectSphere(ray, &centers[3 * i], radii[i], hit.t)) {
+      hit.prim = i;
+      found = true;
+    }
+  });
+  return found;
+}
+
+bool SphereSet::occluded(const FastRay &ray, Float_t tmax) const {
+  if (accel_type == Accel::BVH) return accel.occluded(ray, tmax);
+
+  return grid.occluded(ray, tmax, [&](uint32_t i) {
+    Float_t t = tmax;
+    return intersectSphere(ray, &centers[3 * i], radii[i], t);
+  });
+}
+
+template <typename T>
+void SphereSet::surfaceT(const Ray3<T> &ray, const RayHit &rayHit, SurfaceHit<T> &hit) const {
+  const Float_t *c = &centers[3 * rayHit.prim];
+  sphereSurface(ray, Point3<T>(c[0], c[1], c[2]), T(radii[rayHit.prim]), hit);
+}
+
+template class ObjectBase<SphereSet>;
+
+void Triangle::update() {
+  const Float_t a[3] = {v0.x.value(), v0.y.value(), v0.z.value()};
+  const Float_t b[3] = {v1.x.value(), v1.y.value(), v1.z.value()};
+  const Float_t c[3] = {v2.x.value(), v2.y.value(), v2.z.value()};
+  for (int i = 0; i < 3; i++) {
+    p0[i] = a[i];
+    e1[i] = b[i] - a[i];
+    e2[i] = c[i] - a[i];
+  }
+
+  box = AABB();
+  box.extend(a);
+  box.extend(b);
+  box.extend(c);
+}
+
+bool Triangle::closestHit(const FastRay &ray, RayHit &hit) const {
+  if (!intersectTriangle(ray, p0, e1, e2, hit.t)) return false;
+  hit.prim = 0;
   return true;
 }
 
 // https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
-bool Triangle::intersect(const Ray &ray, ObjectHit &hit) const {
-  const Float_t eps = std::numeric_limits<Float_t>::epsilon();
+template <typename T>
+void Triangle::surfaceT(const Ray3<T> &ray, const RayHit &, SurfaceHit<T> &hit) const {
+  const Point3<T> &p0 = vec_cast<Point3<T>>(v0), &p1 = vec_cast<Point3<T>>(v1), &p2 = vec_cast<Point3<T>>(v2);
 
   // 1. Check if ray intersects triangle plane
-  const Direction e1 = v1 - v0;
-  const Direction e2 = v2 - v0;
-  const Direction ray_x_e2 = ray.d.cross(e2);
-  const Float det = e1.dot(ray_x_e2);
-
-  if (det.value() > -eps && det.value() < eps) return false; // ray parallel to triangle plane
+  const Vec3<T> e1 = p1 - p0;
+  const Vec3<T> e2 = p2 - p0;
+  const Vec3<T> ray_x_e2 = ray.d.cross(e2);
+  const T det = e1.dot(ray_x_e2);
 
   // 2. Check if ray intersects triangle
   // Barycentric coordinates to define a point: P = w * p0 + u * p1 + v * p2,
@@ -56,74 +250,458 @@ bool Triangle::intersect(const Ray &ray, ObjectHit &hit) const {
   // This is a system of linear equations (Ax = b),
   // where: A = [-ray.d, e1, e2], x = [t, u, v], b = ray.o - p0
   // and can be solved using Cramer's rule: https://en.wikipedia.org/wiki/Cramer%27s_rule
+  //
+  // The range checks on u, v and t are done on plain floats by closestHit.
   
-  const Float inv_det = 1.0 / det;
-  const Direction b = ray.o - v0;
-
-  const Float u = b.dot(ray_x_e2) * inv_det;
-  if (u.value() < 0.0 || u.value() > 1.0) return false;
+  const T inv_det = 1.0 / det;
+  const Vec3<T> b = ray.o - p0;
 
-  const Direction ray_x_e1 = b.cross(e1);
-  const Float v = ray.d.dot(ray_x_e1) * inv_det;
-  if (v.value() < 0.0 || (u + v).value() > 1.0) return false;
+  const Vec3<T> ray_x_e1 = b.cross(e1);
 
-  const Float w = 1.0 - u - v;
-
-  const Float t = e2.dot(ray_x_e1) * inv_det;
-
-  if (t.value() < eps) return false; // triangle behind ray
+  const T t = e2.dot(ray_x_e1) * inv_det;
 
   hit.p = ray.at(t);
-  hit.n = this->n;//e1.cross(e2).normalize();
+  hit.n = vec_cast<Vec3<T>>(this->n);//e1.cross(e2).normalize();
   hit.wo = -ray.d;
   hit.t = t;
-  hit.into = hit.n.dot(ray.d).value() < 0;
+  hit.into = value_of(hit.n.dot(ray.d)) < 0;
+}
+
+template class ObjectBase<Triangle>;
+
+template <typename T>
+bool Triangle::sampleDirection(const Point3<T> &x, Float_t u1, Float_t u2, LightSample<T> &s) const {
+  Float_t w[3];
+  return sampleTriangle(vec_cast<Point3<T>>(v0), vec_cast<Point3<T>>(v1), vec_cast<Point3<T>>(v2), x, u1, u2, s, w);
+}
+
+Float_t Triangle::pdfDirection(const Vec3f &x, const Vec3f &p, const Vec3f &) const {
+  const Vec3f ng = Vec3f(e1[0], e1[1], e1[2]).cross(Vec3f(e2[0], e2[1], e2[2])).normalize();
+  return trianglePdf(ng, area(), x, p);
+}
+
+Float_t Triangle::area() const {
+  return 0.5 * Vec3f(e1[0], e1[1], e1[2]).cross(Vec3f(e2[0], e2[1], e2[2])).norm();
+}
+
+
+void Scene::build() const {
+  std::vector<AABB> bounds;
+  bounds.reserve(objects.size());
+  for (const auto &object : objects) {
+    object->update();
+    bounds.push_back(object->bounds());
+  }
+
+  if (accel_type == Accel::BVH) {
+    tlas.build(bounds, leaves);
+    grid = Grid();
+  } else {
+    grid.build(bounds, accel_type == Accel::HashedGrid);
+    tlas = DynamicBVH();
+    leaves.clear();
+  }
+  dirty = false;
+  area_lights_dirty = true; // commit() finds the emitters again too
+  epoch = ad::param_epoch;
+}
+
+void Scene::refresh() const {
+  // Grids have no incremental update
+  if (accel_type != Accel::BVH) {
+    build();
+    return;
+  }
+
+  for (uint32_t i = 0; i < objects.size(); i++) {
+    if (!objects[i]->parametric()) continue;
+
+    objects[i]->update();
+    const AABB box = objects[i]->bounds(), &old = tlas.nodes[leaves[i]].bounds;
+    if (!std::equal(box.min, box.min + 3, old.min) || !std::equal(box.max, box.max + 3, old.max))
+      tlas.move(leaves[i], box);
+  }
+  epoch = ad::param_epoch;
+}
+
+void Scene::add(std::shared_ptr<IObject> object) {
+  for (uint32_t id : object->usedMaterials()) {
+    if (id >= materials.size()) {
+      std::cerr << "Material ID " << id << " out of range, add it with addMaterial first." << std::endl;
+      exit(1);
+    }
+  }
+  objects.push_back(std::move(object));
+  if (accel_type != Accel::BVH) dirty = true;
+  if (dirty) return; // Not built yet, the first query builds everything
+
+  objects.back()->update();
+  leaves.push_back(tlas.insert(objects.back()->bounds(), objects.size() - 1));
+  updateAreaLight(*objects.back()); // It may be an emitter
+}
+
+bool Scene::remove(const std::shared_ptr<IObject> &object) {
+  const auto it = std::find(objects.begin(), objects.end(), object);
+  if (it == objects.end()) return false;
 
+  // Swap with the last object so indices stay dense
+  const uint32_t i = it - objects.begin();
+  const uint32_t last = objects.size() - 1;
+  removeAreaLight(*object);
+  objects[i] = std::move(objects[last]);
+  objects.pop_back();
+  if (accel_type != Accel::BVH) dirty = true;
+  if (dirty) return true;
+
+  tlas.remove(leaves[i]);
+  leaves[i] = leaves[last];
+  leaves.pop_back();
+  if (i != last) tlas.nodes[leaves[i]].id = i;
   return true;
 }
 
-bool Scene::intersect(const Ray &ray, ObjectHit &hit) const {
-  bool found = false;
-  Float_t closest_t = std::numeric_limits<Float_t>::max();
+bool Scene::remove(const std::shared_ptr<PointLight> &light) {
+  const auto it = std::find(lights.begin(), lights.end(), light);
+  if (it == lights.end()) return false;
+  lights.erase(it);
+  lights_dirty = true;
+  return true;
+}
+
+void Scene::buildLights() const {
+  std::vector<Float_t> power;
+  power.reserve(lights.size());
+  for (const auto &light : lights)
+    power.push_back((light->pow.x.value() + light->pow.y.value() + light->pow.z.value()) / 3);
+  light_table.build(power);
 
+  light_bvh = LightBVH();
+  if (light_sampling == LightSampling::BVH) {
+    std::vector<Vec3f> positions;
+    positions.reserve(lights.size());
+    for (const auto &light : lights) positions.emplace_back(light->p);
+    light_bvh.build(positions, power);
+  }
+
+  lights_dirty = false;
+}
+
+void Scene::buildAreaLights() const {
+  area_lights.clear();
+  area_lights_dirty = false;
   for (const auto &object : objects) {
-    ObjectHit temp_hit;
-    if (object->intersect(ray, temp_hit)) {
-      if (temp_hit.t.value() < closest_t) {
-        closest_t = temp_hit.t.value();
-        hit = temp_hit;
-        hit.material = object->material;
-        found = true;
-      }
+    object->light = -1;
+    updateAreaLight(*object);
+  }
+  buildAreaTable();
+}
+
+void Scene::buildAreaTable() const {
+  std::vector<Float_t> power;
+  power.reserve(area_lights.size());
+  for (const AreaLight &light : area_lights) power.push_back(light.power);
+  area_table.build(power);
+  area_table_dirty = false;
+}
+
+void Scene::updateAreaLight(IObject &object) const {
+  if (area_lights_dirty) return; // Rebuilt over every object anyway
+
+  // Emissive triangles and spheres become one area light, meshes and instances one per
+  // triangle (0 power for the triangles that do not emit). They are picked by emitted power
+  const auto emitted = [&](uint32_t material) { return materials[material].meanEmission(); };
+  std::vector<AreaLight> emitters;
+  const TriangleMesh *mesh = dynamic_cast<const TriangleMesh *>(&object);
+  const Transform *transform = nullptr;
+  if (const Instance *instance = dynamic_cast<const Instance *>(&object)) {
+    mesh = instance->mesh.get();
+    transform = &instance->transform;
+  }
+  if (const Triangle *triangle = dynamic_cast<const Triangle *>(&object)) {
+    if (const Float_t radiance = emitted(object.material); radiance > 0)
+      emitters.push_back({&object, triangle, nullptr, nullptr, nullptr, 0, object.material, radiance * triangle->area()});
+  } else if (const Sphere *sphere = dynamic_cast<const Sphere *>(&object)) {
+    if (const Float_t radiance = emitted(object.material); radiance > 0)
+      emitters.push_back({&object, nullptr, sphere, nullptr, nullptr, 0, object.material, radiance * sphere->area()});
+  } else if (mesh != nullptr &&
+             std::any_of(mesh->materials.begin(), mesh->materials.end(), [&](uint32_t m) { return emitted(m) > 0; })) {
+    emitters.reserve(mesh->numTriangles());
+    for (uint32_t tri = 0; tri < mesh->numTriangles(); tri++) {
+      const uint32_t material = mesh->triangleMaterial(tri);
+      emitters.push_back({&object, nullptr, nullptr, mesh, transform, tri, material, emitted(material) * mesh->area(tri, transform)});
     }
   }
+  if (emitters.empty()) {
+    removeAreaLight(object);
+    return;
+  }
 
-  return found;
+  // Refreshed in place if the object keeps as many, appended otherwise
+  size_t count = 0;
+  if (object.light >= 0)
+    while (object.light + count < area_lights.size() && area_lights[object.light + count].object == &object) count++;
+  if (count != emitters.size()) {
+    removeAreaLight(object);
+    object.light = area_lights.size();
+    area_lights.resize(area_lights.size() + emitters.size());
+  }
+  std::copy(emitters.begin(), emitters.end(), area_lights.begin() + object.light);
+  area_table_dirty = true;
+}
+
+void Scene::removeAreaLight(IObject &object) const {
+  const int32_t i = object.light;
+  object.light = -1;
+  if (i < 0 || area_lights_dirty) return;
+
+  // Erase the object's block, the blocks after it move down
+  size_t end = i;
+  while (end < area_lights.size() && area_lights[end].object == &object) end++;
+  area_lights.erase(area_lights.begin() + i, area_lights.begin() + end);
+  for (size_t j = i; j < area_lights.size(); j++)
+    if (j == 0 || area_lights[j - 1].object != area_lights[j].object) area_lights[j].object->light = j;
+  area_table_dirty = true;
+}
+
+void Scene::update(const std::shared_ptr<IObject> &object) {
+  if (accel_type != Accel::BVH) dirty = true;
+  if (dirty) return;
+
+  const auto it = std::find(objects.begin(), objects.end(), object);
+  if (it == objects.end()) return;
+
+  object->update();
+  tlas.move(leaves[it - objects.begin()], object->bounds());
+  updateAreaLight(*object); // Emitters weigh by their area
+}
+
+const IObject *Scene::closestHit(const FastRay &ray, RayHit &hit) const {
+  prepare();
+
+  const IObject *closest_object = nullptr;
+  const auto test = [&](uint32_t i) {
+    if (objects[i]->closestHit(ray, hit))
+      closest_object = objects[i].get();
+  };
+
+  if (accel_type == Accel::BVH) tlas.intersect(ray, hit.t, test);
+  else grid.intersect(ray, hit.t, test);
+  return closest_object;
+}
+
+void Scene::intersect(const std::vector<FastRay> &rays, std::vector<SceneHit> &hits) const {
+  prepare();
+
+  hits.assign(rays.size(), SceneHit());
+  for (size_t i = 0; i < rays.size(); i++) hits[i].object = closestHit(rays[i], hits[i].hit);
+}
+
+void Scene::intersect(const RayPacket<PACKET_SIZE> &packet, PacketHit &hit) const {
+  prepare();
+
+  for (int i = 0; i < PACKET_SIZE; i++) {
+    hit.t[i] = std::numeric_limits<Float_t>::max();
+    hit.object[i] = nullptr;
+  }
+
+  // Grids have no shared packet traversal, their lanes go one by one
+  if (accel_type != Accel::BVH) {
+    for (int i = 0; i < packet.count; i++) {
+      RayHit rayHit;
+      hit.object[i] = closestHit(packet.ray(i), rayHit);
+      hit.t[i] = rayHit.t;
+      hit.prim[i] = rayHit.prim;
+    }
+    return;
+  }
+
+  tlas.intersect(packet, hit.t, packet.lanes(), [&](uint32_t id, uint32_t mask) {
+    uint32_t found = objects[id]->closestHit(packet, mask, hit.t, hit.prim);
+    for (; found != 0; found &= found - 1) hit.object[__builtin_ctz(found)] = objects[id].get();
+  });
+}
+
+bool Scene::occluded(const FastRay &ray, Float_t tmax) const {
+  prepare();
+
+  const auto test = [&](uint32_t i) { return objects[i]->occluded(ray, tmax); };
+  return accel_type == Accel::BVH ? tlas.occluded(ray, tmax, test) : grid.occluded(ray, tmax, test);
 }
 
-Direction Scene::pointLightNEE(const ObjectHit &hit) const {
+// Whether light arriving at cosThetaI from the normal on the side of wo can reach it through
+// bsdf: from the front always, from behind only through transmission
+template <typename T>
+static bool facing(const HitBSDF<T> &bsdf, Float_t cosThetaI) {
+  return cosThetaI > 0 || (cosThetaI < 0 && (bsdf.flags() & LOBE_TRANSMISSION));
+}
+
+// Radiance reflected by bsdf from one point light, 0 if it is shadowed or behind the surface of
+// a lobe that does not transmit. n is the normal on the side of wo
+template <typename T>
+static Vec3<T> pointLightContribution(const Scene &scene, const SurfaceHit<T> &hit, const Vec3<T> &n,
+                                      const HitBSDF<T> &bsdf, const PointLight &light) {
+  using std::sqrt;
+  const Float_t eps = 1e-4;
+
+  const Point3<T> &x = hit.p;
+  const Point3<T> &p = vec_cast<Point3<T>>(light.p);
+  const Vec3<T> wi = (p - x).normalize();
+  const T cosThetaI = n.dot(wi);
+  const T distance_squared = (p - x).norm_squared();
+  const T distance = sqrt(distance_squared);
+
+  if (!facing(bsdf, value_of(cosThetaI))) return Vec3<T>(0, 0, 0); // Light is behind the surface
+
+  // Small offset to the side of the light to avoid self-shadowing
+  const Vec3f o = Vec3f(x) + Vec3f(n) * (value_of(cosThetaI) > 0 ? eps : -eps), d(wi);
+  const Float_t origin[3] = {o.x, o.y, o.z};
+  const Float_t direction[3] = {d.x, d.y, d.z};
+
+  if (scene.occluded(FastRay(origin, direction), value_of(distance))) return Vec3<T>(0, 0, 0); // Light is blocked by a closer object
+
+  return vec_cast<Vec3<T>>(light.pow) * bsdf.evaluate(hit.wo, wi, n, hit.into) * (cosThetaI * sign(cosThetaI)) / distance_squared;
+}
+
+template <typename T>
+Vec3<T> Scene::areaLightNEE(const SurfaceHit<T> &hit, const HitBSDF<T> &bsdf) const {
+  prepare();
+  Vec3<T> L(0, 0, 0);
+  if (!area_light_sampling || area_table.empty()) return L;
+
   const Float_t eps = 1e-4;
+  const Vec3<T> n = hit.into ? hit.n : -hit.n; // On the side of wo
+  const Vec3f front = Vec3f(hit.p) + Vec3f(n) * eps, back = Vec3f(hit.p) - Vec3f(n) * eps;
 
-  const Point &x = hit.p;
-  const Direction n = hit.n;
+  for (int i = 0; i < light_samples; i++) {
+    const uint32_t l = area_table.sample(uniform(0.0, 1.0));
+    const AreaLight &light = area_lights[l];
 
-  Direction L(0, 0, 0);
-  for (const auto &light : lights) {
-    const Direction wi = (light->p - x).normalize();
-    const Float cosThetaI = n.dot(wi);
-    const Float distance_squared = (light->p - x).norm_squared();
-    const Float distance = distance_squared.sqrt();
+    LightSample<T> s;
+    const Float_t u1 = uniform(0.0, 1.0), u2 = uniform(0.0, 1.0);
+    if (!(light.triangle ? light.triangle->sampleDirection(hit.p, u1, u2, s)
+          : light.sphere ? light.sphere->sampleDirection(hit.p, u1, u2, s)
+                         : light.mesh->sampleDirection(light.prim, light.transform, hit.p, u1, u2, s)))
+      continue;
 
-    if (cosThetaI.value() <= 0) continue; // Light is behind the surface
+    const T cosThetaI = n.dot(s.wi);
+    if (!facing(bsdf, value_of(cosThetaI))) continue; // Behind the surface
 
-    ObjectHit shadowHit;
-    Ray shadowRay(x + n * eps, wi); // Small offset to avoid self-shadowing
+    // Stop short of the emitter itself
+    const Vec3f d(s.wi), o = value_of(cosThetaI) > 0 ? front : back;
+    const Float_t origin[3] = {o.x, o.y, o.z};
+    const Float_t direction[3] = {d.x, d.y, d.z};
+    if (occluded(FastRay(origin, direction), s.distance * (1 - 1e-3f))) continue;
 
-    if (intersect(shadowRay, shadowHit)) {
-      if (shadowHit.t.value() < distance.value()) continue; // Light is blocked by a closer object
-      L = L + light->pow * cosThetaI / distance_squared; // Light is blocked by a further object so ok
-    } else
-      L = L + light->pow * cosThetaI / distance_squared; // Light not blocked
+    // The MIS weight is a plain number: the weights of both strategies sum to 1 whatever the
+    // parameters, so their gradient cancels out
+    const Float_t light_pdf = light_samples * area_table.pmf(l) * s.pdf;
+    const Float_t w = mis == MISHeuristic::None ? 1.0f : misWeight(mis, light_pdf, bsdf.pdf(Vec3f(hit.wo), d, Vec3f(n), hit.into));
+    if (w <= 0) continue;
+
+    const Vec3<T> Le = materials[light.material].template evalEmission<T>(TexCoord{s.uv[0], s.uv[1], 0});
+    L = L + Le * bsdf.evaluate(hit.wo, s.wi, n, hit.into) * (cosThetaI * sign(cosThetaI) * s.inv_pdf * T(w / (area_table.pmf(l) * light_samples)));
   }
   return L;
-}
\ No newline at end of file
+}
+
+Float_t Scene::emissionMISWeight(int32_t light, const Vec3f &x, const Vec3f &p, const Vec3f &n, Float_t bsdf_pdf) const {
+  if (mis == MISHeuristic::None) return 0.0;
+
+  const AreaLight &l = area_lights[light];
+  const Float_t pdf = l.triangle ? l.triangle->pdfDirection(x, p, n)
+                      : l.sphere ? l.sphere->pdfDirection(x, p, n)
+                                 : l.mesh->pdfDirection(l.prim, l.transform, x, p);
+  return misWeight(mis, bsdf_pdf, light_samples * area_table.pmf(light) * pdf);
+}
+
+template Vec3<float> Scene::areaLightNEE(const SurfaceHit<float> &hit, const HitBSDF<float> &bsdf) const;
+template Vec3<double> Scene::areaLightNEE(const SurfaceHit<double> &hit, const HitBSDF<double> &bsdf) const;
+template Direction Scene::areaLightNEE(const ObjectHit &hit, const HitBSDF<Float> &bsdf) const;
+
+template <typename T>
+Vec3<T> Scene::environment(const Ray3<T> &ray, Float_t pdf) const {
+  if (!environment_map) return Vec3<T>(0, 0, 0);
+  prepare();
+
+  const Vec3f d(ray.d);
+  const Vec3<T> Le = environment_map->template eval<T>(d);
+  if (pdf <= 0 || !area_light_sampling) return Le;
+  if (mis == MISHeuristic::None) return Vec3<T>(0, 0, 0); // environmentNEE counted it
+  return Le * T(misWeight(mis, pdf, light_samples * environment_map->pdf(d)));
+}
+
+template Vec3<float> Scene::environment(const Ray3<float> &ray, Float_t pdf) const;
+template Vec3<double> Scene::environment(const Ray3<double> &ray, Float_t pdf) const;
+template Direction Scene::environment(const Ray &ray, Float_t pdf) const;
+
+template <typename T>
+Vec3<T> Scene::environmentNEE(const SurfaceHit<T> &hit, const HitBSDF<T> &bsdf) const {
+  prepare();
+  Vec3<T> L(0, 0, 0);
+  if (!area_light_sampling || !environment_map) return L;
+
+  const Float_t eps = 1e-4;
+  const Vec3<T> n = hit.into ? hit.n : -hit.n; // On the side of wo
+  const Vec3f front = Vec3f(hit.p) + Vec3f(n) * eps, back = Vec3f(hit.p) - Vec3f(n) * eps;
+
+  for (int i = 0; i < light_samples; i++) {
+    Vec3f d;
+    Float_t pdf;
+    if (!environment_map->sample(d, pdf)) break; // Black
+
+    const Vec3<T> wi = vec_cast<Vec3<T>>(d);
+    const T cosThetaI = n.dot(wi);
+    if (!facing(bsdf, value_of(cosThetaI))) continue; // Behind the surface
+
+    const Vec3f o = value_of(cosThetaI) > 0 ? front : back;
+    const Float_t origin[3] = {o.x, o.y, o.z};
+    const Float_t direction[3] = {d.x, d.y, d.z};
+    if (occluded(FastRay(origin, direction), std::numeric_limits<Float_t>::max())) continue;
+
+    const Float_t w = mis == MISHeuristic::None ? 1.0f : misWeight(mis, light_samples * pdf, bsdf.pdf(Vec3f(hit.wo), d, Vec3f(n), hit.into));
+    if (w <= 0) continue;
+
+    const Vec3<T> Le = environment_map->template eval<T>(d);
+    L = L + Le * bsdf.evaluate(hit.wo, wi, n, hit.into) * (cosThetaI * sign(cosThetaI) * T(w / (pdf * light_samples)));
+  }
+  return L;
+}
+
+template Vec3<float> Scene::environmentNEE(const SurfaceHit<float> &hit, const HitBSDF<float> &bsdf) const;
+template Vec3<double> Scene::environmentNEE(const SurfaceHit<double> &hit, const HitBSDF<double> &bsdf) const;
+template Direction Scene::environmentNEE(const ObjectHit &hit, const HitBSDF<Float> &bsdf) const;
+
+template <typename T>
+Vec3<T> Scene::pointLightNEE(const SurfaceHit<T> &hit, const HitBSDF<T> &bsdf) const {
+  prepare();
+  const Vec3<T> n = hit.into ? hit.n : -hit.n; // On the side of wo
+
+  Vec3<T> L(0, 0, 0);
+  if (light_sampling == LightSampling::All) {
+    for (const auto &light : lights)
+      L = L + pointLightContribution(*this, hit, n, bsdf, *light);
+    return L;
+  }
+
+  // Each sample is divided by its selection probability, the average is unbiased. Lights
+  // behind the surface are only culled if the bsdf cannot transmit their light
+  const Vec3f x(hit.p), nf = bsdf.flags() & LOBE_TRANSMISSION ? Vec3f(0, 0, 0) : Vec3f(n);
+  for (int s = 0; s < light_samples; s++) {
+    Float_t pmf = 0.0;
+    const PointLight *light = nullptr;
+    if (light_sampling == LightSampling::BVH) {
+      const int i = light_bvh.sample(x, nf, uniform(0.0, 1.0), pmf);
+      if (i >= 0) light = lights[i].get();
+    } else {
+      light = sampleLight(uniform(0.0, 1.0), pmf);
+    }
+    if (light == nullptr) continue;
+
+    L = L + pointLightContribution(*this, hit, n, bsdf, *light) * T(1.0 / (pmf * light_samples));
+  }
+  return L;
+}
+
+template Vec3<float> Scene::pointLightNEE(const SurfaceHit<float> &hit, const HitBSDF<float> &bsdf) const;
+template Vec3<double> Scene::pointLightNEE(const SurfaceHit<double> &hit, const HitBSDF<double> &bsdf) const;
+template Direction Scene::pointLightNEE(const ObjectHit &hit, const HitBSDF<Float> &bsdf) const;
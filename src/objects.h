@@ -2,58 +2,250 @@
 
 #include "rtmath.h"
 #include "material.h"
+#include "simd.h"
+#include "grid.h"
+#include "lightbvh.h"
+#include "envmap.h"
 #include <vector>
 
-struct ObjectHit {
-  Point p;
-  Direction n;
-  Direction wo;
-  std::shared_ptr<Material> material;
-  Float t;
+template <typename T>
+struct SurfaceHit {
+  Point3<T> p;
+  Vec3<T> n;
+  Vec3<T> wo;
+  uint32_t material; // Index into Scene::materials
+  int32_t light;     // Area light index of the object (IObject::light), -1 if it is not one
+  T t;
   bool into; // True if the ray is entering the object, false if exiting
+  Float_t uv[2];    // Texture coordinates, 0 on objects without any
+  Float_t uv_scale; // UV units per world unit around p, 0 without texture coordinates
+
+  // Where textures are read for a ray footprint `width` wide (world units) at p
+  TexCoord texCoord(Float_t width) const {
+    const Float_t cos = std::max(std::abs(Float_t(value_of(n.dot(wo)))), 0.1f); // Footprints stretch at grazing angles
+    return {uv[0], uv[1], width * uv_scale / cos};
+  }
+};
+
+using ObjectHit = SurfaceHit<Float>;
+
+// Direction towards a point on an emitter, sampled for next event estimation
+template <typename T>
+struct LightSample {
+  Vec3<T> wi;       // Unit direction from the shading point to the light
+  T inv_pdf;        // 1 / solid angle pdf, differentiable in the emitter's shape and position
+  Float_t pdf;      // Solid angle pdf
+  Float_t distance; // To the sampled point, for the shadow ray
+  Float_t uv[2];    // Texture coordinates of the sampled point, 0 on emitters without any
+};
+
+// Direction from x to a point uniformly distributed over the triangle (a, b, c), which emits
+// from both sides: pdf = d^2 / (cos A). w gets the barycentric weights of the point. The point
+// moves with the vertices, which carries their gradient
+template <typename T>
+bool sampleTriangle(const Point3<T> &a, const Point3<T> &b, const Point3<T> &c, const Point3<T> &x,
+                    Float_t u1, Float_t u2, LightSample<T> &s, Float_t w[3]) {
+  const Float_t su = std::sqrt(u1);
+  w[0] = su * (1 - u2);
+  w[1] = 1 - su;
+  w[2] = u2 * su;
+
+  const Vec3<T> ab = b - a, ac = c - a;
+  const Vec3<T> d = (a + ab * T(w[1]) + ac * T(w[2])) - x;
+  const T distance = d.norm();
+  s.wi = d / distance;
+
+  const Vec3<T> cross = ab.cross(ac); // Its norm is twice the area
+  const T cosL = cross.dot(s.wi) * sign(cross.dot(s.wi)) / cross.norm();
+  if (value_of(cosL) <= 0) return false; // Seen edge-on
+
+  s.inv_pdf = cosL * cross.norm() * 0.5 / (distance * distance);
+  s.pdf = 1.0 / value_of(s.inv_pdf);
+  s.distance = value_of(distance);
+  s.uv[0] = s.uv[1] = 0;
+  return true;
+}
+
+// Solid angle pdf of sampleTriangle picking p from x, for a triangle of unit normal ng
+inline Float_t trianglePdf(const Vec3f &ng, Float_t area, const Vec3f &x, const Vec3f &p) {
+  const Vec3f d = p - x;
+  const Float_t cosL = std::abs(ng.dot(d.normalize()));
+  return cosL > 0 && area > 0 ? d.norm_squared() / (cosL * area) : 0.0f;
+}
+
+// Result of a plain-float closest-hit query
+struct RayHit {
+  Float_t t = std::numeric_limits<Float_t>::max();
+  uint32_t prim = 0; // Primitive within the object (e.g. triangle of a mesh)
+};
+
+// Closest hits of a packet of rays, one entry per lane. object is nullptr on a miss
+struct PacketHit {
+  Float_t t[PACKET_SIZE];
+  uint32_t prim[PACKET_SIZE];
+  const class IObject *object[PACKET_SIZE];
+};
+
+// Closest hit of a plain-float scene query, object is nullptr on a miss
+struct SceneHit {
+  RayHit hit;
+  const class IObject *object = nullptr;
 };
 
 class IObject {
   public:
-    IObject(Material material_) : material(std::make_shared<Material>(material_)) {}
-    IObject(std::shared_ptr<Material> material_) : material(std::move(material_)) {}
+    // material_ is an index into the scene's material table, see Scene::addMaterial
+    explicit IObject(uint32_t material_) : material(material_) {}
     virtual ~IObject() = default;
 
-    virtual bool intersect(const Ray &ray, ObjectHit &hit) const = 0;
+    // Closest hit closer than hit.t, on plain floats (no autograd)
+    virtual bool closestHit(const FastRay &ray, RayHit &hit) const = 0;
+    // Surface interaction for a hit found by closestHit, one overload per scalar type (see
+    // ObjectBase). Only the Float one is differentiable
+    virtual void surface(const Ray3<float> &ray, const RayHit &rayHit, SurfaceHit<float> &hit) const = 0;
+    virtual void surface(const Ray3<double> &ray, const RayHit &rayHit, SurfaceHit<double> &hit) const = 0;
+    virtual void surface(const Ray &ray, const RayHit &rayHit, ObjectHit &hit) const = 0;
+    // Any hit closer than tmax, for shadow rays
+    virtual bool occluded(const FastRay &ray, Float_t tmax) const {
+      RayHit hit;
+      hit.t = tmax;
+      return closestHit(ray, hit);
+    }
+    // Packet version over the lanes in active, t and prim hold one entry per lane. Returns
+    // the lanes that got a closer hit. By default the rays are traced one by one.
+    virtual uint32_t closestHit(const RayPacket<PACKET_SIZE> &packet, uint32_t active, Float_t *t, uint32_t *prim) const;
+    virtual AABB bounds() const = 0;
+    // Called by Scene::commit, objects refresh their cached float data here
+    virtual void update() {}
+    // Whether update() must run again when parameter values change (ad::param_epoch), the
+    // scene then calls it on its next query
+    virtual bool parametric() const { return true; }
+    // Every scene material ID the object's hits can carry, Scene::add checks them
+    virtual std::vector<uint32_t> usedMaterials() const { return {material}; }
+
+    template <typename T>
+    bool intersect(const Ray3<T> &ray, SurfaceHit<T> &hit) const {
+      RayHit rayHit;
+      if (!closestHit(FastRay(ray), rayHit)) return false;
+      hit.material = material;
+      hit.light = light;
+      hit.uv[0] = hit.uv[1] = hit.uv_scale = 0; // Meshes with texture coordinates set them
+      surface(ray, rayHit, hit);
+      return true;
+    }
 
   public:
-    std::shared_ptr<Material> material;
+    uint32_t material;
+    // Index in the scene's area lights, set by the scene for emissive objects. Emissive meshes
+    // and instances have one per triangle from there on, their hits add the triangle to it
+    int32_t light = -1;
 };
 
-class Sphere : public IObject {
+// Implements the surface() overloads of IObject with Derived::surfaceT, instantiated next to
+// it in the .cc file
+template <typename Derived>
+class ObjectBase : public IObject {
   public:
-    Sphere(const Point &center, Float_t radius, Material material_)
-        : IObject(material_), c(center), r(radius) {}
-    Sphere(const Point &center, Float_t radius, std::shared_ptr<Material>material_)
-        : IObject(material_), c(center), r(radius) {}
+    using IObject::IObject;
 
-    bool intersect(const Ray &ray, ObjectHit &hit) const override;
+    void surface(const Ray3<float> &ray, const RayHit &rayHit, SurfaceHit<float> &hit) const override { self().surfaceT(ray, rayHit, hit); }
+    void surface(const Ray3<double> &ray, const RayHit &rayHit, SurfaceHit<double> &hit) const override { self().surfaceT(ray, rayHit, hit); }
+    void surface(const Ray &ray, const RayHit &rayHit, ObjectHit &hit) const override { self().surfaceT(ray, rayHit, hit); }
+
+  private:
+    const Derived &self() const { return static_cast<const Derived &>(*this); }
+};
+
+class Sphere : public ObjectBase<Sphere> {
+  public:
+    Sphere(const Point &center, Float_t radius, uint32_t material_)
+        : ObjectBase(material_), c(center), r(radius) { update(); }
+
+    bool closestHit(const FastRay &ray, RayHit &hit) const override;
+    template <typename T>
+    void surfaceT(const Ray3<T> &ray, const RayHit &rayHit, SurfaceHit<T> &hit) const;
+    AABB bounds() const override;
+    // Refreshes the cached float center and radius
+    void update() override;
+
+    // As an area light: direction to a point of the sphere, uniform in the cone it subtends
+    // from x (uniform over the area if x is inside). False if there is none
+    template <typename T>
+    bool sampleDirection(const Point3<T> &x, Float_t u1, Float_t u2, LightSample<T> &s) const;
+    // Solid angle pdf of sampleDirection picking p (with normal np) from x
+    Float_t pdfDirection(const Vec3f &x, const Vec3f &p, const Vec3f &np) const;
+    Float_t area() const { return 4.0 * M_PI * radius * radius; }
 
   private:
     Point c;
     Float r;
+
+    Float_t center[3], radius; // Values of c and r for closestHit
 };
+extern template class ObjectBase<Sphere>;
 
-class Triangle : public IObject {
+// Many spheres sharing one material (particles, sphere clouds), kept in SIMD packets
+// behind a BVH instead of one IObject each. Not learnable. Clouds that move every frame
+// can use a grid instead, which rebuilds in O(n).
+class SphereSet : public ObjectBase<SphereSet> {
+  public:
+    explicit SphereSet(uint32_t material_) : ObjectBase(material_) {}
+
+    void addSphere(Float_t x, Float_t y, Float_t z, Float_t radius);
+    size_t size() const { return radii.size(); }
+
+    bool closestHit(const FastRay &ray, RayHit &hit) const override;
+    template <typename T>
+    void surfaceT(const Ray3<T> &ray, const RayHit &rayHit, SurfaceHit<T> &hit) const;
+    bool occluded(const FastRay &ray, Float_t tmax) const override;
+    AABB bounds() const override { return accel_type == Accel::BVH ? accel.bounds() : grid.bounds(); }
+    // Rebuilds the acceleration structure, call it (or Scene::update) after moving spheres
+    void update() override;
+    bool parametric() const override { return false; }
+    // Takes effect on the next update()
+    void setAccel(Accel type) { accel_type = type; }
+
+  public:
+    std::vector<Float_t> centers; // x0 y0 z0 x1 y1 z1 ...
+    std::vector<Float_t> radii;
+
+  private:
+    AABB sphereBounds(uint32_t i) const;
+
+    Accel accel_type = Accel::BVH;
+    PacketBVH<SpherePacket<SIMD_WIDTH>> accel;
+    Grid grid;
+};
+extern template class ObjectBase<SphereSet>;
+
+class Triangle : public ObjectBase<Triangle> {
   public:
     Triangle(const Point &v0, const Point &v1, const Point &v2, const Direction &n_,
-             Material material_)
-        : IObject(material_), v0(v0), v1(v1), v2(v2), n(n_) {}
-    Triangle(const Point &v0, const Point &v1, const Point &v2, const Direction &n_,
-             std::shared_ptr<Material> material_)
-        : IObject(material_), v0(v0), v1(v1), v2(v2), n(n_) {}
+             uint32_t material_)
+        : ObjectBase(material_), v0(v0), v1(v1), v2(v2), n(n_) { update(); }
 
-    bool intersect(const Ray &ray, ObjectHit &hit) const override;
+    bool closestHit(const FastRay &ray, RayHit &hit) const override;
+    template <typename T>
+    void surfaceT(const Ray3<T> &ray, const RayHit &rayHit, SurfaceHit<T> &hit) const;
+    AABB bounds() const override { return box; }
+    // Refreshes the cached float vertex, edges and bounds
+    void update() override;
+
+    // As an area light: direction to a point uniformly distributed over the triangle
+    template <typename T>
+    bool sampleDirection(const Point3<T> &x, Float_t u1, Float_t u2, LightSample<T> &s) const;
+    Float_t pdfDirection(const Vec3f &x, const Vec3f &p, const Vec3f &np) const;
+    Float_t area() const;
 
   // private:
     Point v0, v1, v2;
     Direction n;
+
+  private:
+    Float_t p0[3], e1[3], e2[3]; // v0, v1 - v0 and v2 - v0 for closestHit
+    AABB box;
 };
+extern template class ObjectBase<Triangle>;
 
 struct PointLight {
   PointLight(const Point &position, const Direction &power)
@@ -63,16 +255,206 @@ struct PointLight {
   Direction pow;
 };
 
+class TriangleMesh;
+class Transform;
+
+// How next event estimation picks the point lights it tests
+enum class LightSampling {
+  All,   // Every light, one shadow ray each
+  Power, // Scene::light_samples lights drawn in proportion to their power
+  BVH,   // Same, in proportion to power over distance through a light BVH
+};
+
+// How light sampling and BSDF sampling of area lights are combined (multiple importance
+// sampling). None keeps only the light samples for the emitters NEE can reach
+enum class MISHeuristic { None, Balance, Power };
+
+// Weight of a sample drawn with pdf a among strategies with pdfs a and b (Veach), each pdf
+// already scaled by its number of samples
+inline Float_t misWeight(MISHeuristic heuristic, Float_t a, Float_t b) {
+  if (heuristic == MISHeuristic::Power) {
+    a *= a;
+    b *= b;
+  }
+  return a + b > 0 ? a / (a + b) : 0.0f;
+}
+
 class Scene {
   public:
-    bool intersect(const Ray &ray, ObjectHit &hit) const;
-    Direction pointLightNEE(const ObjectHit &hit) const;
+    template <typename T>
+    bool intersect(const Ray3<T> &ray, SurfaceHit<T> &hit) const {
+      SceneHit sceneHit;
+      sceneHit.object = closestHit(FastRay(ray), sceneHit.hit);
+      return surface(ray, sceneHit, hit);
+    }
+    // Closest object hit on plain floats, nullptr if none
+    const IObject *closestHit(const FastRay &ray, RayHit &hit) const;
+    // Closest hits of a batch of rays (wavefront mode), traced in the given order. Sort
+    // incoherent batches with sortRays (raysort.h) first.
+    void intersect(const std::vector<FastRay> &rays, std::vector<SceneHit> &hits) const;
+    template <typename T>
+    bool surface(const Ray3<T> &ray, const SceneHit &sceneHit, SurfaceHit<T> &hit) const {
+      if (sceneHit.object == nullptr) return false;
+
+      hit.material = sceneHit.object->material; // Meshes override it with their per-triangle material
+      hit.light = sceneHit.object->light;
+      hit.uv[0] = hit.uv[1] = hit.uv_scale = 0; // Meshes with texture coordinates set them
+      sceneHit.object->surface(ray, sceneHit.hit, hit);
+      return true;
+    }
+    // Closest hits of a packet of coherent rays (e.g. a tile of camera rays), traced together
+    void intersect(const RayPacket<PACKET_SIZE> &packet, PacketHit &hit) const;
+    // Surface interaction for lane `lane` of a packet query, ray is that lane's ray
+    template <typename T>
+    bool surface(const Ray3<T> &ray, const PacketHit &packetHit, int lane, SurfaceHit<T> &hit) const {
+      SceneHit sceneHit;
+      sceneHit.hit.t = packetHit.t[lane];
+      sceneHit.hit.prim = packetHit.prim[lane];
+      sceneHit.object = packetHit.object[lane];
+      return surface(ray, sceneHit, hit);
+    }
+    // True if anything is hit closer than tmax. Plain floats, returns on the first hit found
+    bool occluded(const FastRay &ray, Float_t tmax) const;
+    // Radiance brought back by a ray that left the scene, from the environment map (black
+    // without one). pdf as in Li: after a non-specular bounce it is weighted by MIS against
+    // environmentNEE
+    template <typename T>
+    Vec3<T> environment(const Ray3<T> &ray, Float_t pdf) const;
+    // Radiance reflected by bsdf towards hit.wo from the environment map, light_samples
+    // shadow rays in directions importance sampled from it. 0 when area light sampling is off
+    template <typename T>
+    Vec3<T> environmentNEE(const SurfaceHit<T> &hit, const HitBSDF<T> &bsdf) const;
+    // Point light drawn in proportion to its power in O(1), nullptr if there are none
+    const PointLight *sampleLight(Float_t u, Float_t &pmf) const {
+      prepare();
+      if (light_table.empty()) return nullptr;
+      const uint32_t i = light_table.sample(u);
+      pmf = light_table.pmf(i);
+      return lights[i].get();
+    }
+    // Radiance reflected by bsdf towards hit.wo from emissive triangles and spheres, estimated
+    // with light_samples shadow rays to points drawn on emitters picked by power. 0 when area
+    // light sampling is off
+    template <typename T>
+    Vec3<T> areaLightNEE(const SurfaceHit<T> &hit, const HitBSDF<T> &bsdf) const;
+    // Radiance reflected by bsdf towards hit.wo from the point lights in view, all of them or
+    // an unbiased estimate from a few (setLightSampling)
+    template <typename T>
+    Vec3<T> pointLightNEE(const SurfaceHit<T> &hit, const HitBSDF<T> &bsdf) const;
+    AABB bounds() const {
+      prepare();
+      return accel_type == Accel::BVH ? tlas.bounds() : grid.bounds();
+    }
+
+    // Objects can be added, removed and moved at any time. Once the scene is built, each
+    // change only touches the object's leaf of the top-level BVH (O(log n)), and the area
+    // light table (O(emitters)) if the object emits.
+    void add(std::shared_ptr<IObject> object);
+    void add(std::shared_ptr<PointLight> light) { lights.push_back(light); lights_dirty = true; }
+    // Lights the scene from every direction, nullptr for none. Make its texels learnable()
+    // to estimate the lighting
+    void setEnvironment(std::shared_ptr<EnvironmentMap> map) { environment_map = map; }
+    // Appends to the material table and returns the ID objects refer to it by
+    uint32_t addMaterial(const Material &material) {
+      materials.push_back(material);
+      return uint32_t(materials.size() - 1);
+    }
+    // The last object takes the index of the removed one. False if it is not in the scene
+    bool remove(const std::shared_ptr<IObject> &object);
+    bool remove(const std::shared_ptr<PointLight> &light);
+    // Call after moving or reshaping an object (e.g. a new Instance transform)
+    void update(const std::shared_ptr<IObject> &object);
+    // Top-level structure over the objects. The BVH supports incremental edits, grids are
+    // rebuilt in O(n) on the next query after any change (scenes of many small objects)
+    void setAccel(Accel type) { accel_type = type; dirty = true; }
+    // The sampled modes cost `samples` shadow rays per shading point however many lights
+    // there are. `samples` is also the number of shadow rays areaLightNEE and environmentNEE
+    // trace, whatever the mode
+    void setLightSampling(LightSampling mode, int samples = 1) {
+      light_sampling = mode;
+      light_samples = samples;
+      lights_dirty = true;
+    }
+    // Emissive objects (triangles, spheres, and every triangle of meshes and instances, emission
+    // maps included) and the environment map are sampled as lights by next event estimation.
+    // Paths that hit them after a non-specular bounce then weight their emission by MIS (see
+    // setMIS). Off, emitters are only found by BSDF sampling
+    void setAreaLightSampling(bool on) { area_light_sampling = on; }
+    bool areaLightSampling() const { return area_light_sampling; }
+    // Power heuristic by default
+    void setMIS(MISHeuristic heuristic) { mis = heuristic; }
+    // Weight of the emission of area light `light` at p (normal n), found by a BSDF sample of
+    // solid angle pdf bsdf_pdf from x. 0 without MIS, NEE from x already counted it
+    Float_t emissionMISWeight(int32_t light, const Vec3f &x, const Vec3f &p, const Vec3f &n, Float_t bsdf_pdf) const;
+
+    // Updates every object and rebuilds the top-level BVH from scratch. Happens lazily on the
+    // first query; call it after changing many objects at once or to restore the tree quality
+    // after many incremental edits.
+    void commit() { build(); }
+
+    // Parameter changes (optimizer steps, Float::update) are picked up automatically: the
+    // next query refreshes the parametric objects and moves their leaves
 
-    void add(std::shared_ptr<IObject> object) { objects.push_back(object); }
-    void add(std::shared_ptr<PointLight> light) { lights.push_back(light); }
-  
   private:
   public:
     std::vector<std::shared_ptr<IObject>> objects;
     std::vector<std::shared_ptr<PointLight>> lights;
+    std::vector<Material> materials; // Indexed by the material IDs of objects and hits
+
+  private:
+    void build() const;
+    void refresh() const;
+    void buildLights() const;
+    void buildAreaLights() const;
+    void buildAreaTable() const;
+    // Adds, refreshes or drops the area lights of an object after it was added or updated,
+    // and drops them when the object leaves the scene. Both are O(1) on the object count and
+    // at most linear in the area lights
+    void updateAreaLight(IObject &object) const;
+    void removeAreaLight(IObject &object) const;
+    void prepare() const {
+      if (!dirty && epoch == ad::param_epoch && !lights_dirty && !area_lights_dirty && !area_table_dirty) return;
+
+      // Material and light probabilities follow the parameters too
+      if (dirty || epoch != ad::param_epoch) {
+        for (const Material &material : materials) material.update();
+        if (environment_map) environment_map->update();
+        lights_dirty = area_lights_dirty = true;
+      }
+      if (dirty) build();
+      else if (epoch != ad::param_epoch) refresh();
+      if (lights_dirty) buildLights();
+      if (area_lights_dirty) buildAreaLights();
+      else if (area_table_dirty) buildAreaTable();
+    }
+
+    Accel accel_type = Accel::BVH;
+    mutable DynamicBVH tlas;
+    mutable std::vector<uint32_t> leaves; // TLAS leaf of each object
+    mutable Grid grid;
+    mutable bool dirty = true;
+    mutable uint64_t epoch = 0; // ad::param_epoch the objects were last updated at
+    mutable AliasTable light_table; // Over lights, by power
+    mutable LightBVH light_bvh;     // Only built in LightSampling::BVH
+    struct AreaLight {
+      IObject *object;
+      const Triangle *triangle;   // The object, one of triangle, sphere and mesh is set
+      const Sphere *sphere;
+      const TriangleMesh *mesh;   // Triangle prim of it, placed by transform unless nullptr
+      const Transform *transform;
+      uint32_t prim;
+      uint32_t material;          // Of the emitting surface
+      Float_t power;              // Emitted, mean radiance times area
+    };
+    // Emissive objects by IObject::light, meshes take a contiguous block of one per triangle
+    mutable std::vector<AreaLight> area_lights;
+    mutable AliasTable area_table;              // Over area_lights, by power
+    std::shared_ptr<EnvironmentMap> environment_map;
+    bool area_light_sampling = true;
+    MISHeuristic mis = MISHeuristic::Power;
+    LightSampling light_sampling = LightSampling::All;
+    int light_samples = 1;
+    mutable bool lights_dirty = true;       // Point light table and BVH
+    mutable bool area_lights_dirty = true;  // area_lights, found again over every object
+    mutable bool area_table_dirty = false;  // Only area_table, after incremental edits
 };
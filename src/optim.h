@@ -14,11 +14,15 @@ class IOptimizer {
 
     virtual void add_param(std::shared_ptr<ad::Ctx> param) { params.push_back(param); }
     virtual void add_param(const Float &param) { add_param(param._ctx); }
-    virtual void add_param(const Vec3 &param) {
+    virtual void add_param(const Vec3<Float> &param) {
       add_param(param.x);
       add_param(param.y);
       add_param(param.z);
     }
+    virtual void add_param(const std::vector<Float> &block) {
+      for (const auto &param : block)
+        add_param(param);
+    }
     void zero_grad() {
       for (const auto &param : params)
         *param->grad = 0.0;
@@ -59,6 +63,7 @@ class SGD : public IOptimizer {
           *param->value -= lr * grad;
         }
       }
+      ad::param_epoch++;
     }
   
   protected:
@@ -95,6 +100,7 @@ class Adam : public IOptimizer {
 
         *param->value -= lr * mt / (std::sqrt(vt) + epsilon);
       }
+      ad::param_epoch++;
     }
 
   protected:
@@ -0,0 +1,48 @@
+#include "raysort.h"
+
+// Spreads the low 9 bits of x so there are two zero bits between consecutive ones
+static uint32_t expandBits(uint32_t x) {
+  x = (x | (x << 16)) & 0x030000FF;
+  x = (x | (x << 8)) & 0x0300F00F;
+  x = (x | (x << 4)) & 0x030C30C3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+uint32_t rayKey(const FastRay &ray, const AABB &bounds) {
+  uint32_t morton = 0;
+  for (int a = 0; a < 3; a++) {
+    const Float_t extent = bounds.max[a] - bounds.min[a];
+    const Float_t x = extent > 0 ? (ray.o[a] - bounds.min[a]) / extent : 0.0;
+    const uint32_t cell = std::clamp((int)(x * 512), 0, 511);
+    morton |= expandBits(cell) << a;
+  }
+
+  const uint32_t octant = ray.sign[0] | ray.sign[1] << 1 | ray.sign[2] << 2;
+  return octant << 27 | morton;
+}
+
+void sortRays(const std::vector<FastRay> &rays, const AABB &bounds, std::vector<uint32_t> &order) {
+  const size_t n = rays.size();
+  std::vector<uint32_t> keys(n), sorted_keys(n), sorted(n);
+  order.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = rayKey(rays[i], bounds);
+    order[i] = i;
+  }
+
+  // Keys use 30 bits, 4 stable passes over 8 bits each
+  for (int shift = 0; shift < 32; shift += 8) {
+    size_t offset[257] = {};
+    for (size_t i = 0; i < n; i++) offset[((keys[i] >> shift) & 255) + 1]++;
+    for (int b = 0; b < 256; b++) offset[b + 1] += offset[b];
+
+    for (size_t i = 0; i < n; i++) {
+      const size_t dst = offset[(keys[i] >> shift) & 255]++;
+      sorted_keys[dst] = keys[i];
+      sorted[dst] = order[i];
+    }
+    keys.swap(sorted_keys);
+    order.swap(sorted);
+  }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "rtmath.h"
+#include <vector>
+#include <cstdint>
+
+// Ray reordering for batched (wavefront) tracing.
+// After a diffuse bounce rays leave in every direction, and traced in the order they were
+// generated, consecutive rays walk unrelated parts of the BVH. Sorting them by direction
+// octant and then along a Morton curve over their origins makes neighbouring rays visit
+// mostly the same nodes, which are then still in cache.
+
+// Direction octant in bits 27-29, Morton code of the origin inside bounds (9 bits per axis) below
+uint32_t rayKey(const FastRay &ray, const AABB &bounds);
+
+// Indices of rays in increasing key order (LSD radix sort)
+void sortRays(const std::vector<FastRay> &rays, const AABB &bounds, std::vector<uint32_t> &order);
@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <random>
 #include <limits>
+#include <type_traits>
 
 using ad::Float;
 
@@ -18,13 +19,41 @@ inline Float clamp(Float v, Float min = 0.0, Float max = 1.0) {
   return (t.value() > max.value()) ? max : t;
 }
 
-inline Float sign(Float x) { return (x.value() >= 0) ? Float(1.0) : Float(-1.0); }
+// Scalar helpers so the same code reads the same for plain floats and ad::Float. The renderer
+// is instantiated for float and double (primal renders) and ad::Float (differentiable ones).
+template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+inline T value_of(T x) { return x; }
+inline Float_t value_of(const Float &x) { return x.value(); }
 
-class Vec3 {
+// Between scalar types, going to a plain type drops the gradient, coming back gives a constant.
+// Values that already have type T are passed through by reference, which spares copying the
+// shared state of Floats on the differentiable path
+template <typename T, typename U>
+inline std::conditional_t<std::is_same_v<T, U>, const U &, T> scalar_cast(const U &x) {
+  if constexpr (std::is_same_v<T, U>) return x;
+  else return T(value_of(x));
+}
+
+template <typename T>
+inline T sign(const T &x) { return (value_of(x) >= 0) ? T(1.0) : T(-1.0); }
+
+namespace ad {
+// Found by ADL next to std::sqrt, see Vec3::norm
+inline Float sqrt(const Float &x) { return x.sqrt(); }
+} // namespace ad
+
+// 3-vector over a scalar type: Vec3<Float> carries gradients, Vec3<Float_t> (Vec3f) is plain
+// arithmetic padded to 16 bytes so it loads as one SIMD register. Converting between them is
+// explicit, going to plain floats drops the gradients and coming back gives constants.
+template <typename T>
+class alignas(std::is_arithmetic_v<T> ? 4 * sizeof(T) : alignof(T)) Vec3 {
   public:
-    Float x, y, z;
+    T x, y, z;
+
+    Vec3(T x = 0.0, T y = 0.0, T z = 0.0) : x(x), y(y), z(z) {}
 
-    Vec3(Float x = 0.0, Float y = 0.0, Float z = 0.0) : x(x), y(y), z(z) {}
+    template <typename U, typename = std::enable_if_t<!std::is_same_v<T, U>>>
+    explicit Vec3(const Vec3<U> &other) : x(value_of(other.x)), y(value_of(other.y)), z(value_of(other.z)) {}
 
     void requires_grad(bool requires_grad) {
       x.requires_grad(requires_grad);
@@ -38,19 +67,26 @@ class Vec3 {
       z.zero_grad();
     }
 
-    Float min() const { return std::min({x.value(), y.value(), z.value()}); }
-    Float max() const { return std::max({x.value(), y.value(), z.value()}); }
+    T &operator[](int axis) { return axis == 0 ? x : (axis == 1 ? y : z); }
+    const T &operator[](int axis) const { return axis == 0 ? x : (axis == 1 ? y : z); }
+
+    T min() const { return std::min({value_of(x), value_of(y), value_of(z)}); }
+    T max() const { return std::max({value_of(x), value_of(y), value_of(z)}); }
 
     Vec3 operator+(const Vec3 &other) const { return Vec3(x + other.x, y + other.y, z + other.z); }
     Vec3 operator-(const Vec3 &other) const { return Vec3(x - other.x, y - other.y, z - other.z); }
     Vec3 operator*(const Vec3 &other) const { return Vec3(x * other.x, y * other.y, z * other.z); }
-    Vec3 operator*(const Float &scalar) const { return Vec3(x * scalar, y * scalar, z * scalar); }
-    Vec3 operator/(const Float &scalar) const { return (*this) * (1.0 / scalar); }
-    Vec3 operator*(Float_t scalar) const { return (*this) * Float(scalar); }
-    Vec3 operator/(Float_t scalar) const { return (*this) / Float(scalar); }
+    Vec3 operator*(const T &scalar) const { return Vec3(x * scalar, y * scalar, z * scalar); }
+    Vec3 operator/(const T &scalar) const { return (*this) * (1.0 / scalar); }
     Vec3 operator-() const { return Vec3(-x, -y, -z); }
 
-    Float dot(const Vec3 &other) const { return x * other.x + y * other.y + z * other.z; }
+    // Plain constants on a differentiable vector
+    template <typename S = T, typename = std::enable_if_t<!std::is_arithmetic_v<S>>>
+    Vec3 operator*(Float_t scalar) const { return (*this) * T(scalar); }
+    template <typename S = T, typename = std::enable_if_t<!std::is_arithmetic_v<S>>>
+    Vec3 operator/(Float_t scalar) const { return (*this) / T(scalar); }
+
+    T dot(const Vec3 &other) const { return x * other.x + y * other.y + z * other.z; }
     Vec3 cross(const Vec3 &other) const {
       return Vec3(y * other.z - z * other.y,
                   z * other.x - x * other.z,
@@ -58,42 +94,195 @@ class Vec3 {
       );
     }
 
-    Float norm_squared() const { return x * x + y * y + z * z; }
-    Float norm() const { return norm_squared().sqrt(); }
+    T norm_squared() const { return x * x + y * y + z * z; }
+    T norm() const {
+      using std::sqrt;
+      return sqrt(norm_squared());
+    }
     Vec3 normalize() const { return (*this) / norm(); }
 
-    bool isNaN() const { return x.isValueNaN() || y.isValueNaN() || z.isValueNaN(); }
-    bool operator==(const Vec3 &other) const { return x.value() == other.x.value() && y.value() == other.y.value() && z.value() == other.z.value(); }
+    bool isNaN() const { return std::isnan(value_of(x)) || std::isnan(value_of(y)) || std::isnan(value_of(z)); }
+    bool operator==(const Vec3 &other) const { return value_of(x) == value_of(other.x) && value_of(y) == value_of(other.y) && value_of(z) == value_of(other.z); }
     bool operator!=(const Vec3 &other) const { return !(*this == other); }
 
     friend std::ostream &operator<<(std::ostream &os, const Vec3 &v) {
-      return os << "[" << v.x.value() << ", " << v.y.value() << ", " << v.z.value() << "]";
+      return os << "[" << value_of(v.x) << ", " << value_of(v.y) << ", " << value_of(v.z) << "]";
     }
 };
 
-using Direction = Vec3;
-
-class Point : public Vec3 {
+template <typename T>
+class Point3 : public Vec3<T> {
   public:
-    Point(Float x = 0.0, Float y = 0.0, Float z = 0.0) : Vec3(x, y, z) {}
+    using Vec3<T>::x, Vec3<T>::y, Vec3<T>::z;
 
-    Point operator+(const Direction &dir) const { return Point(x + dir.x, y + dir.y, z + dir.z); }
-    Point operator-(const Direction &dir) const { return Point(x - dir.x, y - dir.y, z - dir.z); }
-    Direction operator-(const Point &other) const { return Direction(x - other.x, y - other.y, z - other.z); }
+    Point3(T x = 0.0, T y = 0.0, T z = 0.0) : Vec3<T>(x, y, z) {}
+
+    template <typename U, typename = std::enable_if_t<!std::is_same_v<T, U>>>
+    explicit Point3(const Point3<U> &other) : Vec3<T>(other) {}
+
+    Point3 operator+(const Vec3<T> &dir) const { return Point3(x + dir.x, y + dir.y, z + dir.z); }
+    Point3 operator-(const Vec3<T> &dir) const { return Point3(x - dir.x, y - dir.y, z - dir.z); }
+    Vec3<T> operator-(const Point3 &other) const { return Vec3<T>(x - other.x, y - other.y, z - other.z); }
 };
 
-class Ray {
+template <typename T>
+class Ray3 {
   public:
-    Point o;
-    Direction d;
+    Point3<T> o;
+    Vec3<T> d;
+
+    Ray3(const Point3<T> &origin, const Vec3<T> &direction) : o(origin), d(direction.normalize()) {}
 
-    Ray(const Point &origin, const Direction &direction) : o(origin), d(direction.normalize()) {}
+    // The direction is already normalized, it is only converted
+    template <typename U, typename = std::enable_if_t<!std::is_same_v<T, U>>>
+    explicit Ray3(const Ray3<U> &other) : o(other.o), d(other.d) {}
 
-    Point at(Float t) const { return o + d * t; }
+    Point3<T> at(T t) const { return o + d * t; }
 
     bool isNaN() const { return o.isNaN() || d.isNaN(); }
 
-    friend std::ostream &operator<<(std::ostream &os, const Ray &ray) {
+    friend std::ostream &operator<<(std::ostream &os, const Ray3 &ray) {
       return os << "Ray(origin: " << ray.o << ", direction: " << ray.d << ")";
     }
 };
+
+using Direction = Vec3<Float>;
+using Point = Point3<Float>;
+using Ray = Ray3<Float>;
+
+using Vec3f = Vec3<Float_t>;
+using Point3f = Point3<Float_t>;
+using Ray3f = Ray3<Float_t>;
+
+// Same as scalar_cast for vectors, points and rays (e.g. vec_cast<Point3<T>>(p))
+template <typename V, typename U>
+inline std::conditional_t<std::is_same_v<V, U>, const U &, V> vec_cast(const U &v) {
+  if constexpr (std::is_same_v<V, U>) return v;
+  else return V(v);
+}
+
+// Plain-float ray for the acceleration structures, no autograd involved.
+// The direction is not renormalized, so hit distances stay in the units of the source ray.
+// 1/d and the direction signs are computed once here for all the slab tests of a query.
+struct FastRay {
+  Float_t o[3], d[3], inv_d[3];
+  int sign[3]; // 1 where the direction is negative: the ray enters a box through its max side
+
+  FastRay(const Float_t *origin, const Float_t *direction) { set(origin, direction); }
+  template <typename T>
+  explicit FastRay(const Ray3<T> &ray) {
+    const Float_t origin[3] = {value_of(ray.o.x), value_of(ray.o.y), value_of(ray.o.z)};
+    const Float_t direction[3] = {value_of(ray.d.x), value_of(ray.d.y), value_of(ray.d.z)};
+    set(origin, direction);
+  }
+
+  void set(const Float_t *origin, const Float_t *direction) {
+    for (int a = 0; a < 3; a++) {
+      o[a] = origin[a];
+      d[a] = direction[a];
+      inv_d[a] = 1.0 / d[a];
+      sign[a] = inv_d[a] < 0;
+    }
+  }
+};
+
+struct AABB {
+  Float_t min[3] = { std::numeric_limits<Float_t>::max(),  std::numeric_limits<Float_t>::max(),  std::numeric_limits<Float_t>::max()};
+  Float_t max[3] = {-std::numeric_limits<Float_t>::max(), -std::numeric_limits<Float_t>::max(), -std::numeric_limits<Float_t>::max()};
+
+  void extend(const Float_t *p) {
+    for (int a = 0; a < 3; a++) {
+      min[a] = std::min(min[a], p[a]);
+      max[a] = std::max(max[a], p[a]);
+    }
+  }
+  // Union, an empty other (min above max) leaves the box unchanged
+  void extend(const AABB &other) {
+    for (int a = 0; a < 3; a++) {
+      min[a] = std::min(min[a], other.min[a]);
+      max[a] = std::max(max[a], other.max[a]);
+    }
+  }
+
+  Float_t centroid(int axis) const { return 0.5 * (min[axis] + max[axis]); }
+  bool empty() const { return min[0] > max[0]; }
+  Float_t area() const {
+    if (empty()) return 0.0;
+    const Float_t dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+    return 2.0 * (dx * dy + dy * dz + dz * dx);
+  }
+
+  // Slab test, tnear is the entry distance if the ray hits the box before tmax
+  bool intersect(const FastRay &ray, Float_t tmax, Float_t &tnear) const {
+    const Float_t *sides[2] = {min, max};
+    Float_t t0 = 0.0, t1 = tmax;
+    for (int a = 0; a < 3; a++) {
+      const Float_t tn = (sides[ray.sign[a]][a] - ray.o[a]) * ray.inv_d[a];
+      const Float_t tf = (sides[1 - ray.sign[a]][a] - ray.o[a]) * ray.inv_d[a];
+      t0 = tn > t0 ? tn : t0;
+      t1 = tf < t1 ? tf : t1;
+    }
+    tnear = t0;
+    return t0 <= t1;
+  }
+};
+
+// https://link.springer.com/content/pdf/10.1007/978-1-4842-4427-2_7.pdf#0004286892.INDD%3AAnchor%2019%3A19
+// Same robust quadratic as Sphere::surface, on plain floats and unit ray directions.
+// Only reports hits closer than t, which is then updated.
+inline bool intersectSphere(const FastRay &ray, const Float_t *center, Float_t radius, Float_t &t) {
+  const Float_t f[3] = {ray.o[0] - center[0], ray.o[1] - center[1], ray.o[2] - center[2]};
+
+  const Float_t b = -(f[0] * ray.d[0] + f[1] * ray.d[1] + f[2] * ray.d[2]);
+  const Float_t c = f[0] * f[0] + f[1] * f[1] + f[2] * f[2] - radius * radius;
+
+  const Float_t l[3] = {f[0] + ray.d[0] * b, f[1] + ray.d[1] * b, f[2] + ray.d[2] * b};
+  const Float_t d = radius * radius - (l[0] * l[0] + l[1] * l[1] + l[2] * l[2]);
+
+  if (d < 0) return false;
+
+  const Float_t q = b + (b >= 0 ? 1.0 : -1.0) * std::sqrt(d);
+
+  Float_t t0 = c / q;
+  Float_t t1 = q;
+
+  if (t1 < t0) std::swap(t0, t1);
+  if (t1 <= 0) return false;
+
+  const Float_t t_hit = t0 <= 0 ? t1 : t0;
+  if (t_hit >= t) return false;
+
+  t = t_hit;
+  return true;
+}
+
+// Möller–Trumbore on plain floats, see Triangle::surfaceT for the derivation. Takes the
+// triangle as v0 and its precomputed edges e1 = v1 - v0, e2 = v2 - v0.
+// Only reports hits closer than t, which is then updated.
+inline bool intersectTriangle(const FastRay &ray, const Float_t *v0, const Float_t *e1, const Float_t *e2, Float_t &t) {
+  const Float_t eps = std::numeric_limits<Float_t>::epsilon();
+
+  const Float_t ray_x_e2[3] = {ray.d[1] * e2[2] - ray.d[2] * e2[1],
+                               ray.d[2] * e2[0] - ray.d[0] * e2[2],
+                               ray.d[0] * e2[1] - ray.d[1] * e2[0]};
+  const Float_t det = e1[0] * ray_x_e2[0] + e1[1] * ray_x_e2[1] + e1[2] * ray_x_e2[2];
+  if (det > -eps && det < eps) return false;
+
+  const Float_t inv_det = 1.0 / det;
+  const Float_t b[3] = {ray.o[0] - v0[0], ray.o[1] - v0[1], ray.o[2] - v0[2]};
+
+  const Float_t u = (b[0] * ray_x_e2[0] + b[1] * ray_x_e2[1] + b[2] * ray_x_e2[2]) * inv_det;
+  if (u < 0.0 || u > 1.0) return false;
+
+  const Float_t ray_x_e1[3] = {b[1] * e1[2] - b[2] * e1[1],
+                               b[2] * e1[0] - b[0] * e1[2],
+                               b[0] * e1[1] - b[1] * e1[0]};
+  const Float_t v = (ray.d[0] * ray_x_e1[0] + ray.d[1] * ray_x_e1[1] + ray.d[2] * ray_x_e1[2]) * inv_det;
+  if (v < 0.0 || u + v > 1.0) return false;
+
+  const Float_t t_hit = (e2[0] * ray_x_e1[0] + e2[1] * ray_x_e1[1] + e2[2] * ray_x_e1[2]) * inv_det;
+  if (t_hit < eps || t_hit >= t) return false;
+
+  t = t_hit;
+  return true;
+}
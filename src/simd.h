@@ -0,0 +1,593 @@
+#pragma once
+
+#include "bvh.h"
+#include "bvh_cache.h"
+#include "mapped_file.h"
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+
+// Batched intersection kernels.
+// Primitives are stored W at a time in SoA layout and every lane runs the same
+// branchless math, written as plain fixed-length loops that the compiler turns
+// into vector instructions (-O3 -march=native). Results match the scalar tests
+// in rtmath.h / objects.cc.
+
+// Lanes per batch: one 256-bit (AVX2) register of Float_t
+constexpr int SIMD_WIDTH = 32 / sizeof(Float_t);
+
+// W triangles precomputed as (v0, e1, e2), so nothing is derived per ray
+template <int W>
+struct alignas(64) TrianglePacket {
+  static constexpr int width = W;
+
+  Float_t v0[3][W] = {}, e1[3][W] = {}, e2[3][W] = {};
+  uint32_t prim[W] = {};
+  int count = 0;
+
+  void set(int lane, uint32_t id, const Float_t *p0, const Float_t *p1, const Float_t *p2) {
+    for (int a = 0; a < 3; a++) {
+      v0[a][lane] = p0[a];
+      e1[a][lane] = p1[a] - p0[a];
+      e2[a][lane] = p2[a] - p0[a];
+    }
+    prim[lane] = id;
+  }
+
+  // Fills t_lane with the hit distance of every lane, or infinity
+  void distances(const FastRay &ray, Float_t tmax, Float_t *t_lane) const {
+    const Float_t eps = std::numeric_limits<Float_t>::epsilon();
+    const Float_t inf = std::numeric_limits<Float_t>::infinity();
+
+    for (int i = 0; i < W; i++) {
+      const Float_t px = ray.d[1] * e2[2][i] - ray.d[2] * e2[1][i];
+      const Float_t py = ray.d[2] * e2[0][i] - ray.d[0] * e2[2][i];
+      const Float_t pz = ray.d[0] * e2[1][i] - ray.d[1] * e2[0][i];
+      const Float_t det = e1[0][i] * px + e1[1][i] * py + e1[2][i] * pz;
+      const Float_t inv_det = 1.0 / det;
+
+      const Float_t bx = ray.o[0] - v0[0][i], by = ray.o[1] - v0[1][i], bz = ray.o[2] - v0[2][i];
+      const Float_t u = (bx * px + by * py + bz * pz) * inv_det;
+
+      const Float_t qx = by * e1[2][i] - bz * e1[1][i];
+      const Float_t qy = bz * e1[0][i] - bx * e1[2][i];
+      const Float_t qz = bx * e1[1][i] - by * e1[0][i];
+      const Float_t v = (ray.d[0] * qx + ray.d[1] * qy + ray.d[2] * qz) * inv_det;
+      const Float_t t = (e2[0][i] * qx + e2[1][i] * qy + e2[2][i] * qz) * inv_det;
+
+      const bool hit = i < count && (det <= -eps || det >= eps) &&
+                       u >= 0.0 && u <= 1.0 && v >= 0.0 && u + v <= 1.0 && t >= eps && t < tmax;
+      t_lane[i] = hit ? t : inf;
+    }
+  }
+
+  // Closest hit closer than t, which is then updated. Returns the lane or -1
+  int intersect(const FastRay &ray, Float_t &t) const {
+    Float_t t_lane[W];
+    distances(ray, t, t_lane);
+
+    int best = -1;
+    for (int i = 0; i < W; i++) {
+      if (t_lane[i] < t) {
+        t = t_lane[i];
+        best = i;
+      }
+    }
+    return best;
+  }
+
+  bool occluded(const FastRay &ray, Float_t tmax) const {
+    Float_t t_lane[W];
+    distances(ray, tmax, t_lane);
+
+    bool any = false;
+    for (int i = 0; i < W; i++) any |= t_lane[i] < tmax;
+    return any;
+  }
+};
+
+// W spheres, same robust quadratic as Sphere::closestHit (unit ray directions)
+template <int W>
+struct alignas(64) SpherePacket {
+  static constexpr int width = W;
+
+  Float_t c[3][W] = {}, r[W] = {};
+  uint32_t prim[W] = {};
+  int count = 0;
+
+  void set(int lane, uint32_t id, const Float_t *center, Float_t radius) {
+    for (int a = 0; a < 3; a++) c[a][lane] = center[a];
+    r[lane] = radius;
+    prim[lane] = id;
+  }
+
+  void distances(const FastRay &ray, Float_t tmax, Float_t *t_lane) const {
+    const Float_t inf = std::numeric_limits<Float_t>::infinity();
+
+    for (int i = 0; i < W; i++) {
+      const Float_t fx = ray.o[0] - c[0][i], fy = ray.o[1] - c[1][i], fz = ray.o[2] - c[2][i];
+      const Float_t b = -(fx * ray.d[0] + fy * ray.d[1] + fz * ray.d[2]);
+      const Float_t cc = fx * fx + fy * fy + fz * fz - r[i] * r[i];
+
+      const Float_t lx = fx + ray.d[0] * b, ly = fy + ray.d[1] * b, lz = fz + ray.d[2] * b;
+      const Float_t d = r[i] * r[i] - (lx * lx + ly * ly + lz * lz);
+
+      const Float_t q = b + std::copysign(std::sqrt(std::max(d, (Float_t)0.0)), b);
+      const Float_t t0 = std::min(cc / q, q);
+      const Float_t t1 = std::max(cc / q, q);
+      const Float_t t = t0 <= 0 ? t1 : t0;
+
+      const bool hit = i < count && d >= 0 && t1 > 0 && t < tmax;
+      t_lane[i] = hit ? t : inf;
+    }
+  }
+
+  int intersect(const FastRay &ray, Float_t &t) const {
+    Float_t t_lane[W];
+    distances(ray, t, t_lane);
+
+    int best = -1;
+    for (int i = 0; i < W; i++) {
+      if (t_lane[i] < t) {
+        t = t_lane[i];
+        best = i;
+      }
+    }
+    return best;
+  }
+
+  bool occluded(const FastRay &ray, Float_t tmax) const {
+    Float_t t_lane[W];
+    distances(ray, tmax, t_lane);
+
+    bool any = false;
+    for (int i = 0; i < W; i++) any |= t_lane[i] < tmax;
+    return any;
+  }
+};
+
+// Rays per packet for coherent (camera) rays, a 4x4 pixel tile
+constexpr int PACKET_SIZE = 16;
+
+// W rays in SoA layout, for testing many rays against one primitive or box
+template <int W>
+struct alignas(64) RayPacket {
+  static constexpr int width = W;
+
+  Float_t o[3][W], d[3][W], inv_d[3][W];
+  int count = 0;
+
+  // Interval bounds over all rays, valid if `coherent` (every axis has one direction sign)
+  bool coherent = false;
+  Float_t o_lo[3], o_hi[3], inv_lo[3], inv_hi[3];
+
+  void set(int lane, const FastRay &ray) {
+    for (int a = 0; a < 3; a++) {
+      o[a][lane] = ray.o[a];
+      d[a][lane] = ray.d[a];
+      inv_d[a][lane] = ray.inv_d[a];
+    }
+  }
+
+  void add(const FastRay &ray) { set(count++, ray); }
+  FastRay ray(int lane) const {
+    const Float_t origin[3] = {o[0][lane], o[1][lane], o[2][lane]};
+    const Float_t direction[3] = {d[0][lane], d[1][lane], d[2][lane]};
+    return FastRay(origin, direction);
+  }
+  uint32_t lanes() const { return count >= 32 ? ~0u : (1u << count) - 1; }
+
+  // Call once all rays are added: pads the unused lanes with the first ray and computes the
+  // interval bounds
+  void prepare() {
+    for (int i = count; i < W; i++) set(i, ray(0));
+
+    coherent = count > 0;
+    for (int a = 0; a < 3; a++) {
+      o_lo[a] = o_hi[a] = o[a][0];
+      inv_lo[a] = inv_hi[a] = inv_d[a][0];
+      for (int i = 1; i < count; i++) {
+        o_lo[a] = std::min(o_lo[a], o[a][i]);
+        o_hi[a] = std::max(o_hi[a], o[a][i]);
+        inv_lo[a] = std::min(inv_lo[a], inv_d[a][i]);
+        inv_hi[a] = std::max(inv_hi[a], inv_d[a][i]);
+      }
+      coherent &= std::isfinite(inv_lo[a]) && std::isfinite(inv_hi[a]) && (inv_lo[a] > 0) == (inv_hi[a] > 0);
+    }
+  }
+
+  // Lanes of active whose ray enters box before its tmax, tnear gets the closest entry among
+  // them. Coherent packets first try to cull the box for all rays at once with interval
+  // arithmetic (Boulos et al. 2006).
+  uint32_t intersect(const AABB &box, const Float_t *tmax, uint32_t active, Float_t &tnear) const {
+    tnear = std::numeric_limits<Float_t>::max();
+    if (coherent) {
+      Float_t t0 = 0.0, t1 = 0.0;
+      for (int i = 0; i < W; i++) t1 = ((active >> i) & 1) && tmax[i] > t1 ? tmax[i] : t1;
+
+      for (int a = 0; a < 3; a++) {
+        const bool positive = inv_lo[a] > 0;
+        const Float_t near = positive ? box.min[a] : box.max[a];
+        const Float_t far = positive ? box.max[a] : box.min[a];
+        // Smallest possible entry and largest possible exit over every origin/direction pair
+        const Float_t tn[4] = {(near - o_lo[a]) * inv_lo[a], (near - o_lo[a]) * inv_hi[a],
+                               (near - o_hi[a]) * inv_lo[a], (near - o_hi[a]) * inv_hi[a]};
+        const Float_t tf[4] = {(far - o_lo[a]) * inv_lo[a], (far - o_lo[a]) * inv_hi[a],
+                               (far - o_hi[a]) * inv_lo[a], (far - o_hi[a]) * inv_hi[a]};
+        t0 = std::max(t0, std::min({tn[0], tn[1], tn[2], tn[3]}));
+        t1 = std::min(t1, std::max({tf[0], tf[1], tf[2], tf[3]}));
+      }
+      if (t0 > t1) return 0;
+    }
+
+    // Same slab test as AABB::intersect, per lane
+    bool hit[W];
+    Float_t t_lane[W];
+    for (int i = 0; i < W; i++) {
+      Float_t t0 = 0.0, t1 = tmax[i];
+      for (int a = 0; a < 3; a++) {
+        const Float_t tn = (box.min[a] - o[a][i]) * inv_d[a][i];
+        const Float_t tf = (box.max[a] - o[a][i]) * inv_d[a][i];
+        const Float_t lo = tn > tf ? tf : tn, hi = tn > tf ? tn : tf;
+        t0 = lo > t0 ? lo : t0;
+        t1 = hi < t1 ? hi : t1;
+      }
+      hit[i] = t0 <= t1;
+      t_lane[i] = t0;
+    }
+
+    uint32_t mask = 0;
+    for (int i = 0; i < W; i++) {
+      if (hit[i] && ((active >> i) & 1)) {
+        mask |= 1u << i;
+        tnear = std::min(tnear, t_lane[i]);
+      }
+    }
+    return mask;
+  }
+
+  // Tests every ray against triangle `lane` of a packet, t[i] shrinks where a ray hits it.
+  // Returns the mask of rays that got a closer hit.
+  template <int V>
+  uint32_t intersect(const TrianglePacket<V> &tris, int lane, Float_t *t) const {
+    const Float_t eps = std::numeric_limits<Float_t>::epsilon();
+    const Float_t v0[3] = {tris.v0[0][lane], tris.v0[1][lane], tris.v0[2][lane]};
+    const Float_t e1[3] = {tris.e1[0][lane], tris.e1[1][lane], tris.e1[2][lane]};
+    const Float_t e2[3] = {tris.e2[0][lane], tris.e2[1][lane], tris.e2[2][lane]};
+
+    bool hit[W];
+    for (int i = 0; i < W; i++) {
+      const Float_t px = d[1][i] * e2[2] - d[2][i] * e2[1];
+      const Float_t py = d[2][i] * e2[0] - d[0][i] * e2[2];
+      const Float_t pz = d[0][i] * e2[1] - d[1][i] * e2[0];
+      const Float_t det = e1[0] * px + e1[1] * py + e1[2] * pz;
+      const Float_t inv_det = 1.0 / det;
+
+      const Float_t bx = o[0][i] - v0[0], by = o[1][i] - v0[1], bz = o[2][i] - v0[2];
+      const Float_t u = (bx * px + by * py + bz * pz) * inv_det;
+
+      const Float_t qx = by * e1[2] - bz * e1[1];
+      const Float_t qy = bz * e1[0] - bx * e1[2];
+      const Float_t qz = bx * e1[1] - by * e1[0];
+      const Float_t v = (d[0][i] * qx + d[1][i] * qy + d[2][i] * qz) * inv_det;
+      const Float_t t_hit = (e2[0] * qx + e2[1] * qy + e2[2] * qz) * inv_det;
+
+      hit[i] = (det <= -eps || det >= eps) &&
+               u >= 0.0 && u <= 1.0 && v >= 0.0 && u + v <= 1.0 && t_hit >= eps && t_hit < t[i];
+      t[i] = hit[i] ? t_hit : t[i];
+    }
+
+    uint32_t mask = 0;
+    for (int i = 0; i < W; i++) mask |= (uint32_t)hit[i] << i;
+    return mask;
+  }
+};
+
+// BVH whose leaves are stored as packets, so each visited leaf is tested W primitives at a time.
+// Leaves hold at most W primitives (more only past the depth limit, they then span several packets).
+// With `compressed` set, the float nodes are replaced by 8-bit quantized ones after packing.
+// Traversal reads through plain pointers, either into the vectors below or into a mapped
+// cache file (see bvh_cache.h), so a cached hierarchy is used without copying it.
+template <typename Packet>
+class PacketBVH {
+  static constexpr int W = Packet::width;
+
+  public:
+    PacketBVH() = default;
+    // Moving keeps the vector buffers, hence the pointers, copying would not
+    PacketBVH(PacketBVH &&) = default;
+    PacketBVH &operator=(PacketBVH &&) = default;
+    PacketBVH(const PacketBVH &) = delete;
+    PacketBVH &operator=(const PacketBVH &) = delete;
+
+    // fill(packet, lane, prim) stores primitive prim in the given lane
+    template <typename F>
+    void build(const std::vector<AABB> &prim_bounds, F &&fill) {
+      bvh.build(prim_bounds, W);
+      n_prims = prim_bounds.size();
+      pack(fill);
+    }
+
+    // Compressed or mapped hierarchies have no float nodes to refit, so they are rebuilt
+    template <typename F>
+    void refit(const std::vector<AABB> &prim_bounds, F &&fill) {
+      if (compressed || mapping) return build(prim_bounds, fill);
+      bvh.refit(prim_bounds);
+      pack(fill);
+    }
+
+    bool empty() const { return n_nodes == 0; }
+    // Whether traversal reads a cache file mapped by load()
+    bool mapped() const { return mapping != nullptr; }
+    AABB bounds() const { return root; }
+    size_t size() const { return n_prims; }
+
+    // Closest hit closer than t, returns the primitive in prim
+    bool intersect(const FastRay &ray, Float_t &t, uint32_t &prim) const {
+      if (empty()) return false;
+
+      bool found = false;
+      const auto leaf = [&](uint32_t node) {
+        for (uint32_t p = leaf_data[node]; p < leaf_data[node + 1]; p++) {
+          const int lane = packet_data[p].intersect(ray, t);
+          if (lane >= 0) {
+            prim = packet_data[p].prim[lane];
+            found = true;
+          }
+        }
+      };
+
+      if (compressed) QBVH::traverse(qnode_data, root, ray, t, leaf);
+      else BVH::traverse(node_data, ray, t, leaf);
+      return found;
+    }
+
+    // Closest hits for a packet of rays, t and prim hold one entry per lane. Returns the
+    // lanes that got a closer hit; it may include lanes outside active, whose hits are
+    // just as valid. Compressed hierarchies trace the rays one by one.
+    template <int R>
+    uint32_t intersect(const RayPacket<R> &rays, uint32_t active, Float_t *t, uint32_t *prim) const {
+      if (empty()) return 0;
+
+      uint32_t found = 0;
+      if (compressed) {
+        for (int i = 0; i < R; i++)
+          if (((active >> i) & 1) && intersect(rays.ray(i), t[i], prim[i])) found |= 1u << i;
+        return found;
+      }
+
+      BVH::traversePacket(node_data, rays, t, active, [&](uint32_t node, uint32_t mask) {
+        for (uint32_t p = leaf_data[node]; p < leaf_data[node + 1]; p++) {
+          const Packet &packet = packet_data[p];
+
+          // All rays against one primitive at a time pays off only if enough rays got here,
+          // otherwise each ray takes the whole packet of primitives at once
+          if (__builtin_popcount(mask) * W < packet.count * R) {
+            for (uint32_t m = mask; m != 0; m &= m - 1) {
+              const int i = __builtin_ctz(m);
+              const int lane = packet.intersect(rays.ray(i), t[i]);
+              if (lane >= 0) {
+                prim[i] = packet.prim[lane];
+                found |= 1u << i;
+              }
+            }
+            continue;
+          }
+
+          for (int lane = 0; lane < packet.count; lane++) {
+            uint32_t hits = rays.intersect(packet, lane, t);
+            found |= hits;
+            for (; hits != 0; hits &= hits - 1) prim[__builtin_ctz(hits)] = packet.prim[lane];
+          }
+        }
+      });
+      return found;
+    }
+
+    bool occluded(const FastRay &ray, Float_t tmax) const {
+      if (empty()) return false;
+
+      const auto leaf = [&](uint32_t node) {
+        for (uint32_t p = leaf_data[node]; p < leaf_data[node + 1]; p++)
+          if (packet_data[p].occluded(ray, tmax)) return true;
+        return false;
+      };
+
+      return compressed ? QBVH::traverseAny(qnode_data, root, ray, tmax, leaf)
+                        : BVH::traverseAny(node_data, ray, tmax, leaf);
+    }
+
+    // Writes the hierarchy to a cache file for geometry hashed to key. Returns false on failure
+    bool save(const std::string &filename, uint64_t key) const {
+      BVHCacheHeader header = {};
+      std::memcpy(header.magic, "DIFFRTBV", 8);
+      header.version = BVH_CACHE_VERSION;
+      header.float_size = sizeof(Float_t);
+      header.node_size = compressed ? sizeof(QBVHNode) : sizeof(BVHNode);
+      header.packet_size = sizeof(Packet);
+      header.packet_width = W;
+      header.compressed = compressed;
+      header.key = key;
+      header.n_prims = n_prims;
+      header.n_nodes = n_nodes;
+      header.n_packets = n_packets;
+      header.root = root;
+
+      const char *nodes = compressed ? (const char *)qnode_data : (const char *)node_data;
+      const struct { const char *data; size_t size; } sections[] = {
+        {nodes, n_nodes * header.node_size},
+        {(const char *)leaf_data, (n_nodes + 1) * sizeof(uint32_t)},
+        {(const char *)packet_data, n_packets * sizeof(Packet)},
+      };
+
+      // Written next to the target and renamed, so concurrent jobs never map a partial file
+      const std::string tmp = filename + ".tmp" + std::to_string(getpid());
+      std::ofstream file(tmp, std::ios::binary);
+      if (!file) {
+        std::cerr << "Error writing BVH cache: " << tmp << std::endl;
+        return false;
+      }
+
+      const char zeros[BVH_CACHE_ALIGN] = {};
+      size_t offset = sizeof(header);
+      file.write((const char *)&header, sizeof(header));
+      for (const auto &section : sections) {
+        file.write(zeros, cacheAlign(offset) - offset);
+        file.write(section.data, section.size);
+        offset = cacheAlign(offset) + section.size;
+      }
+      file.close();
+
+      if (!file || std::rename(tmp.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Error writing BVH cache: " << filename << std::endl;
+        std::remove(tmp.c_str());
+        return false;
+      }
+      return true;
+    }
+
+    // Maps a cache file written by save(). Returns false (leaving the hierarchy untouched)
+    // if there is no such file, it was written for other geometry or another build, or any
+    // index in it (child, leaf range, primitive) is out of range: a stale or corrupt file is
+    // rebuilt by the caller instead of traversed. n_prims is the primitive count of the
+    // geometry, the hits report primitives below it.
+    bool load(const std::string &filename, uint64_t key, size_t n_prims_) {
+      if (access(filename.c_str(), R_OK) != 0) return false;
+
+      auto file = std::make_shared<MappedFile>(filename, MADV_WILLNEED);
+      if (!file->valid() || file->size() < sizeof(BVHCacheHeader)) return false;
+
+      BVHCacheHeader header;
+      std::memcpy(&header, file->data(), sizeof(header));
+      if (std::memcmp(header.magic, "DIFFRTBV", 8) != 0 || header.version != BVH_CACHE_VERSION ||
+          header.float_size != sizeof(Float_t) || header.packet_size != sizeof(Packet) ||
+          header.packet_width != W || header.compressed != compressed || header.key != key ||
+          header.node_size != (compressed ? sizeof(QBVHNode) : sizeof(BVHNode)) || header.n_prims != n_prims_)
+        return false;
+
+      // Counts past the file size would overflow the offsets below
+      if (header.n_nodes > file->size() || header.n_packets > file->size()) {
+        std::cerr << "Corrupt BVH cache: " << filename << std::endl;
+        return false;
+      }
+      const size_t nodes_offset = cacheAlign(sizeof(header));
+      const size_t leaf_offset = cacheAlign(nodes_offset + header.n_nodes * header.node_size);
+      const size_t packets_offset = cacheAlign(leaf_offset + (header.n_nodes + 1) * sizeof(uint32_t));
+      if (file->size() < packets_offset + header.n_packets * sizeof(Packet)) {
+        std::cerr << "Truncated BVH cache: " << filename << std::endl;
+        return false;
+      }
+
+      const char *base = file->data();
+      if (!valid(header, base + nodes_offset, (const uint32_t *)(base + leaf_offset), (const Packet *)(base + packets_offset))) {
+        std::cerr << "Corrupt BVH cache: " << filename << std::endl;
+        return false;
+      }
+
+      bvh = BVH();
+      qbvh = QBVH();
+      packets.clear();
+      leaf_packets.clear();
+
+      node_data = (const BVHNode *)(base + nodes_offset);
+      qnode_data = (const QBVHNode *)(base + nodes_offset);
+      leaf_data = (const uint32_t *)(base + leaf_offset);
+      packet_data = (const Packet *)(base + packets_offset);
+      n_prims = header.n_prims;
+      n_nodes = header.n_nodes;
+      n_packets = header.n_packets;
+      root = header.root;
+      mapping = std::move(file);
+      return true;
+    }
+
+  private:
+    // Whether traversal stays in bounds on mapped arrays: children come after their parent
+    // (so there are no cycles) and inside the node array, deep enough trees still fit the
+    // 64-entry traversal stacks, leaf ranges are ordered and inside the packet array, and
+    // packets hold at most W primitives, all below the primitive count
+    static bool valid(const BVHCacheHeader &header, const char *nodes, const uint32_t *leaf, const Packet *packet) {
+      const size_t n_nodes = header.n_nodes, n_packets = header.n_packets;
+      if (n_nodes == 0) return header.n_prims == 0 && n_packets == 0;
+
+      std::vector<uint8_t> depth(n_nodes, 0);
+      for (size_t i = 0; i < n_nodes; i++) {
+        uint32_t left, count;
+        if (header.compressed) {
+          const QBVHNode &node = ((const QBVHNode *)nodes)[i];
+          left = node.left_first;
+          count = node.count;
+        } else {
+          const BVHNode &node = ((const BVHNode *)nodes)[i];
+          left = node.left_first;
+          count = node.count;
+        }
+        if (leaf[i] > leaf[i + 1] || leaf[i + 1] > n_packets) return false;
+        if (count > 0) continue;
+
+        if (left <= i || size_t(left) + 1 >= n_nodes || depth[i] >= 62) return false;
+        depth[left] = std::max<uint8_t>(depth[left], depth[i] + 1);
+        depth[left + 1] = std::max<uint8_t>(depth[left + 1], depth[i] + 1);
+      }
+
+      for (size_t p = 0; p < n_packets; p++) {
+        if (packet[p].count < 0 || packet[p].count > W) return false;
+        for (int lane = 0; lane < packet[p].count; lane++)
+          if (packet[p].prim[lane] >= header.n_prims) return false;
+      }
+      return true;
+    }
+
+    template <typename F>
+    void pack(F &&fill) {
+      packets.clear();
+      leaf_packets.resize(bvh.nodes.size() + 1);
+
+      // Packets are appended in node order, so the packets of node i end where those of node i + 1 begin
+      for (size_t node = 0; node < bvh.nodes.size(); node++) {
+        const BVHNode &leaf = bvh.nodes[node];
+        leaf_packets[node] = packets.size();
+
+        for (uint32_t i = 0; i < leaf.count; i++) {
+          if (i % W == 0) packets.emplace_back();
+          Packet &packet = packets.back();
+          fill(packet, packet.count++, bvh.indices[leaf.left_first + i]);
+        }
+      }
+      leaf_packets.back() = packets.size();
+
+      if (compressed) {
+        qbvh.compress(bvh);
+        bvh = BVH(); // Packets hold the primitive IDs, the float nodes are not needed anymore
+      } else {
+        qbvh = QBVH();
+      }
+
+      mapping.reset();
+      node_data = bvh.nodes.data();
+      qnode_data = qbvh.nodes.data();
+      leaf_data = leaf_packets.data();
+      packet_data = packets.data();
+      n_nodes = compressed ? qbvh.nodes.size() : bvh.nodes.size();
+      n_packets = packets.size();
+      root = compressed ? qbvh.bounds() : bvh.bounds();
+    }
+
+  public:
+    bool compressed = false;
+    BVH bvh;
+    QBVH qbvh;
+    std::vector<Packet> packets;
+    std::vector<uint32_t> leaf_packets; // Packets of node i are [leaf_packets[i], leaf_packets[i + 1])
+
+  private:
+    // What traversal reads, into the members above or into `mapping`
+    const BVHNode *node_data = nullptr;
+    const QBVHNode *qnode_data = nullptr;
+    const uint32_t *leaf_data = nullptr;
+    const Packet *packet_data = nullptr;
+    size_t n_prims = 0, n_nodes = 0, n_packets = 0;
+    AABB root;
+    std::shared_ptr<MappedFile> mapping;
+};
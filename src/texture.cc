@@ -0,0 +1,198 @@
+#include "texture.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+Texture::Texture(int width_, int height_, const std::vector<Float_t> &rgb)
+    : width(width_), height(height_) {
+  if (width <= 0 || height <= 0 || rgb.size() != size_t(width) * height * 3) {
+    std::cerr << "Texture size does not match its texels." << std::endl;
+    exit(1);
+  }
+  build(rgb);
+}
+
+// Position of texel (x, y) in a level tiles_x tiles wide: 4x4 tiles in row-major order,
+// Morton order inside a tile
+inline static size_t tiledIndex(int x, int y, int tiles_x) {
+  const uint32_t morton = (x & 1) | (y & 1) << 1 | (x & 2) << 1 | (y & 2) << 2;
+  return (size_t(y >> 2) * tiles_x + (x >> 2)) * 16 + morton;
+}
+
+inline static int wrap(int i, int n) {
+  i %= n;
+  return i < 0 ? i + n : i;
+}
+
+Vec3f Texture::Level::texel(int x, int y) const {
+  const Float_t *rgb = &texels[3 * tiledIndex(wrap(x, width), wrap(y, height), tiles_x)];
+  return Vec3f(rgb[0], rgb[1], rgb[2]);
+}
+
+void Texture::build(std::vector<Float_t> rgb) {
+  average = Vec3f(0, 0, 0);
+  for (size_t i = 0; i < rgb.size(); i += 3) average = average + Vec3f(rgb[i], rgb[i + 1], rgb[i + 2]);
+  average = average / Float_t(size_t(width) * height);
+
+  levels.clear();
+  int w = width, h = height;
+  while (true) {
+    Level level;
+    level.width = w;
+    level.height = h;
+    level.tiles_x = (w + 3) / 4;
+    level.texels.resize(size_t(level.tiles_x) * ((h + 3) / 4) * 16 * 3);
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < w; x++)
+        std::memcpy(&level.texels[3 * tiledIndex(x, y, level.tiles_x)], &rgb[3 * (size_t(y) * w + x)], 3 * sizeof(Float_t));
+    levels.push_back(std::move(level));
+    if (w == 1 && h == 1) break;
+
+    // Next level, 2x2 box filter (the last row or column of an odd size is dropped)
+    const int nw = std::max(1, w / 2), nh = std::max(1, h / 2);
+    std::vector<Float_t> next(size_t(nw) * nh * 3);
+    for (int y = 0; y < nh; y++) {
+      for (int x = 0; x < nw; x++) {
+        const int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+        const int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+        for (int c = 0; c < 3; c++)
+          next[3 * (size_t(y) * nw + x) + c] = 0.25f * (rgb[3 * (size_t(y0) * w + x0) + c] + rgb[3 * (size_t(y0) * w + x1) + c] +
+                                                        rgb[3 * (size_t(y1) * w + x0) + c] + rgb[3 * (size_t(y1) * w + x1) + c]);
+      }
+    }
+    rgb.swap(next);
+    w = nw;
+    h = nh;
+  }
+}
+
+Vec3f Texture::bilinear(const Level &level, Float_t u, Float_t v) {
+  // Texel centers sit at half-integer coordinates, row 0 at the top (v = 1)
+  const Float_t x = u * level.width - 0.5f, y = (1 - v) * level.height - 0.5f;
+  const Float_t fx = std::floor(x), fy = std::floor(y);
+  const int x0 = int(fx), y0 = int(fy);
+  const Float_t dx = x - fx, dy = y - fy;
+  return (level.texel(x0, y0) * (1 - dx) + level.texel(x0 + 1, y0) * dx) * (1 - dy) +
+         (level.texel(x0, y0 + 1) * (1 - dx) + level.texel(x0 + 1, y0 + 1) * dx) * dy;
+}
+
+Direction Texture::bilinear(Float_t u, Float_t v) const {
+  const Float_t x = u * width - 0.5f, y = (1 - v) * height - 0.5f;
+  const Float_t fx = std::floor(x), fy = std::floor(y);
+  const int x0 = int(fx), y0 = int(fy);
+  const Float_t dx = x - fx, dy = y - fy;
+  const auto texel = [&](int x, int y) -> const Direction & { return texels[size_t(wrap(y, height)) * width + wrap(x, width)]; };
+  return (texel(x0, y0) * Float(1 - dx) + texel(x0 + 1, y0) * Float(dx)) * Float(1 - dy) +
+         (texel(x0, y0 + 1) * Float(1 - dx) + texel(x0 + 1, y0 + 1) * Float(dx)) * Float(dy);
+}
+
+Vec3f Texture::filtered(const TexCoord &tc) const {
+  // Learnable textures stay on the full-resolution level, like their Float lookups
+  if (!texels.empty()) return bilinear(levels[0], tc.u, tc.v);
+
+  // Level whose texels are as wide as the footprint
+  const Float_t texels_across = tc.width * std::max(width, height);
+  const Float_t lod = texels_across > 1 ? std::min(std::log2(texels_across), Float_t(levels.size() - 1)) : 0.0f;
+  const int level = int(lod);
+  const Float_t f = lod - level;
+
+  const Vec3f value = bilinear(levels[level], tc.u, tc.v);
+  if (f <= 0) return value;
+  return value * (1 - f) + bilinear(levels[level + 1], tc.u, tc.v) * f;
+}
+
+std::vector<Direction> &Texture::learnable() {
+  if (texels.empty()) {
+    texels.reserve(size_t(width) * height);
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        const Vec3f value = levels[0].texel(x, y);
+        texels.emplace_back(value.x, value.y, value.z);
+        texels.back().requires_grad(true);
+      }
+    }
+  }
+  return texels;
+}
+
+void Texture::update() {
+  if (texels.empty()) return;
+
+  std::vector<Float_t> rgb(size_t(width) * height * 3);
+  for (size_t i = 0; i < texels.size(); i++) {
+    rgb[3 * i] = texels[i].x.value();
+    rgb[3 * i + 1] = texels[i].y.value();
+    rgb[3 * i + 2] = texels[i].z.value();
+  }
+  build(std::move(rgb));
+}
+
+// PFM
+
+inline static const char *skipSpace(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+  return p;
+}
+
+template <typename T>
+inline static const char *parseToken(const char *p, const char *end, T &out) {
+  p = skipSpace(p, end);
+  const auto [ptr, ec] = std::from_chars(p, end, out);
+  return ec == std::errc() ? ptr : nullptr;
+}
+
+bool readPFM(const std::string &filename, int &width, int &height, std::vector<Float_t> &rgb) {
+  MappedFile file(filename);
+  if (!file.valid()) return false;
+
+  const char *p = file.data();
+  const char *end = file.data() + file.size();
+
+  // "PF" or "Pf", width height, then the scale: its sign gives the endianness (negative is
+  // little endian) and its magnitude multiplies the values. One whitespace before the data
+  int channels = 0;
+  if (end - p >= 2 && p[0] == 'P') channels = p[1] == 'F' ? 3 : p[1] == 'f' ? 1 : 0;
+  Float_t scale = 0;
+  if (channels == 0 ||
+      (p = parseToken(p + 2, end, width)) == nullptr ||
+      (p = parseToken(p, end, height)) == nullptr ||
+      (p = parseToken(p, end, scale)) == nullptr ||
+      p == end || width <= 0 || height <= 0 || scale == 0) {
+    std::cerr << "Error parsing PFM header: " << filename << std::endl;
+    return false;
+  }
+  p++;
+
+  // Each dimension is bounded by the data before they are multiplied, so the size can not wrap
+  const size_t texel_bytes = channels * sizeof(float), available = end - p;
+  if (size_t(width) > available / texel_bytes || size_t(height) > available / texel_bytes / width) {
+    std::cerr << "Truncated PFM file: " << filename << std::endl;
+    return false;
+  }
+
+  // Rows are stored bottom to top
+  rgb.resize(size_t(width) * height * 3);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int c = 0; c < 3; c++) {
+        char bytes[sizeof(float)];
+        std::memcpy(bytes, p + ((size_t(height - 1 - y) * width + x) * channels + c % channels) * sizeof(float), sizeof(float));
+        if (scale > 0) std::reverse(bytes, bytes + sizeof(float));
+
+        float value;
+        std::memcpy(&value, bytes, sizeof(float));
+        rgb[(size_t(y) * width + x) * 3 + c] = value * std::abs(scale);
+      }
+    }
+  }
+  return true;
+}
+
+std::shared_ptr<Texture> loadTexture(const std::string &filename) {
+  int width, height;
+  std::vector<Float_t> rgb;
+  if (!readPFM(filename, width, height, rgb)) return nullptr;
+  return std::make_shared<Texture>(width, height, rgb);
+}
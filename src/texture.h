@@ -0,0 +1,71 @@
+#pragma once
+
+#include "rtmath.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// Where a texture is read: UV coordinates and the width of the ray footprint in UV units,
+// which selects the MIP level
+struct TexCoord {
+  Float_t u, v;
+  Float_t width;
+};
+
+// RGB image over UV space: u goes right and v up from the bottom-left corner (the OBJ
+// convention), addressing wraps around. Lookups are trilinear, between the two MIP levels
+// whose texels are closest to the footprint width, so minified lookups read a few
+// neighbouring texels of a small level instead of scattering over the full one. Each level
+// is stored in 4x4 tiles, Morton (Z) order inside a tile, so the texels of a bilinear lookup
+// are nearly always in the same tile.
+class Texture {
+  public:
+    // rgb holds width * height texels, row-major with the top row first
+    Texture(int width_, int height_, const std::vector<Float_t> &rgb);
+
+    template <typename T>
+    Vec3<T> lookup(const TexCoord &tc) const {
+      if constexpr (std::is_same_v<T, Float>)
+        if (!texels.empty()) return bilinear(tc.u, tc.v);
+      return Vec3<T>(filtered(tc));
+    }
+
+    // Turns the full-resolution texels into parameters (Floats requiring gradients) and returns
+    // them, row-major, e.g. for optimizer.add_param. From then on lookups are bilinear on that
+    // level whatever the footprint, so every texel a value comes from gets its gradient
+    std::vector<Direction> &learnable();
+
+    // Reads the texel values back from the parameters and rebuilds the MIP levels, if the
+    // texture is learnable. Materials call it when parameter values change (ad::param_epoch)
+    void update();
+
+    // Average of the full-resolution texels, e.g. for the power of a textured emitter
+    const Vec3f &mean() const { return average; }
+
+  public:
+    const int width, height;
+
+  private:
+    struct Level {
+      int width, height;
+      int tiles_x;                 // Width in 4x4 tiles
+      std::vector<Float_t> texels; // r g b, tile after tile
+      Vec3f texel(int x, int y) const; // Wraps around
+    };
+
+    void build(std::vector<Float_t> rgb);
+    Vec3f filtered(const TexCoord &tc) const;
+    static Vec3f bilinear(const Level &level, Float_t u, Float_t v);
+    Direction bilinear(Float_t u, Float_t v) const; // On the parameters
+
+    std::vector<Level> levels;     // Full resolution first, down to 1x1
+    std::vector<Direction> texels; // Parameters, empty unless learnable()
+    Vec3f average;
+};
+
+// Portable float map (.pfm, color "PF" or grayscale "Pf"), either endianness, into row-major
+// rgb with the top row first. On failure the reason is printed and false is returned.
+bool readPFM(const std::string &filename, int &width, int &height, std::vector<Float_t> &rgb);
+
+// Texture from a PFM file, nullptr on failure
+std::shared_ptr<Texture> loadTexture(const std::string &filename);
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "rtmath.h"
+#include <vector>
+
+// Affine transform [A | t], stored row-major as 12 Floats so it can be learned.
+// Points and vectors go through the Float versions when gradients are needed,
+// the acceleration structures use the plain-float ones.
+class Transform {
+  public:
+    Transform() : m{1, 0, 0, 0,
+                    0, 1, 0, 0,
+                    0, 0, 1, 0} {}
+
+    static Transform translate(Float_t x, Float_t y, Float_t z) {
+      Transform tr;
+      tr.m[3] = x; tr.m[7] = y; tr.m[11] = z;
+      return tr;
+    }
+
+    static Transform scale(Float_t x, Float_t y, Float_t z) {
+      Transform tr;
+      tr.m[0] = x; tr.m[5] = y; tr.m[10] = z;
+      return tr;
+    }
+
+    // Rodrigues' rotation, angle in radians
+    static Transform rotate(const Direction &axis, Float_t angle) {
+      const Direction a = axis.normalize();
+      const Float_t x = a.x.value(), y = a.y.value(), z = a.z.value();
+      const Float_t c = std::cos(angle), s = std::sin(angle), t = 1.0 - c;
+
+      Transform tr;
+      tr.m[0] = t * x * x + c;     tr.m[1] = t * x * y - s * z; tr.m[2]  = t * x * z + s * y;
+      tr.m[4] = t * x * y + s * z; tr.m[5] = t * y * y + c;     tr.m[6]  = t * y * z - s * x;
+      tr.m[8] = t * x * z - s * y; tr.m[9] = t * y * z + s * x; tr.m[10] = t * z * z + c;
+      return tr;
+    }
+
+    // Composition, (a * b)(p) = a(b(p))
+    Transform operator*(const Transform &other) const {
+      Transform tr;
+      for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+          Float sum = m[4 * i] * other.m[j] + m[4 * i + 1] * other.m[4 + j] + m[4 * i + 2] * other.m[8 + j];
+          if (j == 3) sum = sum + m[4 * i + 3];
+          tr.m[4 * i + j] = sum;
+        }
+      }
+      return tr;
+    }
+
+    // On plain scalar types the current values are used, without gradients
+    template <typename T>
+    Point3<T> operator()(const Point3<T> &p) const {
+      const Vec3<T> v = vector(p);
+      return Point3<T>(v.x + at<T>(3), v.y + at<T>(7), v.z + at<T>(11));
+    }
+
+    template <typename T>
+    Vec3<T> vector(const Vec3<T> &v) const {
+      return Vec3<T>(at<T>(0) * v.x + at<T>(1) * v.y + at<T>(2)  * v.z,
+                     at<T>(4) * v.x + at<T>(5) * v.y + at<T>(6)  * v.z,
+                     at<T>(8) * v.x + at<T>(9) * v.y + at<T>(10) * v.z);
+    }
+
+    // Normals go through the cofactor matrix (det(A) * A^-T), which maps e1 x e2 of a
+    // triangle to e1' x e2' of the transformed one, orientation included
+    template <typename T>
+    Vec3<T> normal(const Vec3<T> &n) const {
+      const Vec3<T> r0(at<T>(0), at<T>(1), at<T>(2)), r1(at<T>(4), at<T>(5), at<T>(6)), r2(at<T>(8), at<T>(9), at<T>(10));
+      return Vec3<T>(r1.cross(r2).dot(n), r2.cross(r0).dot(n), r0.cross(r1).dot(n));
+    }
+
+    template <typename T>
+    T at(int i) const { return scalar_cast<T>(m[i]); }
+
+    void values(Float_t out[12]) const {
+      for (int i = 0; i < 12; i++) out[i] = m[i].value();
+    }
+
+    // Inverse of the current values, false if the transform is singular
+    bool inverse(Float_t out[12]) const {
+      Float_t a[12];
+      values(a);
+
+      const Float_t c00 = a[5] * a[10] - a[6] * a[9], c01 = a[6] * a[8] - a[4] * a[10], c02 = a[4] * a[9] - a[5] * a[8];
+      const Float_t det = a[0] * c00 + a[1] * c01 + a[2] * c02;
+      if (det == 0.0) return false;
+      const Float_t inv_det = 1.0 / det;
+
+      out[0] = c00 * inv_det;
+      out[1] = (a[2] * a[9] - a[1] * a[10]) * inv_det;
+      out[2] = (a[1] * a[6] - a[2] * a[5]) * inv_det;
+      out[4] = c01 * inv_det;
+      out[5] = (a[0] * a[10] - a[2] * a[8]) * inv_det;
+      out[6] = (a[2] * a[4] - a[0] * a[6]) * inv_det;
+      out[8] = c02 * inv_det;
+      out[9] = (a[1] * a[8] - a[0] * a[9]) * inv_det;
+      out[10] = (a[0] * a[5] - a[1] * a[4]) * inv_det;
+
+      for (int i = 0; i < 3; i++)
+        out[4 * i + 3] = -(out[4 * i] * a[3] + out[4 * i + 1] * a[7] + out[4 * i + 2] * a[11]);
+      return true;
+    }
+
+    static void applyPoint(const Float_t m[12], const Float_t p[3], Float_t out[3]) {
+      for (int i = 0; i < 3; i++)
+        out[i] = m[4 * i] * p[0] + m[4 * i + 1] * p[1] + m[4 * i + 2] * p[2] + m[4 * i + 3];
+    }
+
+    static void applyVector(const Float_t m[12], const Float_t v[3], Float_t out[3]) {
+      for (int i = 0; i < 3; i++)
+        out[i] = m[4 * i] * v[0] + m[4 * i + 1] * v[1] + m[4 * i + 2] * v[2];
+    }
+
+    void requires_grad(bool requires_grad) {
+      for (auto &x : m) x.requires_grad(requires_grad);
+    }
+
+    std::vector<Float> parameters() const { return std::vector<Float>(m, m + 12); }
+
+  public:
+    Float m[12];
+};